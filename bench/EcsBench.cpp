@@ -0,0 +1,431 @@
+#include "Config.h"
+
+#include "Ecs/Ecs.h"
+
+#include "Containers/Array.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <tuple>
+#include <utility>
+
+namespace hs
+{
+
+//------------------------------------------------------------------------------
+struct Position
+{
+    float x_, y_;
+};
+
+//------------------------------------------------------------------------------
+struct Velocity
+{
+    float x_, y_;
+};
+
+//------------------------------------------------------------------------------
+//! Optional components, each combination of them is a separate archetype
+template<int TIdx>
+struct Payload
+{
+    int value_;
+};
+
+//------------------------------------------------------------------------------
+//! Added to every entity by the migration benchmark
+struct Migrated
+{
+    float value_;
+};
+
+//------------------------------------------------------------------------------
+HS_ECS_COMPONENTS(
+    Position,
+    Velocity,
+    Payload<0>,
+    Payload<1>,
+    Payload<2>,
+    Payload<3>,
+    Payload<4>,
+    Migrated
+);
+
+//------------------------------------------------------------------------------
+//! Entities are spread round robin over every combination of the payloads
+static constexpr int PAYLOAD_COUNT{ 5 };
+static constexpr int ARCHETYPE_COUNT{ 1 << PAYLOAD_COUNT };
+//! Every benchmark takes the best of this many runs, each on a fresh world
+static constexpr int ITER_RUNS{ 5 };
+static constexpr int ENTITY_COUNTS[]{ 1000, 100 * 1000, 1000 * 1000 };
+static constexpr float DEFAULT_TOLERANCE{ 0.1f };
+
+//------------------------------------------------------------------------------
+enum BenchId
+{
+    BENCH_CREATE_ENTITY,
+    BENCH_GET_COMPONENT,
+    BENCH_GET_COMPONENTS,
+    BENCH_EACH,
+    BENCH_EACH_EXCEPT,
+    BENCH_SET_COMPONENTS_MIGRATE,
+    BENCH_DELETE_ENTITY,
+    BENCH_DELETE_ENTITY_DEFERRED,
+    BENCH_COUNT
+};
+
+//! Indexed by BenchId
+static constexpr const char* BENCH_NAMES[BENCH_COUNT]{
+    "CreateEntity",
+    "GetComponent",
+    "GetComponents",
+    "Each",
+    "EachExcept",
+    "SetComponentsMigrate",
+    "DeleteEntity",
+    "DeleteEntityDeferred",
+};
+
+//------------------------------------------------------------------------------
+struct BenchResult
+{
+    char name_[64];
+    int entityCount_;
+    double nsPerEntity_;
+};
+
+//------------------------------------------------------------------------------
+class BenchTimer
+{
+public:
+    //------------------------------------------------------------------------------
+    BenchTimer()
+        : start_(std::chrono::steady_clock::now())
+    {
+    }
+
+    //------------------------------------------------------------------------------
+    double ElapsedNs() const
+    {
+        const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start_;
+        return elapsed.count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Keeps results of the lookups alive so the compiler can't drop them
+static volatile float g_Sink;
+
+//------------------------------------------------------------------------------
+template<int TMask, int TIdx>
+static auto OptionalPayload(int value)
+{
+    if constexpr (((TMask >> TIdx) & 1) != 0)
+        return std::tuple<Payload<TIdx>>(Payload<TIdx>{ value });
+    else
+        return std::tuple<>();
+}
+
+//------------------------------------------------------------------------------
+template<int TMask>
+static Entity_t CreateWithMask(EcsWorld& world, int i)
+{
+    auto payloads = std::tuple_cat(
+        OptionalPayload<TMask, 0>(i),
+        OptionalPayload<TMask, 1>(i),
+        OptionalPayload<TMask, 2>(i),
+        OptionalPayload<TMask, 3>(i),
+        OptionalPayload<TMask, 4>(i)
+    );
+
+    return std::apply(
+        [&world, i](const auto&... payload)
+        {
+            return world.CreateEntity(Position{ (float)i, 0 }, Velocity{ 1, 1 }, payload...);
+        },
+        payloads
+    );
+}
+
+//------------------------------------------------------------------------------
+template<size_t... TMasks>
+static Entity_t CreateInArchetype(EcsWorld& world, int i, std::index_sequence<TMasks...>)
+{
+    using CreateFun_t = Entity_t (*)(EcsWorld&, int);
+    static constexpr CreateFun_t CREATE_FUNS[]{ CreateWithMask<TMasks>... };
+
+    return CREATE_FUNS[i % sizeof...(TMasks)](world, i);
+}
+
+//------------------------------------------------------------------------------
+static void AddResult(Array<BenchResult>& results, const char* name, const char* storageName, int entityCount, double ns, int opCount)
+{
+    BenchResult result;
+    snprintf(result.name_, sizeof(result.name_), "%s/%s", name, storageName);
+    result.entityCount_ = entityCount;
+    result.nsPerEntity_ = ns / Max(opCount, 1);
+    results.Add(result);
+
+    printf("%-32s %8d %10.2f ns\n", result.name_, result.entityCount_, result.nsPerEntity_);
+}
+
+//------------------------------------------------------------------------------
+//! Runs every benchmark once on a fresh world, ns gets the time of each and opCounts the number of timed operations
+static void RunBenchmarksOnce(ArchetypeStorage storage, int entityCount, double* ns, int* opCounts)
+{
+    EcsWorld world(storage);
+    Array<Entity_t> entities;
+    entities.Reserve(entityCount);
+
+    {
+        BenchTimer timer;
+        for (int i = 0; i < entityCount; ++i)
+            entities.Add(CreateInArchetype(world, i, std::make_index_sequence<ARCHETYPE_COUNT>()));
+        ns[BENCH_CREATE_ENTITY] = timer.ElapsedNs();
+        opCounts[BENCH_CREATE_ENTITY] = entityCount;
+    }
+
+    {
+        // Random order so the lookups don't walk the rows sequentially
+        Array<Entity_t> shuffled;
+        shuffled = entities;
+        uint32 rng = 12345;
+        for (int i = entityCount - 1; i > 0; --i)
+        {
+            rng = rng * 1664525u + 1013904223u;
+            const int j = (int)((rng >> 8) % (uint32)(i + 1));
+            const Entity_t tmp = shuffled[i];
+            shuffled[i] = shuffled[j];
+            shuffled[j] = tmp;
+        }
+
+        float sum = 0;
+        BenchTimer timer;
+        for (int i = 0; i < entityCount; ++i)
+            sum += world.GetComponent<const Position>(shuffled[i]).x_;
+        ns[BENCH_GET_COMPONENT] = timer.ElapsedNs();
+        opCounts[BENCH_GET_COMPONENT] = entityCount;
+        g_Sink = sum;
+
+        sum = 0;
+        BenchTimer componentsTimer;
+        for (int i = 0; i < entityCount; ++i)
+        {
+            const auto [position, velocity] = world.GetComponents<const Position, const Velocity>(shuffled[i]);
+            sum += position.x_ + velocity.y_;
+        }
+        ns[BENCH_GET_COMPONENTS] = componentsTimer.ElapsedNs();
+        opCounts[BENCH_GET_COMPONENTS] = entityCount;
+        g_Sink = sum;
+    }
+
+    {
+        BenchTimer timer;
+        EcsWorld::Iter<Position, const Velocity>(&world).Each(
+            [](Position& position, const Velocity& velocity)
+            {
+                position.x_ += velocity.x_;
+                position.y_ += velocity.y_;
+            }
+        );
+        ns[BENCH_EACH] = timer.ElapsedNs();
+        opCounts[BENCH_EACH] = entityCount;
+    }
+
+    {
+        // Skips half of the archetypes
+        BenchTimer timer;
+        EcsWorld::Iter<Position, const Velocity>(&world).EachExcept<Payload<0>>(
+            [](Position& position, const Velocity& velocity)
+            {
+                position.x_ += velocity.x_;
+                position.y_ += velocity.y_;
+            }
+        );
+        ns[BENCH_EACH_EXCEPT] = timer.ElapsedNs();
+        opCounts[BENCH_EACH_EXCEPT] = entityCount;
+    }
+
+    {
+        BenchTimer timer;
+        for (int i = 0; i < entityCount; ++i)
+            world.SetComponents(entities[i], Migrated{ 1 });
+        ns[BENCH_SET_COMPONENTS_MIGRATE] = timer.ElapsedNs();
+        opCounts[BENCH_SET_COMPONENTS_MIGRATE] = entityCount;
+    }
+
+    {
+        int deleteCount = 0;
+        BenchTimer timer;
+        for (int i = 0; i < entityCount; i += 2, ++deleteCount)
+            world.DeleteEntity(entities[i]);
+        ns[BENCH_DELETE_ENTITY] = timer.ElapsedNs();
+        opCounts[BENCH_DELETE_ENTITY] = deleteCount;
+    }
+
+    {
+        // Deletes requested during iteration are applied when it ends
+        const int deleteCount = entityCount / 2;
+        BenchTimer timer;
+        EcsWorld::Iter<const Entity_t>(&world).Each(
+            [&world](const Entity_t entity)
+            {
+                world.DeleteEntity(entity);
+            }
+        );
+        ns[BENCH_DELETE_ENTITY_DEFERRED] = timer.ElapsedNs();
+        opCounts[BENCH_DELETE_ENTITY_DEFERRED] = deleteCount;
+    }
+}
+
+//------------------------------------------------------------------------------
+//! Every benchmark takes the best of ITER_RUNS runs on fresh worlds, so even the few microseconds of a run at 1k
+//! entities are stable enough to compare against the baseline
+static void RunBenchmarks(Array<BenchResult>& results, ArchetypeStorage storage, const char* storageName, int entityCount)
+{
+    double bestNs[BENCH_COUNT];
+    int opCounts[BENCH_COUNT];
+    for (int runI = 0; runI < ITER_RUNS; ++runI)
+    {
+        double ns[BENCH_COUNT];
+        RunBenchmarksOnce(storage, entityCount, ns, opCounts);
+
+        for (int i = 0; i < BENCH_COUNT; ++i)
+            bestNs[i] = runI == 0 ? ns[i] : Min(bestNs[i], ns[i]);
+    }
+
+    for (int i = 0; i < BENCH_COUNT; ++i)
+        AddResult(results, BENCH_NAMES[i], storageName, entityCount, bestNs[i], opCounts[i]);
+}
+
+//------------------------------------------------------------------------------
+static bool WriteResults(const char* path, const Array<BenchResult>& results)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+    {
+        printf("Failed to open %s for writing\n", path);
+        return false;
+    }
+
+    fprintf(file, "name,entities,ns_per_entity\n");
+    for (int i = 0; i < (int)results.Count(); ++i)
+        fprintf(file, "%s,%d,%.4f\n", results[i].name_, results[i].entityCount_, results[i].nsPerEntity_);
+
+    fclose(file);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+static bool ReadResults(const char* path, Array<BenchResult>& results)
+{
+    FILE* file = fopen(path, "r");
+    if (!file)
+    {
+        printf("Failed to open baseline %s\n", path);
+        return false;
+    }
+
+    // Skip the header
+    char line[256];
+    if (!fgets(line, sizeof(line), file))
+    {
+        fclose(file);
+        return true;
+    }
+
+    BenchResult result;
+    while (fscanf(file, " %63[^,],%d,%lf", result.name_, &result.entityCount_, &result.nsPerEntity_) == 3)
+        results.Add(result);
+
+    fclose(file);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+//! Returns the number of benchmarks slower than the baseline by more than the tolerance
+static int CompareWithBaseline(const Array<BenchResult>& results, const Array<BenchResult>& baseline, float tolerance)
+{
+    int regressionCount = 0;
+    for (int i = 0; i < (int)results.Count(); ++i)
+    {
+        const BenchResult& result = results[i];
+        for (int baseI = 0; baseI < (int)baseline.Count(); ++baseI)
+        {
+            const BenchResult& base = baseline[baseI];
+            if (base.entityCount_ != result.entityCount_ || strcmp(base.name_, result.name_) != 0)
+                continue;
+
+            const double ratio = result.nsPerEntity_ / Max(base.nsPerEntity_, 0.0001);
+            if (ratio > 1 + tolerance)
+            {
+                printf("REGRESSION %-32s %8d %10.2f ns, baseline %10.2f ns (%+.0f%%)\n",
+                    result.name_, result.entityCount_, result.nsPerEntity_, base.nsPerEntity_, (ratio - 1) * 100);
+                ++regressionCount;
+            }
+            break;
+        }
+    }
+
+    return regressionCount;
+}
+
+}
+
+//------------------------------------------------------------------------------
+//! EcsBench [--out results.csv] [--baseline baseline.csv] [--tolerance 0.1]
+//! Exits with 1 when any benchmark is slower than the baseline by more than the tolerance.
+int main(int argc, char** argv)
+{
+    using namespace hs;
+
+    const char* outPath = "EcsBenchResults.csv";
+    const char* baselinePath = nullptr;
+    float tolerance = DEFAULT_TOLERANCE;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+        {
+            outPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+        {
+            baselinePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+        {
+            tolerance = (float)atof(argv[++i]);
+        }
+        else
+        {
+            printf("Usage: EcsBench [--out results.csv] [--baseline baseline.csv] [--tolerance 0.1]\n");
+            return 1;
+        }
+    }
+
+    Array<BenchResult> results;
+    for (int entityCount : ENTITY_COUNTS)
+    {
+        RunBenchmarks(results, ArchetypeStorage::Contiguous, "Contiguous", entityCount);
+        RunBenchmarks(results, ArchetypeStorage::Chunked, "Chunked", entityCount);
+    }
+
+    if (!WriteResults(outPath, results))
+        return 1;
+
+    if (!baselinePath)
+        return 0;
+
+    Array<BenchResult> baseline;
+    if (!ReadResults(baselinePath, baseline))
+        return 1;
+
+    const int regressionCount = CompareWithBaseline(results, baseline, tolerance);
+    printf("%d regressions against %s\n", regressionCount, baselinePath);
+
+    return regressionCount > 0 ? 1 : 0;
+}
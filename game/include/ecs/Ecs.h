@@ -2,12 +2,26 @@
 
 #include "Config.h"
 
+#include "Ecs/EcsAllocator.h"
+#include "Ecs/JobSystem.h"
+
 #include "Containers/Array.h"
 
+#include "Common/Enums.h"
 #include "Common/Types.h"
 #include "Common/Util.h"
 
-#include <algorithm> // For std::sort
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <initializer_list>
+#include <tuple>
+#include <unordered_map>
+
+#if defined(_MSC_VER)
+    #include <intrin.h> // For __popcnt64
+    #include <malloc.h> // For _aligned_malloc
+#endif
 
 namespace hs
 {
@@ -20,781 +34,4249 @@ struct TypeInfo;
 static constexpr int ID_BAD{ -1 };
 static constexpr Entity_t NULL_ENTITY{ 0 };
 
-namespace internal
+//! Entity handles keep the index of the entity's slot in the low bits and the slot's generation in the high bits. The
+//! generation changes every time the slot is reused so handles of deleted entities don't alias new ones.
+static constexpr int ENTITY_INDEX_BITS{ 24 };
+static constexpr uint32 ENTITY_INDEX_MASK{ (1u << ENTITY_INDEX_BITS) - 1 };
+
+//------------------------------------------------------------------------------
+inline int GetEntityIndex(Entity_t entity)
+{
+    return (int)((uint32)entity & ENTITY_INDEX_MASK);
+}
+
+//! Maximum number of registered component types, limited by the width of ComponentMask
+static constexpr int MAX_COMPONENT_TYPES{ 128 };
+//! Maximum number of components a single archetype can have
+static constexpr int MAX_ARCHETYPE_COMPONENTS{ 32 };
+//! Maximum number of shared components a single archetype can have, see IsSharedComponent
+static constexpr int MAX_SHARED_COMPONENTS{ 4 };
+//! Size of one block of rows when archetypes use ArchetypeStorage::Chunked
+static constexpr int ARCHETYPE_CHUNK_SIZE{ 16 * 1024 };
+//! Maximum number of rows processed by one task of ParallelEach
+static constexpr int PARALLEL_RANGE_ROWS{ 1024 };
+//! Alignment of every archetype column, a cache line so columns can be processed with aligned SIMD loads
+static constexpr int ARCHETYPE_COLUMN_ALIGNMENT{ 64 };
+//! Size of one block of component values recorded in an EcsCommandBuffer
+static constexpr int COMMAND_BUFFER_BLOCK_SIZE{ 16 * 1024 };
+
+//------------------------------------------------------------------------------
+enum class ArchetypeStorage
 {
+    //! All rows of a column are in one allocation which doubles when full
+    Contiguous,
+    //! Rows are stored in fixed-size chunks of ARCHETYPE_CHUNK_SIZE bytes, growth allocates a new chunk and never moves rows
+    Chunked,
+};
+
 //------------------------------------------------------------------------------
-template<class TWithoutCvRef>
-struct TypeInfoHelper
+//! Carries a type to overloads found by argument dependent lookup
+template<class T>
+struct TypeTag
 {
-    inline static int typeId_{ ID_BAD };
 };
+
+//------------------------------------------------------------------------------
+//! Fallback for types which are not in any list declared by HS_ECS_COMPONENTS
+inline void EcsComponentListOf(...)
+{
 }
 
-using TypeCtor_t = void (*)(void* dst);
-using TypeDtor_t = void (*)(void* dst);
-using TypeCopyCtor_t = void (*)(void* dst, const void* src);
-using TypeMoveCtor_t = void (*)(void* dst, void* src);
+namespace internal
+{
+//------------------------------------------------------------------------------
+// Atomic since systems of one ParallelRun stage may ask for the slots of their first queries at the same time
+inline std::atomic<int> g_LastQuerySlot{ 0 };
 
 //------------------------------------------------------------------------------
-struct TypeDetails
+//! Shared instance handed out for tag components which have no storage
+template<class TTag>
+struct TagInstance
 {
-    TypeCtor_t ctor_;
-    TypeDtor_t dtor_;
-    TypeCopyCtor_t copyCtor_;
-    TypeMoveCtor_t moveCtor_;
-    int alignment_;
-    int size_;
-    bool isTrivial_;
+    inline static TTag value_{};
 };
 
 //------------------------------------------------------------------------------
-struct TypeInfoDb
+//! Assigns each distinct Iter signature a slot in the world's query cache
+template<class... TSignature>
+struct QuerySlotHelper
 {
-    template<class T>
-    friend struct TypeInfo;
-
     //------------------------------------------------------------------------------
-    static const TypeDetails* GetDetails(int type)
+    static int Slot()
     {
-        return details_[type];
+        static const int slot = g_LastQuerySlot.fetch_add(1, std::memory_order_relaxed);
+        return slot;
     }
-
-private:
-    inline static int lastTypeId_{ 0 };
-    inline static Array<const TypeDetails*> details_;
 };
 
 //------------------------------------------------------------------------------
-template<class T>
-void TypeCtor(void* dst)
+inline void* AlignedAlloc(size_t size, size_t alignment)
 {
-    new (dst) T;
+    #if defined(_MSC_VER)
+        return _aligned_malloc(size, alignment);
+    #else
+        // aligned_alloc requires size to be a multiple of alignment
+        return std::aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+    #endif
 }
 
 //------------------------------------------------------------------------------
-template<class T>
-void TypeDtor(void* dst)
+inline void AlignedFree(void* ptr)
 {
-    static_cast<T*>(dst)->~T();
+    #if defined(_MSC_VER)
+        _aligned_free(ptr);
+    #else
+        std::free(ptr);
+    #endif
 }
 
 //------------------------------------------------------------------------------
-template<class T>
-void TypeCopyCtor(void* dst, const void* src)
+inline int AlignUp(int value, int alignment)
 {
-    new (dst) T(*static_cast<const T*>(src));
+    return (value + alignment - 1) & ~(alignment - 1);
 }
 
 //------------------------------------------------------------------------------
-template<class T>
-void TypeMoveCtor(void* dst, void* src)
+//! Statistics counter which may be bumped from several threads at once, copies take the current value so the owning
+//! object stays movable
+class RelaxedCounter
 {
-    new (dst) T(std::move(*static_cast<T*>(src)));
-}
+public:
+    //------------------------------------------------------------------------------
+    RelaxedCounter() = default;
 
-//------------------------------------------------------------------------------
-template<class T>
-struct TypeInfo
-{
-    static_assert(std::is_standard_layout_v<T>);
+    //------------------------------------------------------------------------------
+    RelaxedCounter(const RelaxedCounter& other)
+        : value_(other.Get())
+    {
+    }
 
     //------------------------------------------------------------------------------
-    static int TypeId()
+    RelaxedCounter& operator=(const RelaxedCounter& other)
     {
-        const auto id = internal::TypeInfoHelper<RemoveCvRef_t<T>>::typeId_;
-        HS_ASSERT(id != ID_BAD && "Type is not registered by TypeInfo<T>::InitTypeId()");
-        return id;
+        value_.store(other.Get(), std::memory_order_relaxed);
+        return *this;
     }
 
     //------------------------------------------------------------------------------
-    static void InitTypeId()
+    void Increment()
     {
-        internal::TypeInfoHelper<RemoveCvRef_t<T>>::typeId_ = TypeInfoDb::lastTypeId_++;
-        details_.alignment_ = alignof(T);
-        details_.size_ = sizeof(T);
-        details_.isTrivial_ = std::is_trivial_v<T>;
-        details_.ctor_ = TypeCtor<T>;
-        details_.dtor_ = TypeDtor<T>;
-        details_.copyCtor_ = TypeCopyCtor<T>;
-        details_.moveCtor_ = TypeMoveCtor<T>;
-        TypeInfoDb::details_.Add(&details_);
+        value_.fetch_add(1, std::memory_order_relaxed);
+    }
 
-        HS_ASSERT(TypeInfoDb::details_.Count() == TypeInfoDb::lastTypeId_);
+    //------------------------------------------------------------------------------
+    uint32 Get() const
+    {
+        return value_.load(std::memory_order_relaxed);
     }
 
-    inline static TypeDetails details_;
+private:
+    std::atomic<uint32> value_{};
 };
 
-class EcsWorld;
-
 //------------------------------------------------------------------------------
-class Archetype // Table?
+//! Read-only view of a whole file, pages are copy-on-write so the memory can be modified without touching the file
+class FileMapping
 {
 public:
-    using Type_t = Array<int>;
-    using Column_t = void*;
-
     //------------------------------------------------------------------------------
-    Archetype(EcsWorld* world, const Type_t& type)
-        : world_(world)
-    {
-        type_ = type;
-        rowCapacity_ = 8;
-
-        for (int i = 0; i < type_.Count(); ++i)
-        {
-            // TODO alignment
-            const TypeDetails* details = TypeInfoDb::GetDetails(type_[i]);
-            Column_t column = malloc(rowCapacity_ * details->size_);
-            if (!details->isTrivial_)
-            {
-                for (int rowI = 0; rowI < rowCapacity_; ++rowI)
-                {
-                    details->ctor_((int8*)column + rowI * details->size_);
-                }
-            }
-            columns_.Add(column);
-        }
-    }
+    FileMapping() = default;
 
     //------------------------------------------------------------------------------
-    ~Archetype()
-    {
-        for (int i = 0; i < type_.Count(); ++i)
-        {
-            const TypeDetails* details = TypeInfoDb::GetDetails(type_[i]);
-            if (!details->isTrivial_)
-            {
-                for (int rowI = 0; rowI < rowCapacity_; ++rowI)
-                {
-                    details->dtor_((int8*)columns_[i] + rowI * details->size_);
-                }
-            }
-            free(columns_[i]);
-        }
-    }
-
+    ~FileMapping();
 
     //------------------------------------------------------------------------------
-    Archetype(Archetype&& other) = default;
+    FileMapping(const FileMapping&) = delete;
 
     //------------------------------------------------------------------------------
-    Archetype& operator=(Archetype&& other) = default;
+    FileMapping& operator=(const FileMapping&) = delete;
 
     //------------------------------------------------------------------------------
-    Archetype(const Archetype&) = delete;
+    RESULT Map(const char* path);
 
     //------------------------------------------------------------------------------
-    Archetype& operator=(const Archetype&) = delete;
+    void Unmap();
 
     //------------------------------------------------------------------------------
-    const Type_t& GetType() const
+    int8* GetData() const
     {
-        return type_;
+        return data_;
     }
 
     //------------------------------------------------------------------------------
-    int FindComponent(int componentTypeId) const
+    int64 GetSize() const
     {
-        for (int i = 0; i < type_.Count(); ++i)
-        {
-            if (type_[i] == componentTypeId)
-                return i;
-        }
-
-        return ID_BAD;
+        return size_;
     }
 
+private:
+    int8* data_{};
+    int64 size_{};
+};
+
+//------------------------------------------------------------------------------
+inline int PopCount64(uint64 value)
+{
+    #if defined(_MSC_VER)
+        return (int)__popcnt64(value);
+    #else
+        return __builtin_popcountll(value);
+    #endif
+}
+}
+
+//------------------------------------------------------------------------------
+//! Fixed-width bitset of component type ids, the signature of an archetype or a query
+struct ComponentMask
+{
+    static constexpr int WORD_BITS = 64;
+    static constexpr int WORD_COUNT = MAX_COMPONENT_TYPES / WORD_BITS;
+
+    uint64 words_[WORD_COUNT]{};
+
     //------------------------------------------------------------------------------
-    template<class TComponent>
-    int FindComponent() const
+    void Set(int typeId)
     {
-        auto componentTypeId = TypeInfo<TComponent>::TypeId();
-        return FindComponent(componentTypeId);
+        HS_ASSERT(typeId >= 0 && typeId < MAX_COMPONENT_TYPES);
+        words_[typeId / WORD_BITS] |= 1ull << (typeId % WORD_BITS);
     }
 
     //------------------------------------------------------------------------------
-    template<class... TComponent>
-    bool HasComponents() const
+    void Clear(int typeId)
     {
-        return ((FindComponent<TComponent>() != ID_BAD) && ...);
+        HS_ASSERT(typeId >= 0 && typeId < MAX_COMPONENT_TYPES);
+        words_[typeId / WORD_BITS] &= ~(1ull << (typeId % WORD_BITS));
     }
 
     //------------------------------------------------------------------------------
-    bool IsType(const Type_t& otherType) const
+    bool Has(int typeId) const
     {
-        if (type_.Count() != otherType.Count())
-            return false;
+        HS_ASSERT(typeId >= 0 && typeId < MAX_COMPONENT_TYPES);
+        return (words_[typeId / WORD_BITS] >> (typeId % WORD_BITS)) & 1;
+    }
 
-        for (int i = 0; i < type_.Count(); ++i)
+    //------------------------------------------------------------------------------
+    //! True if all bits of other are set in this mask
+    bool Contains(const ComponentMask& other) const
+    {
+        for (int i = 0; i < WORD_COUNT; ++i)
         {
-            if (type_[i] != otherType[i])
+            if ((words_[i] & other.words_[i]) != other.words_[i])
                 return false;
         }
-
         return true;
     }
 
     //------------------------------------------------------------------------------
-    template<class TComponent>
-    TComponent& GetComponent(int row, int column)
+    bool Intersects(const ComponentMask& other) const
     {
-        auto size = TypeInfo<TComponent>::details_.size_;
-        auto& result = *reinterpret_cast<TComponent*>((int8*)columns_[column] + row * size);
-        return result;
+        for (int i = 0; i < WORD_COUNT; ++i)
+        {
+            if (words_[i] & other.words_[i])
+                return true;
+        }
+        return false;
     }
 
     //------------------------------------------------------------------------------
-    void SetComponent(int rowIdx, int componentTypeId, void* value)
+    //! Number of set bits lower than typeId
+    int Rank(int typeId) const
     {
-        HS_ASSERT(componentTypeId != ID_BAD);
+        HS_ASSERT(typeId >= 0 && typeId < MAX_COMPONENT_TYPES);
+        const int wordIdx = typeId / WORD_BITS;
 
-        const auto details = TypeInfoDb::GetDetails(componentTypeId);
-        auto size = details->size_;
-
-        auto componentIdx = FindComponent(componentTypeId);
+        int rank = 0;
+        for (int i = 0; i < wordIdx; ++i)
+            rank += internal::PopCount64(words_[i]);
 
-        Column_t column = columns_[componentIdx];
+        const uint64 lowerBits = (1ull << (typeId % WORD_BITS)) - 1;
+        return rank + internal::PopCount64(words_[wordIdx] & lowerBits);
+    }
 
-        void* dst = (int8*)column + rowIdx * size;
-        if (details->isTrivial_)
-        {
-            memcpy(dst, value, size);
-        }
-        else
+    //------------------------------------------------------------------------------
+    bool operator==(const ComponentMask& other) const
+    {
+        for (int i = 0; i < WORD_COUNT; ++i)
         {
-            details->copyCtor_(dst, value);
+            if (words_[i] != other.words_[i])
+                return false;
         }
+        return true;
     }
 
     //------------------------------------------------------------------------------
-    template<class TComponent, class... TRest>
-    void SetComponents(int rowIdx, const TComponent& value, const TRest... rest)
+    bool operator!=(const ComponentMask& other) const
     {
-        SetComponent(rowIdx, value);
-        SetComponents(rowIdx, rest...);
+        return !(*this == other);
     }
+};
 
+//------------------------------------------------------------------------------
+//! Ordered list of component type ids stored inline, archetypes and queries use it to avoid heap allocations
+class ComponentTypeList
+{
+public:
     //------------------------------------------------------------------------------
-    template<class TComponent>
-    void SetComponents(int rowIdx, const TComponent& value)
-    {
-        SetComponent(rowIdx, value);
-    }
+    ComponentTypeList() = default;
 
     //------------------------------------------------------------------------------
-    int AddEntity(Entity_t eid)
+    ComponentTypeList(std::initializer_list<int> typeIds)
     {
-        EnsureCapacity();
-
-        Element entityElement = GetElement(rowCount_, 0);
-        memcpy(entityElement.data_, &eid, sizeof(eid));
-
-        for (int i = 1; i < columns_.Count(); ++i)
-        {
-            Element e = GetElement(rowCount_, i);
-            if (e.details_->isTrivial_)
-            {
-                memset(e.data_, 0, e.details_->size_);
-            }
-            else
-            {
-                e.details_->dtor_(e.data_);
-                e.details_->ctor_(e.data_);
-            }
-        }
-
-        return rowCount_++;
+        for (int typeId : typeIds)
+            Add(typeId);
     }
 
     //------------------------------------------------------------------------------
-    void RemoveRow(int row);
-
-    //------------------------------------------------------------------------------
-    int TryGetIterators(const Type_t& canonicalType, Span<const int> permutation, void** arr, Span<const int> avoidTypes) const
+    int Count() const
     {
-        if (canonicalType.Count() > type_.Count())
-            return 0;
-
-        int colI = 0;
-        for (int i = 0; i < type_.Count(); ++i)
-        {
-            for (int avoidI = 0; avoidI < avoidTypes.Count(); ++avoidI)
-            {
-                if (avoidTypes[avoidI] == type_[i])
-                    return 0;
-            }
-
-            if (colI < permutation.Count() && canonicalType[colI] == type_[i])
-            {
-                auto finalIdx = permutation[colI++];
-                arr[finalIdx] = columns_[i];
-            }
-        }
-
-        if (colI != permutation.Count())
-            return 0;
-
-        return rowCount_;
+        return count_;
     }
 
     //------------------------------------------------------------------------------
-    struct Element
+    int operator[](int i) const
     {
-        void* data_;
-        const TypeDetails* details_;
-    };
+        HS_ASSERT(i < count_);
+        return typeIds_[i];
+    }
 
     //------------------------------------------------------------------------------
-    Element GetElement(int row, int column)
+    void Add(int typeId)
     {
-        const TypeDetails* details = TypeInfoDb::GetDetails(type_[column]);
-        Element element;
-        element.data_ = (int8*)columns_[column] + row * details->size_;
-        element.details_ = details;
-        return element;
+        HS_ASSERT(count_ < MAX_ARCHETYPE_COMPONENTS && "Too many components in one archetype, increase MAX_ARCHETYPE_COMPONENTS");
+        typeIds_[count_++] = typeId;
     }
 
-private:
-    EcsWorld* world_;
-    Type_t type_;
-    Array<Column_t> columns_;
-    int rowCount_{};
-    int rowCapacity_;
-
     //------------------------------------------------------------------------------
-    int GetEntityId(int row)
+    void Insert(int idx, int typeId)
     {
-        auto element = GetElement(row, 0);
-        return *(Entity_t*)element.data_;
+        HS_ASSERT(count_ < MAX_ARCHETYPE_COMPONENTS && "Too many components in one archetype, increase MAX_ARCHETYPE_COMPONENTS");
+        HS_ASSERT(idx <= count_);
+        for (int i = count_; i > idx; --i)
+            typeIds_[i] = typeIds_[i - 1];
+
+        typeIds_[idx] = typeId;
+        ++count_;
     }
 
     //------------------------------------------------------------------------------
-    void EnsureCapacity()
+    ComponentMask MakeMask() const
     {
-        if (rowCount_ < rowCapacity_)
-            return;
-
-        HS_ASSERT(rowCount_ == rowCapacity_);
-
-        rowCapacity_ *= 2;
-        for (int i = 0; i < columns_.Count(); ++i)
-        {
-            // TODO alignment
-            const TypeDetails* details = TypeInfoDb::GetDetails(type_[i]);
-            Column_t newColumn{};
-            if (details->isTrivial_)
-            {
-                newColumn = realloc(columns_[i], rowCapacity_ * details->size_);
-            }
-            else
-            {
-                newColumn = malloc(rowCapacity_ * details->size_);
-
-                for (int rowI = 0; rowI < rowCapacity_; ++rowI)
-                {
-                    void* dst = (int8*)newColumn + rowI * details->size_;
-                    void* src = (int8*)columns_[i] + rowI * details->size_;
-                    details->moveCtor_(dst, src);
-                    details->dtor_(src);
-                }
-                free(columns_[i]);
-            }
-            HS_ASSERT(newColumn);
-            columns_[i] = newColumn;
-        }
+        ComponentMask mask{};
+        for (int i = 0; i < count_; ++i)
+            mask.Set(typeIds_[i]);
+        return mask;
     }
 
     //------------------------------------------------------------------------------
-    void SwapRow(int a, int b)
+    const int* begin() const
     {
-        for (int i = 0; i < columns_.Count(); ++i)
-        {
-            const TypeDetails* details = TypeInfoDb::GetDetails(type_[i]);
-            auto size = details->size_;
-
-            int8* tmp = HS_ALLOCA(int8, size);
-            int8* aPtr = (int8*)columns_[i] + size * a;
-            int8* bPtr = (int8*)columns_[i] + size * b;
-
-            if (details->isTrivial_)
-            {
-                memcpy(tmp, aPtr, size);
-                memcpy(aPtr, bPtr, size);
-                memcpy(bPtr, tmp, size);
-            }
-            else
-            {
-                details->moveCtor_(tmp, aPtr);
-                details->moveCtor_(aPtr, bPtr);
-                details->moveCtor_(bPtr, tmp);
-                details->dtor_(tmp);
-            }
-        }
+        return typeIds_;
     }
 
     //------------------------------------------------------------------------------
-    template<class TComponent>
-    void SetComponent(int rowIdx, const TComponent& value)
+    const int* end() const
     {
-        auto componentId = FindComponent<TComponent>();
-        HS_ASSERT(componentId != ID_BAD);
-        HS_ASSERT(rowIdx < rowCount_);
-
-        Column_t column = columns_[componentId];
-        static_cast<TComponent*>(column)[rowIdx] = value;
+        return typeIds_ + count_;
     }
+
+private:
+    int typeIds_[MAX_ARCHETYPE_COMPONENTS];
+    int count_{};
 };
 
+using TypeCtor_t = void (*)(void* dst);
+using TypeDtor_t = void (*)(void* dst);
+using TypeCopyCtor_t = void (*)(void* dst, const void* src);
+using TypeMoveCtor_t = void (*)(void* dst, void* src);
+using TypeSnapshotSave_t = void (*)(const void* src, Array<int8>& out);
+using TypeSnapshotLoad_t = const int8* (*)(void* dst, const int8* data);
+
 //------------------------------------------------------------------------------
-// Class that has all the types and entities
-class EcsWorld
+struct TypeDetails
 {
-    friend class Archetype;
+    TypeCtor_t ctor_;
+    TypeDtor_t dtor_;
+    TypeCopyCtor_t copyCtor_;
+    TypeMoveCtor_t moveCtor_;
+    //! Set only for components with a SnapshotSerializer
+    TypeSnapshotSave_t snapshotSave_;
+    TypeSnapshotLoad_t snapshotLoad_;
+    int alignment_;
+    int size_;
+    bool isTrivial_;
+    //! Moving the object to another address and not destroying the source can be done by memcpy
+    bool isTriviallyRelocatable_;
+    //! Empty type which is stored only in archetype signatures, never in columns
+    bool isTag_;
+    //! Bytes of the object are its whole value, snapshots store such columns as raw memory
+    bool isTriviallyCopyable_;
+    //! Kept in a SparseSet of the world, never in archetypes
+    bool isSparse_;
+    //! One value per archetype instead of a column, see IsSharedComponent
+    bool isShared_;
+};
+
+//------------------------------------------------------------------------------
+//! Specialize to std::true_type for components which may be moved by memcpy, e.g. ones owning heap memory through
+//! plain pointers. Such components are relocated without calling moveCtor_ and dtor_ when rows move.
+template<class T>
+struct IsTriviallyRelocatable : std::bool_constant<std::is_trivially_copyable_v<T>>
+{
+};
+
+//------------------------------------------------------------------------------
+//! Specialize to std::true_type for components which are added to and removed from entities often. Their values live
+//! in a SparseSet of the world instead of archetype columns, so adding or removing them never moves the entity's row.
+//! Each and ParallelEach join them to the archetype rows by a lookup per entity. Chunk iteration, change filters,
+//! Except, SortRows and snapshots don't support them.
+template<class T>
+struct IsSparseComponent : std::false_type
+{
+};
+
+//------------------------------------------------------------------------------
+template<class T>
+inline constexpr bool IsSparseComponent_v = IsSparseComponent<RemoveCvRef_t<T>>::value;
+
+//------------------------------------------------------------------------------
+//! Specialize to std::true_type for components whose value is the same for many entities. The value is stored once
+//! per archetype, entities with different values are in different archetypes, so setting a new value moves the
+//! entity. Values are compared by their bytes. Iteration hands out a const reference, chunk iteration one reference
+//! per chunk instead of a span. Change filters, sparse storage and snapshots don't support them.
+template<class T>
+struct IsSharedComponent : std::false_type
+{
+};
+
+//------------------------------------------------------------------------------
+template<class T>
+inline constexpr bool IsSharedComponent_v = IsSharedComponent<RemoveCvRef_t<T>>::value;
+
+//------------------------------------------------------------------------------
+//! Specialize for components which are not trivially copyable to include them in world snapshots, trivially copyable
+//! components are saved as raw column memory. The specialization sets IS_DEFINED and provides
+//!     static void Save(const T& value, Array<int8>& out) which appends the value to out
+//!     static const int8* Load(T* dst, const int8* data) which constructs the value at dst and returns the end of its data
+template<class T>
+struct SnapshotSerializer
+{
+    static constexpr bool IS_DEFINED = false;
+};
+
+//------------------------------------------------------------------------------
+//! Details of all component types indexed by type id, filled from the list declared by HS_ECS_COMPONENTS
+struct TypeInfoDb
+{
+    //------------------------------------------------------------------------------
+    static const TypeDetails* GetDetails(int type)
+    {
+        HS_ASSERT(type >= 0 && type < typeCount_);
+        return &details_[type];
+    }
+
+    //------------------------------------------------------------------------------
+    static int GetTypeCount()
+    {
+        return typeCount_;
+    }
+
+private:
+    // Defined by HS_ECS_COMPONENTS with constant initializers, so they are set before any dynamic initialization runs
+    // and the table can be used from constructors of globals in any translation unit
+    static const TypeDetails* const details_;
+    static const int typeCount_;
+};
+
+//------------------------------------------------------------------------------
+template<class T>
+void TypeCtor(void* dst)
+{
+    new (dst) T;
+}
+
+//------------------------------------------------------------------------------
+template<class T>
+void TypeDtor(void* dst)
+{
+    static_cast<T*>(dst)->~T();
+}
+
+//------------------------------------------------------------------------------
+template<class T>
+void TypeCopyCtor(void* dst, const void* src)
+{
+    new (dst) T(*static_cast<const T*>(src));
+}
+
+//------------------------------------------------------------------------------
+template<class T>
+void TypeMoveCtor(void* dst, void* src)
+{
+    new (dst) T(std::move(*static_cast<T*>(src)));
+}
+
+//------------------------------------------------------------------------------
+template<class T>
+void TypeSnapshotSave(const void* src, Array<int8>& out)
+{
+    SnapshotSerializer<T>::Save(*static_cast<const T*>(src), out);
+}
+
+//------------------------------------------------------------------------------
+template<class T>
+const int8* TypeSnapshotLoad(void* dst, const int8* data)
+{
+    return SnapshotSerializer<T>::Load(static_cast<T*>(dst), data);
+}
+
+//------------------------------------------------------------------------------
+template<class T>
+constexpr TypeDetails MakeTypeDetails()
+{
+    static_assert(!(IsSparseComponent<T>::value && std::is_empty_v<T>), "Tags have no value to keep in a sparse set");
+    static_assert(!IsSharedComponent<T>::value || (!std::is_empty_v<T> && !IsSparseComponent<T>::value), "Shared components can't be tags or sparse");
+    static_assert(!IsSharedComponent<T>::value || std::has_unique_object_representations_v<T>, "Shared values are compared by their bytes, they must have no padding");
+
+    TypeDetails details{};
+    details.alignment_ = alignof(T);
+    details.size_ = sizeof(T);
+    details.isTrivial_ = std::is_trivial_v<T>;
+    details.isTriviallyRelocatable_ = IsTriviallyRelocatable<T>::value;
+    details.isTag_ = std::is_empty_v<T>;
+    details.isTriviallyCopyable_ = std::is_trivially_copyable_v<T>;
+    details.isSparse_ = IsSparseComponent<T>::value;
+    details.isShared_ = IsSharedComponent<T>::value;
+    details.ctor_ = TypeCtor<T>;
+    details.dtor_ = TypeDtor<T>;
+    details.copyCtor_ = TypeCopyCtor<T>;
+    details.moveCtor_ = TypeMoveCtor<T>;
+    if constexpr (SnapshotSerializer<T>::IS_DEFINED)
+    {
+        details.snapshotSave_ = TypeSnapshotSave<T>;
+        details.snapshotLoad_ = TypeSnapshotLoad<T>;
+    }
+    return details;
+}
+
+//------------------------------------------------------------------------------
+//! Compile-time list of all component types, a type id is the index of the type in the list. Entity_t always has id 0.
+//! Declared once per program by HS_ECS_COMPONENTS.
+template<class... TComponents>
+struct ComponentList
+{
+    static constexpr int COUNT = 1 + sizeof...(TComponents);
+    static_assert(COUNT <= MAX_COMPONENT_TYPES, "Too many component types, increase MAX_COMPONENT_TYPES");
+
+    static constexpr TypeDetails DETAILS[]{ MakeTypeDetails<Entity_t>(), MakeTypeDetails<TComponents>()... };
+
+    //------------------------------------------------------------------------------
+    template<class T>
+    static constexpr int IndexOf()
+    {
+        constexpr bool IS_SAME[]{ std::is_same_v<T, Entity_t>, std::is_same_v<T, TComponents>... };
+        for (int i = 0; i < COUNT; ++i)
+        {
+            if (IS_SAME[i])
+                return i;
+        }
+        return ID_BAD;
+    }
+};
+
+//------------------------------------------------------------------------------
+//! Declares the component types of the program, use once in one source file at namespace hs scope after all the
+//! components are defined:
+//!     HS_ECS_COMPONENTS(Position, Velocity, ...);
+//! TypeInfo finds the list through argument dependent lookup on TypeTag so type ids are compile-time constants. The
+//! macro also defines the TypeInfoDb table, a program without the list fails to link.
+#define HS_ECS_COMPONENTS(...) \
+    using EcsComponents_t = ::hs::ComponentList<__VA_ARGS__>; \
+    template<class T> \
+    EcsComponents_t EcsComponentListOf(::hs::TypeTag<T>); \
+    const ::hs::TypeDetails* const ::hs::TypeInfoDb::details_ = EcsComponents_t::DETAILS; \
+    const int ::hs::TypeInfoDb::typeCount_ = EcsComponents_t::COUNT
+
+//------------------------------------------------------------------------------
+template<class T>
+struct TypeInfo
+{
+    static_assert(std::is_standard_layout_v<T>);
+
+    //------------------------------------------------------------------------------
+    static constexpr int TypeId()
+    {
+        using Component_t = RemoveCvRef_t<T>;
+        if constexpr (std::is_same_v<Component_t, Entity_t>)
+        {
+            return 0;
+        }
+        else
+        {
+            using List_t = decltype(EcsComponentListOf(TypeTag<Component_t>{}));
+            static_assert(!std::is_void_v<List_t>, "Components have to be declared by HS_ECS_COMPONENTS");
+
+            constexpr int id = List_t::template IndexOf<Component_t>();
+            static_assert(id != ID_BAD, "Type is not in the HS_ECS_COMPONENTS list");
+            return id;
+        }
+    }
+};
+
+class EcsWorld;
+
+//------------------------------------------------------------------------------
+//! Identifies an archetype by its components and the values of its shared components
+struct ArchetypeKey
+{
+    ComponentMask mask_;
+    //! Ids of the shared values in the order of the shared component types, ID_BAD after the last one
+    int sharedValues_[MAX_SHARED_COMPONENTS];
+
+    //------------------------------------------------------------------------------
+    bool operator==(const ArchetypeKey& other) const
+    {
+        return mask_ == other.mask_ && memcmp(sharedValues_, other.sharedValues_, sizeof(sharedValues_)) == 0;
+    }
+};
+
+//------------------------------------------------------------------------------
+//! Copy of the rows of one archetype kept by EcsWorldState. Chunk images have the layout of the archetype's chunks
+//! at the time of the save and components which are not trivially copyable are copy constructed into them.
+class ArchetypeState
+{
+public:
+    //------------------------------------------------------------------------------
+    ArchetypeState() = default;
+
+    //------------------------------------------------------------------------------
+    ~ArchetypeState()
+    {
+        Release();
+    }
+
+    //------------------------------------------------------------------------------
+    ArchetypeState(ArchetypeState&& other) = default;
+
+    //------------------------------------------------------------------------------
+    ArchetypeState& operator=(ArchetypeState&& other) = default;
+
+    //------------------------------------------------------------------------------
+    ArchetypeState(const ArchetypeState&) = delete;
+
+    //------------------------------------------------------------------------------
+    ArchetypeState& operator=(const ArchetypeState&) = delete;
+
+private:
+    friend class Archetype;
+
+    ComponentTypeList columns_;
+    int columnOffsets_[MAX_ARCHETYPE_COMPONENTS];
+    Array<int8*> chunks_;
+    int chunkByteSize_{};
+    int chunkRowCapacity_{};
+    int rowCount_{};
+
+    //------------------------------------------------------------------------------
+    int GetChunkRowCount(int chunk) const
+    {
+        return Max(Min(rowCount_ - chunk * chunkRowCapacity_, chunkRowCapacity_), 0);
+    }
+
+    //------------------------------------------------------------------------------
+    int8* GetChunkColumn(int chunk, int column) const
+    {
+        return chunks_[chunk] + columnOffsets_[column];
+    }
+
+    //------------------------------------------------------------------------------
+    void DestroyRows(int chunk, int column, int firstRow, int endRow)
+    {
+        const TypeDetails* details = TypeInfoDb::GetDetails(columns_[column]);
+        if (details->isTriviallyCopyable_)
+            return;
+
+        for (int rowI = firstRow; rowI < endRow; ++rowI)
+            details->dtor_(GetChunkColumn(chunk, column) + rowI * details->size_);
+    }
+
+    //------------------------------------------------------------------------------
+    void Release()
+    {
+        for (int chunkI = 0; chunkI < chunks_.Count(); ++chunkI)
+        {
+            for (int i = 0; i < columns_.Count(); ++i)
+                DestroyRows(chunkI, i, 0, GetChunkRowCount(chunkI));
+
+            internal::AlignedFree(chunks_[chunkI]);
+        }
+
+        chunks_.Clear();
+        chunkByteSize_ = 0;
+        chunkRowCapacity_ = 0;
+        rowCount_ = 0;
+    }
+};
+
+//------------------------------------------------------------------------------
+class Archetype // Table?
+{
+public:
+    using Type_t = ComponentTypeList;
+    using Column_t = void*;
+
+    //------------------------------------------------------------------------------
+    //! sharedValues holds the value ids of the shared components in type order, null if the type has none
+    Archetype(EcsWorld* world, const Type_t& type, ArchetypeStorage storage, const int* sharedValues = nullptr)
+        : world_(world)
+        , storage_(storage)
+    {
+        type_ = type;
+        mask_ = type_.MakeMask();
+
+        for (int i = 1; i < type_.Count(); ++i)
+            HS_ASSERT(type_[i - 1] < type_[i] && "Type must be sorted");
+
+        for (int i = 0; i < MAX_SHARED_COMPONENTS; ++i)
+            sharedValues_[i] = ID_BAD;
+
+        // Tags are only part of the signature, they get no column. Shared components have one value for all rows.
+        for (int typeId : type_)
+        {
+            const TypeDetails* details = TypeInfoDb::GetDetails(typeId);
+            if (details->isShared_)
+            {
+                HS_ASSERT(sharedCount_ < MAX_SHARED_COMPONENTS && "Too many shared components in one archetype, increase MAX_SHARED_COMPONENTS");
+                HS_ASSERT(sharedValues && sharedValues[sharedCount_] != ID_BAD);
+                sharedTypeIds_[sharedCount_] = typeId;
+                sharedValues_[sharedCount_] = sharedValues[sharedCount_];
+                ++sharedCount_;
+            }
+
+            if (details->isTag_ || details->isShared_)
+                continue;
+
+            HS_ASSERT(details->alignment_ <= ARCHETYPE_COLUMN_ALIGNMENT && "Over-aligned components are not supported");
+            details_[columns_.Count()] = details;
+            columns_.Add(typeId);
+        }
+        columnMask_ = columns_.MakeMask();
+
+        if (storage_ == ArchetypeStorage::Chunked)
+        {
+            int rowSize = 0;
+            for (int i = 0; i < columns_.Count(); ++i)
+                rowSize += details_[i]->size_;
+
+            // Power of two rows per chunk so that the row -> chunk mapping is a shift
+            chunkShift_ = 0;
+            while ((2 << chunkShift_) * rowSize <= ARCHETYPE_CHUNK_SIZE)
+                ++chunkShift_;
+
+            while (chunkShift_ > 0 && ComputeLayout(1 << chunkShift_, columnOffsets_) > ARCHETYPE_CHUNK_SIZE)
+                --chunkShift_;
+
+            chunkRowCapacity_ = 1 << chunkShift_;
+            chunkByteSize_ = ComputeLayout(chunkRowCapacity_, columnOffsets_);
+        }
+        else
+        {
+            // Single chunk which is reallocated on growth
+            chunkShift_ = CONTIGUOUS_CHUNK_SHIFT;
+            chunkRowCapacity_ = 0;
+            chunkByteSize_ = 0;
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    ~Archetype()
+    {
+        // Moved-from archetypes have no chunks
+        if (chunks_.Count())
+            DestroyRows(0, rowCount_, ComponentMask{});
+
+        for (int chunkI = borrowedChunkCount_; chunkI < chunks_.Count(); ++chunkI)
+            FreeChunk(chunks_[chunkI], chunkByteSize_);
+    }
+
+
+    //------------------------------------------------------------------------------
+    Archetype(Archetype&& other) = default;
+
+    //------------------------------------------------------------------------------
+    Archetype& operator=(Archetype&& other) = default;
+
+    //------------------------------------------------------------------------------
+    Archetype(const Archetype&) = delete;
+
+    //------------------------------------------------------------------------------
+    Archetype& operator=(const Archetype&) = delete;
+
+    //------------------------------------------------------------------------------
+    const Type_t& GetType() const
+    {
+        return type_;
+    }
+
+    //------------------------------------------------------------------------------
+    const ComponentMask& GetMask() const
+    {
+        return mask_;
+    }
+
+    //------------------------------------------------------------------------------
+    ArchetypeStorage GetStorage() const
+    {
+        return storage_;
+    }
+
+    //------------------------------------------------------------------------------
+    ArchetypeKey GetKey() const
+    {
+        ArchetypeKey key;
+        key.mask_ = mask_;
+        memcpy(key.sharedValues_, sharedValues_, sizeof(sharedValues_));
+        return key;
+    }
+
+    //------------------------------------------------------------------------------
+    int GetSharedCount() const
+    {
+        return sharedCount_;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Id of the archetype's value of the shared component, ID_BAD if the archetype does not have it
+    int GetSharedValueId(int typeId) const
+    {
+        for (int i = 0; i < sharedCount_; ++i)
+        {
+            if (sharedTypeIds_[i] == typeId)
+                return sharedValues_[i];
+        }
+        return ID_BAD;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Value of the shared component for all rows of the archetype
+    const void* GetSharedValue(int typeId) const;
+
+    //------------------------------------------------------------------------------
+    //! Column of the component, ID_BAD for components the archetype does not have, tags and shared components
+    int FindComponent(int componentTypeId) const
+    {
+        if (!columnMask_.Has(componentTypeId))
+            return ID_BAD;
+
+        // Columns are sorted so the column index is the number of columns with lower id
+        return columnMask_.Rank(componentTypeId);
+    }
+
+    //------------------------------------------------------------------------------
+    template<class TComponent>
+    int FindComponent() const
+    {
+        constexpr int componentTypeId = TypeInfo<TComponent>::TypeId();
+        return FindComponent(componentTypeId);
+    }
+
+    //------------------------------------------------------------------------------
+    template<class... TComponent>
+    bool HasComponents() const
+    {
+        return (mask_.Has(TypeInfo<TComponent>::TypeId()) && ...);
+    }
+
+    //------------------------------------------------------------------------------
+    bool IsType(const ComponentMask& otherMask) const
+    {
+        return mask_ == otherMask;
+    }
+
+    //------------------------------------------------------------------------------
+    int GetRowCount() const
+    {
+        return rowCount_;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Rows which fit into the allocated chunks
+    int GetRowCapacity() const
+    {
+        return rowCapacity_;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Most rows the archetype had since the last ResetPeakRowCount
+    int GetPeakRowCount() const
+    {
+        return peakRowCount_;
+    }
+
+    //------------------------------------------------------------------------------
+    void ResetPeakRowCount()
+    {
+        peakRowCount_ = rowCount_;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Number of allocated chunks including empty ones, contiguous storage has at most one
+    int GetAllocatedChunkCount() const
+    {
+        return chunks_.Count();
+    }
+
+    //------------------------------------------------------------------------------
+    int64 GetAllocatedBytes() const
+    {
+        return (int64)chunks_.Count() * chunkByteSize_;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Number of times a query iteration visited the archetype
+    uint32 GetQueryCount() const
+    {
+        return queryCount_.Get();
+    }
+
+    //------------------------------------------------------------------------------
+    //! Called once per archetype by every query iteration, may be called from parallel tasks
+    void CountQuery() const
+    {
+        queryCount_.Increment();
+    }
+
+    //------------------------------------------------------------------------------
+    //! Number of chunks which contain at least one row
+    int GetChunkCount() const
+    {
+        if (!rowCount_)
+            return 0;
+        return ((rowCount_ - 1) >> chunkShift_) + 1;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Number of rows in the given chunk, all chunks but the last one are full
+    int GetChunkRowCount(int chunk) const
+    {
+        HS_ASSERT(chunk < GetChunkCount());
+        return Min(rowCount_ - chunk * chunkRowCapacity_, chunkRowCapacity_);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Pointer to the first element of the column in the given chunk
+    Column_t GetChunkColumn(int chunk, int column) const
+    {
+        return chunks_[chunk] + columnOffsets_[column];
+    }
+
+    //------------------------------------------------------------------------------
+    //! Number of columns, the type without tags
+    int GetColumnCount() const
+    {
+        return columns_.Count();
+    }
+
+    //------------------------------------------------------------------------------
+    const TypeDetails* GetColumnDetails(int column) const
+    {
+        return details_[column];
+    }
+
+    //------------------------------------------------------------------------------
+    int GetColumnTypeId(int column) const
+    {
+        return columns_[column];
+    }
+
+    //------------------------------------------------------------------------------
+    //! World change version of the last mutable access to the column in the given chunk
+    uint32 GetColumnVersion(int chunk, int column) const
+    {
+        return columnVersions_[chunk * columns_.Count() + column];
+    }
+
+    //------------------------------------------------------------------------------
+    void MarkColumnChanged(int chunk, int column)
+    {
+        columnVersions_[chunk * columns_.Count() + column] = GetChangeVersion();
+    }
+
+    //------------------------------------------------------------------------------
+    void MarkElementChanged(int row, int column)
+    {
+        MarkColumnChanged(row >> chunkShift_, column);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Marks all columns of the chunk containing row as changed
+    void MarkRowChanged(int row)
+    {
+        const int chunk = row >> chunkShift_;
+        for (int i = 0; i < columns_.Count(); ++i)
+            MarkColumnChanged(chunk, i);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Returns index of the archetype reached by adding the component to this one, ID_BAD if not yet known
+    int GetAddEdge(int componentTypeId) const
+    {
+        if (componentTypeId >= edges_.Count())
+            return ID_BAD;
+        return edges_[componentTypeId].add_;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Returns index of the archetype reached by removing the component from this one, ID_BAD if not yet known
+    int GetRemoveEdge(int componentTypeId) const
+    {
+        if (componentTypeId >= edges_.Count())
+            return ID_BAD;
+        return edges_[componentTypeId].remove_;
+    }
+
+    //------------------------------------------------------------------------------
+    void SetAddEdge(int componentTypeId, int archetypeIdx)
+    {
+        EnsureEdge(componentTypeId);
+        edges_[componentTypeId].add_ = archetypeIdx;
+    }
+
+    //------------------------------------------------------------------------------
+    void SetRemoveEdge(int componentTypeId, int archetypeIdx)
+    {
+        EnsureEdge(componentTypeId);
+        edges_[componentTypeId].remove_ = archetypeIdx;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Updates edges after archetypes were removed, remap holds the new index of every old one or ID_BAD
+    void RemapEdges(const int* remap)
+    {
+        for (Edge& edge : edges_)
+        {
+            if (edge.add_ != ID_BAD)
+                edge.add_ = remap[edge.add_];
+            if (edge.remove_ != ID_BAD)
+                edge.remove_ = remap[edge.remove_];
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    template<class TComponent>
+    TComponent& GetComponent(int row, int column)
+    {
+        if constexpr (std::is_empty_v<TComponent>)
+        {
+            return internal::TagInstance<RemoveCvRef_t<TComponent>>::value_;
+        }
+        else
+        {
+            auto& result = *reinterpret_cast<TComponent*>(GetElementData(row, column));
+            return result;
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    void SetComponent(int rowIdx, int componentTypeId, void* value)
+    {
+        HS_ASSERT(componentTypeId != ID_BAD);
+
+        auto componentIdx = FindComponent(componentTypeId);
+        Element element = GetElement(rowIdx, componentIdx);
+
+        if (element.details_->isTrivial_)
+        {
+            memcpy(element.data_, value, element.details_->size_);
+        }
+        else
+        {
+            element.details_->dtor_(element.data_);
+            element.details_->copyCtor_(element.data_, value);
+        }
+
+        MarkElementChanged(rowIdx, componentIdx);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Replaces the component with value, value is left in a moved-from state
+    void MoveComponent(int rowIdx, int componentTypeId, void* value)
+    {
+        HS_ASSERT(componentTypeId != ID_BAD);
+
+        auto componentIdx = FindComponent(componentTypeId);
+        Element element = GetElement(rowIdx, componentIdx);
+
+        if (element.details_->isTrivial_)
+        {
+            memcpy(element.data_, value, element.details_->size_);
+        }
+        else
+        {
+            element.details_->dtor_(element.data_);
+            element.details_->moveCtor_(element.data_, value);
+        }
+
+        MarkElementChanged(rowIdx, componentIdx);
+    }
+
+    //------------------------------------------------------------------------------
+    template<class TComponent, class... TRest>
+    void SetComponents(int rowIdx, const TComponent& value, const TRest... rest)
+    {
+        SetComponent(rowIdx, value);
+        SetComponents(rowIdx, rest...);
+    }
+
+    //------------------------------------------------------------------------------
+    template<class TComponent>
+    void SetComponents(int rowIdx, const TComponent& value)
+    {
+        SetComponent(rowIdx, value);
+    }
+
+    //------------------------------------------------------------------------------
+    int AddEntity(Entity_t eid)
+    {
+        EnsureCapacity();
+
+        Element entityElement = GetElement(rowCount_, 0);
+        memcpy(entityElement.data_, &eid, sizeof(eid));
+
+        for (int i = 1; i < columns_.Count(); ++i)
+            ConstructElement(details_[i], GetElementData(rowCount_, i));
+
+        MarkRowChanged(rowCount_);
+        peakRowCount_ = Max(peakRowCount_, rowCount_ + 1);
+        return rowCount_++;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Appends a row for eid and moves into it the components it shares with srcRow of src, except those in skipMask
+    //! which are default constructed. Trivially relocatable components are memcpy'd and added to relocatedMask,
+    //! src must not destroy them. Others are move constructed and src is left with a moved-from row.
+    int MoveEntityFrom(Archetype& src, int srcRow, Entity_t eid, const ComponentMask& skipMask, ComponentMask& relocatedMask)
+    {
+        EnsureCapacity();
+        const int row = rowCount_++;
+        peakRowCount_ = Max(peakRowCount_, rowCount_);
+
+        Element entityElement = GetElement(row, 0);
+        memcpy(entityElement.data_, &eid, sizeof(eid));
+
+        for (int i = 1; i < columns_.Count(); ++i)
+        {
+            const int typeId = columns_[i];
+            const TypeDetails* details = details_[i];
+            void* dst = GetElementData(row, i);
+
+            if (!src.mask_.Has(typeId) || skipMask.Has(typeId))
+            {
+                ConstructElement(details, dst);
+                continue;
+            }
+
+            void* value = src.GetElementData(srcRow, src.FindComponent(typeId));
+            if (details->isTrivial_ || details->isTriviallyRelocatable_)
+            {
+                memcpy(dst, value, details->size_);
+                relocatedMask.Set(typeId);
+            }
+            else
+            {
+                details->moveCtor_(dst, value);
+            }
+        }
+
+        MarkRowChanged(row);
+        return row;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Grows the storage so at least capacity rows fit without further allocations
+    void Reserve(int capacity)
+    {
+        if (capacity <= rowCapacity_)
+            return;
+
+        if (storage_ == ArchetypeStorage::Chunked)
+        {
+            // Existing rows never move, just add more chunks
+            while (rowCapacity_ < capacity)
+            {
+                chunks_.Add(AllocateChunk(chunkByteSize_));
+                for (int i = 0; i < columns_.Count(); ++i)
+                    columnVersions_.Add(0);
+                rowCapacity_ += chunkRowCapacity_;
+            }
+            return;
+        }
+
+        int newCapacity = rowCapacity_ ? rowCapacity_ * 2 : CONTIGUOUS_INITIAL_CAPACITY;
+        while (newCapacity < capacity)
+            newCapacity *= 2;
+        HS_ASSERT(newCapacity <= (1 << CONTIGUOUS_CHUNK_SHIFT));
+
+        ReallocateContiguous(newCapacity);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Frees capacity beyond what keepRows rows need, live rows are always kept. Contiguous storage is reallocated to
+    //! the smallest power of two which fits, chunked storage frees its trailing chunks.
+    void ShrinkCapacity(int keepRows)
+    {
+        keepRows = Max(keepRows, rowCount_);
+
+        if (storage_ == ArchetypeStorage::Chunked)
+        {
+            // Chunks of a mapped snapshot are released with the snapshot
+            const int keepChunks = Max((keepRows + chunkRowCapacity_ - 1) >> chunkShift_, borrowedChunkCount_);
+            while (chunks_.Count() > keepChunks)
+            {
+                FreeChunk(chunks_[chunks_.Count() - 1], chunkByteSize_);
+                chunks_.RemoveBack();
+                for (int i = 0; i < columns_.Count(); ++i)
+                    columnVersions_.RemoveBack();
+                rowCapacity_ -= chunkRowCapacity_;
+            }
+            return;
+        }
+
+        if (keepRows == 0)
+        {
+            if (chunks_.Count() && !borrowedChunkCount_)
+                FreeChunk(chunks_[0], chunkByteSize_);
+            chunks_.Clear();
+            columnVersions_.Clear();
+            borrowedChunkCount_ = 0;
+            rowCapacity_ = 0;
+            chunkRowCapacity_ = 0;
+            chunkByteSize_ = 0;
+            return;
+        }
+
+        int newCapacity = CONTIGUOUS_INITIAL_CAPACITY;
+        while (newCapacity < keepRows)
+            newCapacity *= 2;
+
+        if (newCapacity < rowCapacity_)
+            ReallocateContiguous(newCapacity);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Destroys the row and fills the hole with the last row. Components in relocatedMask were already relocated
+    //! away by MoveEntityFrom and are not destroyed.
+    void RemoveRow(int row, const ComponentMask& relocatedMask = {});
+
+    //------------------------------------------------------------------------------
+    //! Reorders the rows so row i holds what was in row order[i]. order has to be a permutation of all rows, it is
+    //! overwritten. Entity records of the moved rows are updated and their chunks marked as changed.
+    void PermuteRows(int* order);
+
+    //------------------------------------------------------------------------------
+    //! Destroys the rows, which have to be sorted and unique, and fills the holes with the rows left past the new end.
+    //! Works column by column so every column is walked once for the whole batch.
+    void RemoveRows(const int* rows, int count);
+
+    //------------------------------------------------------------------------------
+    //! Copies the rows into state. Columns which were not written since sinceVersion, the version of the previous save
+    //! into the same state, are skipped unless the layout changed in the meantime.
+    void SaveState(ArchetypeState& state, uint32 sinceVersion) const
+    {
+        // First save or contiguous storage which was reallocated, every row is copied into new images
+        const bool isSameLayout = state.chunkByteSize_ == chunkByteSize_ && state.chunkRowCapacity_ == chunkRowCapacity_;
+        if (!isSameLayout)
+        {
+            state.Release();
+            state.columns_ = columns_;
+            memcpy(state.columnOffsets_, columnOffsets_, sizeof(columnOffsets_));
+            state.chunkByteSize_ = chunkByteSize_;
+            state.chunkRowCapacity_ = chunkRowCapacity_;
+        }
+
+        const int chunkCount = GetChunkCount();
+        while (state.chunks_.Count() < chunkCount)
+        {
+            auto chunk = (int8*)internal::AlignedAlloc(chunkByteSize_, ARCHETYPE_COLUMN_ALIGNMENT);
+            HS_ASSERT(chunk);
+            state.chunks_.Add(chunk);
+        }
+
+        for (int chunkI = 0; chunkI < state.chunks_.Count(); ++chunkI)
+        {
+            const int stateRowCount = state.GetChunkRowCount(chunkI);
+            const int rowCount = chunkI < chunkCount ? GetChunkRowCount(chunkI) : 0;
+
+            for (int i = 0; i < columns_.Count(); ++i)
+            {
+                // Removing the last row does not mark the chunk, the rows which are left are the same
+                const bool isDirty = !isSameLayout || rowCount > stateRowCount
+                    || (rowCount && GetColumnVersion(chunkI, i) > sinceVersion);
+                if (!isDirty)
+                {
+                    state.DestroyRows(chunkI, i, rowCount, stateRowCount);
+                    continue;
+                }
+
+                state.DestroyRows(chunkI, i, 0, stateRowCount);
+
+                const TypeDetails* details = details_[i];
+                int8* dst = state.GetChunkColumn(chunkI, i);
+                const int8* src = (const int8*)GetChunkColumn(chunkI, i);
+                if (details->isTriviallyCopyable_)
+                {
+                    memcpy(dst, src, rowCount * details->size_);
+                }
+                else
+                {
+                    for (int rowI = 0; rowI < rowCount; ++rowI)
+                        details->copyCtor_(dst + rowI * details->size_, src + rowI * details->size_);
+                }
+            }
+        }
+
+        state.rowCount_ = rowCount_;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Replaces the rows with the ones in state. Columns which were not written since sinceVersion, the version the
+    //! state was saved at, still hold the saved values and are skipped. Restored columns are marked changed.
+    void RestoreState(const ArchetypeState& state, uint32 sinceVersion)
+    {
+        Reserve(state.rowCount_);
+
+        // Contiguous storage may have been reallocated since the save, offsets then differ
+        const bool isSameLayout = state.chunkByteSize_ == chunkByteSize_ && state.chunkRowCapacity_ == chunkRowCapacity_;
+        const int chunkCount = GetChunkCount();
+        const int stateChunkCount = state.rowCount_ ? (state.rowCount_ - 1) / state.chunkRowCapacity_ + 1 : 0;
+
+        for (int chunkI = 0; chunkI < Max(chunkCount, stateChunkCount); ++chunkI)
+        {
+            const int stateRowCount = state.GetChunkRowCount(chunkI);
+            const int rowCount = chunkI < chunkCount ? GetChunkRowCount(chunkI) : 0;
+
+            for (int i = 0; i < columns_.Count(); ++i)
+            {
+                const TypeDetails* details = details_[i];
+                int8* column = (int8*)GetChunkColumn(chunkI, i);
+
+                const bool isDirty = !isSameLayout || stateRowCount > rowCount
+                    || (rowCount && GetColumnVersion(chunkI, i) > sinceVersion);
+                if (!isDirty)
+                {
+                    if (!details->isTriviallyCopyable_)
+                    {
+                        for (int rowI = stateRowCount; rowI < rowCount; ++rowI)
+                            details->dtor_(column + rowI * details->size_);
+                    }
+                    continue;
+                }
+
+                if (!details->isTriviallyCopyable_)
+                {
+                    for (int rowI = 0; rowI < rowCount; ++rowI)
+                        details->dtor_(column + rowI * details->size_);
+                }
+
+                if (stateRowCount)
+                {
+                    const int8* src = state.GetChunkColumn(chunkI, i);
+                    if (details->isTriviallyCopyable_)
+                    {
+                        memcpy(column, src, stateRowCount * details->size_);
+                    }
+                    else
+                    {
+                        for (int rowI = 0; rowI < stateRowCount; ++rowI)
+                            details->copyCtor_(column + rowI * details->size_, src + rowI * details->size_);
+                    }
+
+                    MarkColumnChanged(chunkI, i);
+                }
+            }
+        }
+
+        rowCount_ = state.rowCount_;
+        peakRowCount_ = Max(peakRowCount_, rowCount_);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Layout of chunk images in a snapshot, returns the image size. Contiguous storage is trimmed to the live rows.
+    int GetSnapshotLayout(int& chunkRowCapacity, int* offsets) const
+    {
+        if (storage_ == ArchetypeStorage::Chunked)
+        {
+            chunkRowCapacity = chunkRowCapacity_;
+            memcpy(offsets, columnOffsets_, sizeof(columnOffsets_));
+            return chunkByteSize_;
+        }
+
+        chunkRowCapacity = rowCount_;
+        return ComputeLayout(rowCount_, offsets);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Copies the trivially copyable columns of the chunk into a zeroed image laid out by GetSnapshotLayout
+    void WriteSnapshotChunk(int chunk, int8* image, const int* offsets) const
+    {
+        const int rowCount = GetChunkRowCount(chunk);
+        for (int i = 0; i < columns_.Count(); ++i)
+        {
+            if (details_[i]->isTriviallyCopyable_)
+                memcpy(image + offsets[i], GetChunkColumn(chunk, i), rowCount * details_[i]->size_);
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    //! Uses chunk images of a mapped snapshot as the storage of an empty archetype, nothing is copied. Columns which
+    //! are not trivially copyable are left zeroed for the caller to construct.
+    void AdoptSnapshotChunks(int8* firstChunk, int chunkCount, int chunkStride, int rowCount, int chunkRowCapacity)
+    {
+        HS_ASSERT(rowCount_ == 0);
+
+        for (int chunkI = borrowedChunkCount_; chunkI < chunks_.Count(); ++chunkI)
+            FreeChunk(chunks_[chunkI], chunkByteSize_);
+        chunks_.Clear();
+        columnVersions_.Clear();
+
+        if (storage_ == ArchetypeStorage::Contiguous)
+        {
+            chunkRowCapacity_ = chunkRowCapacity;
+            chunkByteSize_ = ComputeLayout(chunkRowCapacity, columnOffsets_);
+        }
+        HS_ASSERT(chunkRowCapacity == chunkRowCapacity_);
+
+        // Loaded rows count as changed for change filtered iteration
+        for (int chunkI = 0; chunkI < chunkCount; ++chunkI)
+        {
+            chunks_.Add(firstChunk + (int64)chunkI * chunkStride);
+            for (int i = 0; i < columns_.Count(); ++i)
+                columnVersions_.Add(GetChangeVersion());
+        }
+
+        borrowedChunkCount_ = chunkCount;
+        rowCount_ = rowCount;
+        rowCapacity_ = chunkCount * chunkRowCapacity_;
+        peakRowCount_ = rowCount_;
+    }
+
+    //------------------------------------------------------------------------------
+    struct Element
+    {
+        void* data_;
+        const TypeDetails* details_;
+    };
+
+    //------------------------------------------------------------------------------
+    Element GetElement(int row, int column)
+    {
+        Element element;
+        element.data_ = GetElementData(row, column);
+        element.details_ = details_[column];
+        return element;
+    }
+
+private:
+    //------------------------------------------------------------------------------
+    // Cached transitions to neighboring archetypes, indexed by component type id
+    struct Edge
+    {
+        int add_{ ID_BAD };
+        int remove_{ ID_BAD };
+    };
+
+    // Contiguous storage keeps all rows in chunk 0
+    static constexpr int CONTIGUOUS_CHUNK_SHIFT = 30;
+    static constexpr int CONTIGUOUS_INITIAL_CAPACITY = 8;
+
+    EcsWorld* world_;
+    Type_t type_;
+    ComponentMask mask_;
+    // Shared components in type order and the ids of their values in the world
+    int sharedTypeIds_[MAX_SHARED_COMPONENTS];
+    int sharedValues_[MAX_SHARED_COMPONENTS];
+    int sharedCount_{};
+    // Type without tags and shared components, one column per component
+    Type_t columns_;
+    ComponentMask columnMask_;
+    ArchetypeStorage storage_;
+    const TypeDetails* details_[MAX_ARCHETYPE_COMPONENTS];
+    // Byte offset of each column from the start of a chunk
+    int columnOffsets_[MAX_ARCHETYPE_COMPONENTS];
+    Array<int8*> chunks_;
+    // Leading chunks which point into a mapped snapshot, they are not freed by the archetype
+    int borrowedChunkCount_{};
+    // Change version of every column in every chunk, indexed by chunk * columns_.Count() + column
+    Array<uint32> columnVersions_;
+    Array<Edge> edges_;
+    int chunkShift_;
+    int chunkRowCapacity_;
+    int chunkByteSize_;
+    int rowCount_{};
+    int rowCapacity_{};
+    int peakRowCount_{};
+    mutable internal::RelaxedCounter queryCount_;
+
+    //------------------------------------------------------------------------------
+    void EnsureEdge(int componentTypeId)
+    {
+        while (edges_.Count() <= componentTypeId)
+            edges_.Add(Edge{});
+    }
+
+    //------------------------------------------------------------------------------
+    void* GetElementData(int row, int column) const
+    {
+        HS_ASSERT(row < rowCapacity_);
+        const int rowInChunk = row & ((1 << chunkShift_) - 1);
+        return chunks_[row >> chunkShift_] + columnOffsets_[column] + rowInChunk * details_[column]->size_;
+    }
+
+    //------------------------------------------------------------------------------
+    int GetEntityId(int row)
+    {
+        auto element = GetElement(row, 0);
+        return *(Entity_t*)element.data_;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Fills column offsets for a chunk of rowCount rows, returns the size of the chunk in bytes
+    int ComputeLayout(int rowCount, int* offsets) const
+    {
+        int offset = 0;
+        for (int i = 0; i < columns_.Count(); ++i)
+        {
+            offset = internal::AlignUp(offset, Max(details_[i]->alignment_, ARCHETYPE_COLUMN_ALIGNMENT));
+            offsets[i] = offset;
+            offset += rowCount * details_[i]->size_;
+        }
+
+        return internal::AlignUp(offset, ARCHETYPE_COLUMN_ALIGNMENT);
+    }
+
+    //------------------------------------------------------------------------------
+    uint32 GetChangeVersion() const;
+
+    //------------------------------------------------------------------------------
+    //! Chunks come from the allocator of the world
+    int8* AllocateChunk(int byteSize);
+
+    //------------------------------------------------------------------------------
+    void FreeChunk(int8* chunk, int byteSize);
+
+    //------------------------------------------------------------------------------
+    static void ConstructElement(const TypeDetails* details, void* data)
+    {
+        if (details->isTrivial_)
+            memset(data, 0, details->size_);
+        else
+            details->ctor_(data);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Moves the element to raw memory at dst, src is dead afterwards
+    static void RelocateElement(const TypeDetails* details, void* dst, void* src)
+    {
+        if (details->isTrivial_ || details->isTriviallyRelocatable_)
+        {
+            memcpy(dst, src, details->size_);
+        }
+        else
+        {
+            details->moveCtor_(dst, src);
+            details->dtor_(src);
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    void DestroyRows(int firstRow, int endRow, const ComponentMask& skipMask)
+    {
+        for (int i = 0; i < columns_.Count(); ++i)
+        {
+            if (details_[i]->isTrivial_ || skipMask.Has(columns_[i]))
+                continue;
+
+            for (int rowI = firstRow; rowI < endRow; ++rowI)
+                details_[i]->dtor_(GetElementData(rowI, i));
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    //! Moves the rows of contiguous storage to a new allocation of newCapacity rows
+    void ReallocateContiguous(int newCapacity)
+    {
+        HS_ASSERT(storage_ == ArchetypeStorage::Contiguous && newCapacity >= rowCount_);
+        const int oldCapacity = rowCapacity_;
+
+        int newOffsets[MAX_ARCHETYPE_COMPONENTS];
+        const int newByteSize = ComputeLayout(newCapacity, newOffsets);
+
+        int8* newChunk = AllocateChunk(newByteSize);
+
+        if (oldCapacity)
+        {
+            // Only live rows are relocated, the rest of the capacity is raw memory
+            int8* oldChunk = chunks_[0];
+            for (int i = 0; i < columns_.Count(); ++i)
+            {
+                const TypeDetails* details = details_[i];
+                int8* dst = newChunk + newOffsets[i];
+                int8* src = oldChunk + columnOffsets_[i];
+
+                if (details->isTrivial_ || details->isTriviallyRelocatable_)
+                {
+                    memcpy(dst, src, rowCount_ * details->size_);
+                }
+                else
+                {
+                    for (int rowI = 0; rowI < rowCount_; ++rowI)
+                    {
+                        details->moveCtor_(dst + rowI * details->size_, src + rowI * details->size_);
+                        details->dtor_(src + rowI * details->size_);
+                    }
+                }
+            }
+
+            // Memory of a loaded snapshot is released with the snapshot
+            if (borrowedChunkCount_)
+                borrowedChunkCount_ = 0;
+            else
+                FreeChunk(oldChunk, chunkByteSize_);
+            chunks_[0] = newChunk;
+        }
+        else
+        {
+            chunks_.Add(newChunk);
+            for (int i = 0; i < columns_.Count(); ++i)
+                columnVersions_.Add(0);
+        }
+
+        memcpy(columnOffsets_, newOffsets, sizeof(newOffsets));
+        rowCapacity_ = newCapacity;
+        chunkRowCapacity_ = newCapacity;
+        chunkByteSize_ = newByteSize;
+    }
+
+    //------------------------------------------------------------------------------
+    void EnsureCapacity()
+    {
+        if (rowCount_ < rowCapacity_)
+            return;
+
+        HS_ASSERT(rowCount_ == rowCapacity_);
+        Reserve(rowCount_ + 1);
+    }
+
+    //------------------------------------------------------------------------------
+    template<class TComponent>
+    void SetComponent(int rowIdx, const TComponent& value)
+    {
+        // Tags have no data, sparse and shared components are set by the world
+        if constexpr (std::is_empty_v<TComponent> || IsSparseComponent_v<TComponent> || IsSharedComponent_v<TComponent>)
+            return;
+
+        auto componentId = FindComponent<TComponent>();
+        HS_ASSERT(componentId != ID_BAD);
+        HS_ASSERT(rowIdx < rowCount_);
+
+        *static_cast<TComponent*>(GetElementData(rowIdx, componentId)) = value;
+        MarkElementChanged(rowIdx, componentId);
+    }
+};
+
+//------------------------------------------------------------------------------
+//! List of archetypes matching a query together with the query's column indices in each of them.
+//! Registered queries are updated by the world whenever a new archetype is created.
+class QueryCache
+{
+public:
+    //------------------------------------------------------------------------------
+    struct Match
+    {
+        int archetype_;
+        int columns_[MAX_ARCHETYPE_COMPONENTS];
+    };
+
+    //------------------------------------------------------------------------------
+    QueryCache(const ComponentMask& includeMask, const ComponentMask& excludeMask, Span<const int> typeIds)
+        : includeMask_(includeMask)
+        , excludeMask_(excludeMask)
+    {
+        for (int i = 0; i < typeIds.Count(); ++i)
+            typeIds_.Add(typeIds[i]);
+    }
+
+    //------------------------------------------------------------------------------
+    void OnArchetypeCreated(int archetypeIdx, const Archetype& archetype)
+    {
+        const ComponentMask& mask = archetype.GetMask();
+        if (!mask.Contains(includeMask_) || mask.Intersects(excludeMask_))
+            return;
+
+        Match match;
+        match.archetype_ = archetypeIdx;
+        for (int i = 0; i < typeIds_.Count(); ++i)
+            match.columns_[i] = archetype.FindComponent(typeIds_[i]);
+
+        matches_.Add(match);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Updates matches after archetypes were removed, remap holds the new index of every old one or ID_BAD
+    void RemapArchetypes(const int* remap)
+    {
+        int keptCount = 0;
+        for (int i = 0; i < matches_.Count(); ++i)
+        {
+            const int archetypeIdx = remap[matches_[i].archetype_];
+            if (archetypeIdx == ID_BAD)
+                continue;
+
+            matches_[keptCount] = matches_[i];
+            matches_[keptCount].archetype_ = archetypeIdx;
+            ++keptCount;
+        }
+
+        while (matches_.Count() > keptCount)
+            matches_.RemoveBack();
+    }
+
+    //------------------------------------------------------------------------------
+    int GetMatchCount() const
+    {
+        return matches_.Count();
+    }
+
+    //------------------------------------------------------------------------------
+    const Match& GetMatch(int i) const
+    {
+        return matches_[i];
+    }
+
+    //------------------------------------------------------------------------------
+    //! World change version at the last change filtered iteration, 0 if there was none
+    uint32 GetLastChangeVersion() const
+    {
+        return lastChangeVersion_;
+    }
+
+    //------------------------------------------------------------------------------
+    void SetLastChangeVersion(uint32 version)
+    {
+        lastChangeVersion_ = version;
+    }
+
+private:
+    ComponentMask includeMask_;
+    ComponentMask excludeMask_;
+    ComponentTypeList typeIds_;
+    Array<Match> matches_;
+    uint32 lastChangeVersion_{};
+};
+
+//------------------------------------------------------------------------------
+//! Records structural changes to be applied later by EcsWorld::FlushCommands. Component values are copied
+//! into blocks owned by the buffer, the blocks are reused after the buffer is flushed.
+class EcsCommandBuffer
+{
+    friend class EcsWorld;
+
+public:
+    //------------------------------------------------------------------------------
+    EcsCommandBuffer() = default;
+
+    //------------------------------------------------------------------------------
+    ~EcsCommandBuffer()
+    {
+        Clear();
+        for (int i = 0; i < blocks_.Count(); ++i)
+            internal::AlignedFree(blocks_[i].data_);
+    }
+
+    //------------------------------------------------------------------------------
+    EcsCommandBuffer(const EcsCommandBuffer&) = delete;
+
+    //------------------------------------------------------------------------------
+    EcsCommandBuffer& operator=(const EcsCommandBuffer&) = delete;
+
+    //------------------------------------------------------------------------------
+    //! The entity id is assigned when the buffer is flushed
+    template<class... TComponents>
+    void CreateEntity(const TComponents&... components)
+    {
+        AddCommand(CommandType::Create, ID_BAD, components...);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Adds the components the entity does not have yet and overwrites the rest
+    template<class... TComponents>
+    void SetComponents(Entity_t entity, const TComponents&... components)
+    {
+        static_assert(sizeof...(TComponents) > 0);
+        AddCommand(CommandType::Set, entity, components...);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Removing components the entity does not have is allowed
+    template<class... TComponents>
+    void RemoveComponents(Entity_t entity)
+    {
+        static_assert(sizeof...(TComponents) > 0);
+        AddCommand(CommandType::Remove, entity);
+
+        // Removals carry only the type ids
+        commands_[commands_.Count() - 1].valueCount_ = (int)sizeof...(TComponents);
+        (values_.Add(ComponentValue{ TypeInfo<TComponents>::TypeId(), nullptr }), ...);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Deleting the same entity multiple times is allowed, commands setting its components are dropped
+    void DeleteEntity(Entity_t entity)
+    {
+        AddCommand(CommandType::Delete, entity);
+    }
+
+    //------------------------------------------------------------------------------
+    bool IsEmpty() const
+    {
+        return commands_.Count() == 0;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Drops all recorded commands without applying them
+    void Clear()
+    {
+        for (int i = 0; i < values_.Count(); ++i)
+        {
+            const TypeDetails* details = TypeInfoDb::GetDetails(values_[i].typeId_);
+            if (values_[i].data_ && !details->isTrivial_)
+                details->dtor_(values_[i].data_);
+        }
+
+        commands_.Clear();
+        values_.Clear();
+        blockIdx_ = 0;
+        blockOffset_ = 0;
+    }
+
+private:
+    //------------------------------------------------------------------------------
+    enum class CommandType : uint8
+    {
+        Create,
+        Set,
+        Remove,
+        Delete,
+    };
+
+    //------------------------------------------------------------------------------
+    struct Command
+    {
+        CommandType type_;
+        Entity_t entity_;
+        int firstValue_;
+        int valueCount_;
+    };
+
+    //------------------------------------------------------------------------------
+    struct ComponentValue
+    {
+        int typeId_;
+        void* data_;
+    };
+
+    //------------------------------------------------------------------------------
+    struct Block
+    {
+        int8* data_;
+        int size_;
+    };
+
+    Array<Command> commands_;
+    Array<ComponentValue> values_;
+    Array<Block> blocks_;
+    int blockIdx_{};
+    int blockOffset_{};
+
+    //------------------------------------------------------------------------------
+    template<class... TComponents>
+    void AddCommand(CommandType type, Entity_t entity, const TComponents&... components)
+    {
+        Command command;
+        command.type_ = type;
+        command.entity_ = entity;
+        command.firstValue_ = values_.Count();
+        command.valueCount_ = (int)sizeof...(TComponents);
+        commands_.Add(command);
+
+        (AddValue(components), ...);
+    }
+
+    //------------------------------------------------------------------------------
+    template<class TComponent>
+    void AddValue(const TComponent& component)
+    {
+        ComponentValue value;
+        value.typeId_ = TypeInfo<TComponent>::TypeId();
+        value.data_ = nullptr;
+
+        // Tags are fully described by their type id
+        if constexpr (!std::is_empty_v<TComponent>)
+        {
+            value.data_ = Allocate(sizeof(TComponent), alignof(TComponent));
+            new (value.data_) TComponent(component);
+        }
+
+        values_.Add(value);
+    }
+
+    //------------------------------------------------------------------------------
+    void* Allocate(int size, int alignment)
+    {
+        for (; blockIdx_ < blocks_.Count(); ++blockIdx_, blockOffset_ = 0)
+        {
+            const int offset = internal::AlignUp(blockOffset_, alignment);
+            if (offset + size <= blocks_[blockIdx_].size_)
+            {
+                blockOffset_ = offset + size;
+                return blocks_[blockIdx_].data_ + offset;
+            }
+        }
+
+        // Blocks are aligned to ARCHETYPE_COLUMN_ALIGNMENT which covers the alignment of every component
+        Block block;
+        block.size_ = Max(COMMAND_BUFFER_BLOCK_SIZE, internal::AlignUp(size, ARCHETYPE_COLUMN_ALIGNMENT));
+        block.data_ = (int8*)internal::AlignedAlloc(block.size_, ARCHETYPE_COLUMN_ALIGNMENT);
+        HS_ASSERT(block.data_);
+        blocks_.Add(block);
+
+        blockIdx_ = blocks_.Count() - 1;
+        blockOffset_ = size;
+        return block.data_;
+    }
+};
+
+//------------------------------------------------------------------------------
+//! Values of one sparse component type, see IsSparseComponent. The values are packed, indices_ maps the entity index
+//! to the position of its value so lookup, addition and removal are O(1). Additions may move the values, references to
+//! them are valid until the next value of the type is added.
+class SparseSet
+{
+public:
+    //------------------------------------------------------------------------------
+    //! Values are allocated by the world's allocator, copies kept by EcsWorldState have no world and use the heap
+    SparseSet(int typeId, EcsWorld* world)
+        : details_(TypeInfoDb::GetDetails(typeId))
+        , world_(world)
+    {
+        HS_ASSERT(details_->isSparse_);
+    }
+
+    //------------------------------------------------------------------------------
+    ~SparseSet()
+    {
+        Clear();
+        FreeValues();
+    }
+
+    //------------------------------------------------------------------------------
+    SparseSet(const SparseSet&) = delete;
+
+    //------------------------------------------------------------------------------
+    SparseSet& operator=(const SparseSet&) = delete;
+
+    //------------------------------------------------------------------------------
+    //! Value of the entity, null when the entity does not have the component
+    void* Find(Entity_t entity) const
+    {
+        const int index = GetEntityIndex(entity);
+        if (index >= indices_.Count())
+            return nullptr;
+
+        const int valueIdx = indices_[index];
+        if (valueIdx == ID_BAD || entities_[valueIdx] != entity)
+            return nullptr;
+
+        return GetValue(valueIdx);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Adds a default constructed value, the entity must not have one yet
+    void* Add(Entity_t entity)
+    {
+        void* value = AddUninitialized(entity);
+        if (details_->isTrivial_)
+            memset(value, 0, details_->size_);
+        else
+            details_->ctor_(value);
+        return value;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Adds or replaces the value of the entity, value is left in a moved-from state
+    void Move(Entity_t entity, void* value)
+    {
+        void* dst = Find(entity);
+        if (!dst)
+        {
+            dst = AddUninitialized(entity);
+        }
+        else if (!details_->isTrivial_)
+        {
+            details_->dtor_(dst);
+        }
+
+        if (details_->isTrivial_)
+            memcpy(dst, value, details_->size_);
+        else
+            details_->moveCtor_(dst, value);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Destroys the value of the entity, the last value takes its place. Returns false if the entity had none.
+    bool Remove(Entity_t entity)
+    {
+        void* value = Find(entity);
+        if (!value)
+            return false;
+
+        const int index = GetEntityIndex(entity);
+        const int valueIdx = indices_[index];
+        const int lastIdx = entities_.Count() - 1;
+
+        if (!details_->isTrivial_)
+            details_->dtor_(value);
+
+        if (valueIdx != lastIdx)
+        {
+            Relocate(value, GetValue(lastIdx));
+            entities_[valueIdx] = entities_[lastIdx];
+            indices_[GetEntityIndex(entities_[valueIdx])] = valueIdx;
+        }
+
+        entities_.RemoveBack();
+        indices_[index] = ID_BAD;
+        return true;
+    }
+
+    //------------------------------------------------------------------------------
+    void Clear()
+    {
+        for (int i = 0; i < entities_.Count(); ++i)
+        {
+            if (!details_->isTrivial_)
+                details_->dtor_(GetValue(i));
+            indices_[GetEntityIndex(entities_[i])] = ID_BAD;
+        }
+
+        entities_.Clear();
+    }
+
+    //------------------------------------------------------------------------------
+    //! Makes the set a copy of other, both have to hold the same type
+    void CopyFrom(const SparseSet& other)
+    {
+        HS_ASSERT(details_ == other.details_);
+
+        Clear();
+        Reserve(other.entities_.Count());
+        for (int i = 0; i < other.entities_.Count(); ++i)
+        {
+            if (details_->isTriviallyCopyable_)
+                memcpy(GetValue(i), other.GetValue(i), details_->size_);
+            else
+                details_->copyCtor_(GetValue(i), other.GetValue(i));
+        }
+
+        entities_ = other.entities_;
+        indices_ = other.indices_;
+    }
+
+    //------------------------------------------------------------------------------
+    int GetCount() const
+    {
+        return entities_.Count();
+    }
+
+    //------------------------------------------------------------------------------
+    int64 GetAllocatedBytes() const
+    {
+        return (int64)capacity_ * details_->size_ + (int64)(entities_.Count() + indices_.Count()) * sizeof(int);
+    }
+
+private:
+    const TypeDetails* details_;
+    EcsWorld* world_;
+    int8* values_{};
+    int capacity_{};
+    // Entity of every value
+    Array<Entity_t> entities_;
+    // Position of the value indexed by the entity index, ID_BAD for entities without the component
+    Array<int> indices_;
+
+    //------------------------------------------------------------------------------
+    void* GetValue(int valueIdx) const
+    {
+        return values_ + (size_t)valueIdx * details_->size_;
+    }
+
+    //------------------------------------------------------------------------------
+    void* AddUninitialized(Entity_t entity)
+    {
+        HS_ASSERT(!Find(entity) && "Entity already has the component");
+
+        const int index = GetEntityIndex(entity);
+        while (indices_.Count() <= index)
+            indices_.Add(ID_BAD);
+
+        if (entities_.Count() == capacity_)
+            Reserve(Max(capacity_ * 2, 16));
+
+        indices_[index] = entities_.Count();
+        entities_.Add(entity);
+        return GetValue(entities_.Count() - 1);
+    }
+
+    //------------------------------------------------------------------------------
+    void Reserve(int capacity)
+    {
+        if (capacity <= capacity_)
+            return;
+
+        int8* values = AllocateValues(capacity);
+        for (int i = 0; i < entities_.Count(); ++i)
+            Relocate(values + (size_t)i * details_->size_, GetValue(i));
+
+        FreeValues();
+        values_ = values;
+        capacity_ = capacity;
+    }
+
+    //------------------------------------------------------------------------------
+    int8* AllocateValues(int capacity);
+
+    //------------------------------------------------------------------------------
+    void FreeValues();
+
+    //------------------------------------------------------------------------------
+    //! Moves the value to raw memory at dst, src is dead afterwards
+    void Relocate(void* dst, void* src)
+    {
+        if (details_->isTrivial_ || details_->isTriviallyRelocatable_)
+        {
+            memcpy(dst, src, details_->size_);
+        }
+        else
+        {
+            details_->moveCtor_(dst, src);
+            details_->dtor_(src);
+        }
+    }
+};
+
+//------------------------------------------------------------------------------
+//! Growable array of trivially copyable elements, used for the entity tables of a world. The memory comes from the
+//! world's allocator, copies kept by EcsWorldState have no world and use the heap.
+template<class T>
+class EcsPodArray
+{
+    static_assert(std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>, "Elements are copied with memcpy");
+
+public:
+    //------------------------------------------------------------------------------
+    explicit EcsPodArray(EcsWorld* world)
+        : world_(world)
+    {
+    }
+
+    //------------------------------------------------------------------------------
+    ~EcsPodArray()
+    {
+        FreeData();
+    }
+
+    //------------------------------------------------------------------------------
+    EcsPodArray(const EcsPodArray&) = delete;
+
+    //------------------------------------------------------------------------------
+    EcsPodArray& operator=(const EcsPodArray&) = delete;
+
+    //------------------------------------------------------------------------------
+    void Add(const T& value)
+    {
+        if (count_ == capacity_)
+            Reserve(Max(capacity_ * 2, 64));
+
+        data_[count_++] = value;
+    }
+
+    //------------------------------------------------------------------------------
+    void Reserve(int capacity)
+    {
+        if (capacity <= capacity_)
+            return;
+
+        T* data = AllocateData(capacity);
+        if (count_)
+            memcpy(data, data_, (size_t)count_ * sizeof(T));
+
+        FreeData();
+        data_ = data;
+        capacity_ = capacity;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Makes the array a copy of other, the memory is kept when it is big enough
+    void CopyFrom(const EcsPodArray& other)
+    {
+        count_ = 0;
+        Reserve(other.count_);
+        if (other.count_)
+            memcpy(data_, other.data_, (size_t)other.count_ * sizeof(T));
+        count_ = other.count_;
+    }
+
+    //------------------------------------------------------------------------------
+    int Count() const
+    {
+        return count_;
+    }
+
+    //------------------------------------------------------------------------------
+    T& operator[](int i)
+    {
+        HS_ASSERT(i >= 0 && i < count_);
+        return data_[i];
+    }
+
+    //------------------------------------------------------------------------------
+    const T& operator[](int i) const
+    {
+        HS_ASSERT(i >= 0 && i < count_);
+        return data_[i];
+    }
+
+    //------------------------------------------------------------------------------
+    T* Data()
+    {
+        return data_;
+    }
+
+    //------------------------------------------------------------------------------
+    const T* Data() const
+    {
+        return data_;
+    }
+
+private:
+    EcsWorld* world_;
+    T* data_{};
+    int count_{};
+    int capacity_{};
+
+    //------------------------------------------------------------------------------
+    T* AllocateData(int capacity);
+
+    //------------------------------------------------------------------------------
+    void FreeData();
+};
+
+//------------------------------------------------------------------------------
+//! Memory use of one archetype, reported by EcsWorld::GetStats
+struct EcsArchetypeStats
+{
+    int archetype_;
+    int rowCount_;
+    int rowCapacity_;
+    //! Most rows the archetype had since the last EcsWorld::Compact
+    int peakRowCount_;
+    //! Allocated chunks including empty ones, contiguous storage has at most one
+    int chunkCount_;
+    int columnCount_;
+    int columnTypeIds_[MAX_ARCHETYPE_COMPONENTS];
+    //! Capacity of each column in bytes
+    int64 columnBytes_[MAX_ARCHETYPE_COMPONENTS];
+    int64 allocatedBytes_;
+    //! Allocated bytes not holding live rows, unused capacity and alignment padding
+    int64 wastedBytes_;
+    //! Number of times a query iteration visited the archetype
+    uint32 queryCount_;
+};
+
+//------------------------------------------------------------------------------
+struct EcsStats
+{
+    Array<EcsArchetypeStats> archetypes_;
+    int entityCount_;
+    int emptyArchetypeCount_;
+    int64 allocatedBytes_;
+    int64 wastedBytes_;
+    //! Memory of the sparse sets, included in allocatedBytes_
+    int64 sparseBytes_;
+    int sparseValueCount_;
+    //! Distinct values of shared components, each stored once
+    int sharedValueCount_;
+    EcsAllocatorStats allocator_;
+};
+
+class EcsWorldState;
+
+//------------------------------------------------------------------------------
+// Class that has all the types and entities
+class EcsWorld
+{
+    friend class Archetype;
+    friend class EcsWorldState;
+
+public:
+    //------------------------------------------------------------------------------
+    //! Column, sparse and shared storage and the entity tables come from allocator, which has to outlive the world. The
+    //! world uses its own EcsPoolAllocator when it is null.
+    explicit EcsWorld(ArchetypeStorage storage = ArchetypeStorage::Contiguous, EcsAllocator* allocator = nullptr)
+        : allocator_(allocator ? allocator : &defaultAllocator_)
+        , storage_(storage)
+    {
+        Archetype emptyArchetype(this, { 0 }, storage_);
+        archetypeIndex_.emplace(emptyArchetype.GetKey(), 0);
+        archetypes_.Add(std::move(emptyArchetype));
+
+        AddThreadBuffers(1);
+    }
+
+    //------------------------------------------------------------------------------
+    ~EcsWorld()
+    {
+        // Rows of archetypes loaded from a snapshot have to be destroyed while the snapshot is still mapped
+        archetypes_.Clear();
+
+        for (int i = 0; i < iterQueries_.Count(); ++i)
+            delete iterQueries_[i];
+
+        for (int i = 0; i < commandBuffers_.Count(); ++i)
+            delete commandBuffers_[i];
+
+        for (int i = 0; i < deleteScratch_.Count(); ++i)
+            delete deleteScratch_[i];
+
+        for (int i = 0; i < sparseSets_.Count(); ++i)
+            delete sparseSets_[i];
+
+        for (int i = 0; i < sharedValues_.Count(); ++i)
+            FreeMemory(sharedValues_[i].data_, TypeInfoDb::GetDetails(sharedValues_[i].typeId_)->size_);
+
+        FreeMemory(sortKeys_, sortKeysSize_);
+        FreeMemory(elementScratch_, elementScratchSize_);
+    }
+
+    //------------------------------------------------------------------------------
+    EcsWorld(const EcsWorld&) = delete;
+
+    //------------------------------------------------------------------------------
+    EcsWorld& operator=(const EcsWorld&) = delete;
+
+    //------------------------------------------------------------------------------
+    //! Not allowed during iteration, adding the row can move the rows being visited. Record the creation with
+    //! GetCommands().CreateEntity() instead.
+    Entity_t CreateEntity()
+    {
+        HS_ASSERT(!isInParallel_ && "Use GetCommands() to make structural changes from ParallelEach");
+        HS_ASSERT(!IsIterating() && "Use GetCommands().CreateEntity() during iteration");
+        return AllocateEntity(0);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Places the entity directly into the archetype with TComponents, no migration from the empty archetype. Not
+    //! allowed during iteration, see CreateEntity().
+    template<class... TComponents>
+    Entity_t CreateEntity(TComponents... components)
+    {
+        HS_ASSERT(!isInParallel_ && "Use GetCommands() to make structural changes from ParallelEach");
+        HS_ASSERT(!IsIterating() && "Use GetCommands().CreateEntity() during iteration");
+
+        int archetypeIdx = 0;
+        ((archetypeIdx = GetSetTarget(archetypeIdx, components)), ...);
+
+        const Entity_t entity = AllocateEntity(archetypeIdx);
+        archetypes_[archetypeIdx].SetComponents(GetRecord(entity).rowIndex_, components...);
+        (SetSparseComponent(entity, components), ...);
+        return entity;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Creates count entities with exactly TComponents in one pass, the components are default constructed and
+    //! then passed to init(int idx, TComponents&... components) to be filled in
+    template<class... TComponents, class TFun>
+    void CreateEntities(int count, TFun init)
+    {
+        HS_ASSERT(!isInParallel_ && "Use GetCommands() to make structural changes from ParallelEach");
+        HS_ASSERT(!IsIterating() && "Use GetCommands().CreateEntity() during iteration");
+
+        const int archetypeIdx = GetArchetype<TComponents...>();
+        Reserve<TComponents...>(count);
+
+        const Archetype& archetype = archetypes_[archetypeIdx];
+        const int columns[] = { archetype.FindComponent<TComponents>()... };
+
+        for (int i = 0; i < count; ++i)
+        {
+            const Entity_t entity = AllocateEntity(archetypeIdx);
+            (AddSparseComponent<TComponents>(entity), ...);
+            InitEntityHelper<TComponents...>(archetypeIdx, entity, GetRecord(entity).rowIndex_, columns, i, init, std::index_sequence_for<TComponents...>());
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    //! Creates one entity per element of the spans which all have to have the same count. Entities with shared
+    //! components are created one by one since their values decide the archetype.
+    template<class... TComponents>
+    void CreateEntities(Span<TComponents>... components)
+    {
+        static_assert(sizeof...(TComponents) > 0);
+
+        const uint counts[] = { components.Count()... };
+        for (uint count : counts)
+            HS_ASSERT(count == counts[0]);
+
+        if constexpr ((IsSharedComponent_v<TComponents> || ...))
+        {
+            for (uint i = 0; i < counts[0]; ++i)
+                CreateEntity(RemoveCvRef_t<TComponents>(components[i])...);
+        }
+        else
+        {
+            CreateEntities<RemoveCvRef_t<TComponents>...>((int)counts[0], [&components...](int i, RemoveCvRef_t<TComponents>&... dst)
+            {
+                ((dst = components[i]), ...);
+            });
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    //! Preallocates space for count more entities with exactly TComponents so creating them does not reallocate
+    template<class... TComponents>
+    void Reserve(int count)
+    {
+        HS_ASSERT(!IsIterating() && "Reserving can move the rows being iterated");
+
+        const int archetypeIdx = GetArchetype<TComponents...>();
+        archetypes_[archetypeIdx].Reserve(archetypes_[archetypeIdx].GetRowCount() + count);
+
+        dense_.Reserve(denseUsedCount_ + count);
+        records_.Reserve(denseUsedCount_ + count);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Deletes the entity right away, during iteration the deletion is recorded to GetCommands() instead
+    void DeleteEntity(Entity_t entity)
+    {
+        if (!IsIterating())
+            EntityDeleteOperation(this, entity).Execute();
+        else
+            GetCommands().DeleteEntity(entity);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Deletes all the entities at once, rows are removed archetype by archetype with one pass over each column.
+    //! During iteration the deletions are recorded to GetCommands() instead. Entities may repeat.
+    void DeleteEntities(Span<const Entity_t> entities)
+    {
+        if (!IsIterating())
+        {
+            DeleteEntitiesNow(entities.Data(), (int)entities.Count());
+            return;
+        }
+
+        EcsCommandBuffer& commands = GetCommands();
+        for (Entity_t entity : entities)
+            commands.DeleteEntity(entity);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Command buffer of the calling thread, it is flushed when the outermost iteration ends or by FlushCommands.
+    //! Safe to use from ParallelEach, every job system thread records to its own buffer.
+    EcsCommandBuffer& GetCommands()
+    {
+        const int threadIdx = isInParallel_ ? JobSystem::GetCurrentThreadIdx() : 0;
+        HS_ASSERT(threadIdx < commandBuffers_.Count());
+        return *commandBuffers_[threadIdx];
+    }
+
+    //------------------------------------------------------------------------------
+    //! Writes entities, archetypes and their rows to a binary file. Trivially copyable columns are written as raw
+    //! memory, other components need a SnapshotSerializer. Pointers are written as they are, so a snapshot of components
+    //! referencing other objects is only valid while those objects live.
+    RESULT SaveSnapshot(const char* path) const;
+
+    //------------------------------------------------------------------------------
+    //! Restores a snapshot into a world without entities. The file is mapped and its chunk images become the storage of
+    //! the archetypes, only components with a SnapshotSerializer are loaded row by row. The components have to be
+    //! registered in the same order as when the snapshot was saved.
+    RESULT LoadSnapshot(const char* path);
+
+    //------------------------------------------------------------------------------
+    //! Copies the entities and all their components into state. Saving into a state which already holds an earlier
+    //! save of this world copies only the chunks written since then.
+    void SaveState(EcsWorldState& state);
+
+    //------------------------------------------------------------------------------
+    //! Rolls the world back or forward to a state saved from it, only chunks written since the save are copied back
+    void RestoreState(const EcsWorldState& state);
+
+    //------------------------------------------------------------------------------
+    //! Fills stats with the memory use of every archetype, the arrays of stats are reused
+    void GetStats(EcsStats& stats) const;
+
+    //------------------------------------------------------------------------------
+    //! Frees capacity archetypes did not need since the last compaction and drops archetypes which stayed empty the
+    //! whole time, so queries no longer scan them. Returns the number of dropped archetypes. States saved before
+    //! archetypes were dropped can't be restored.
+    int Compact();
+
+    //------------------------------------------------------------------------------
+    //! Applies the commands of all world command buffers in thread order
+    void FlushCommands()
+    {
+        PlaybackCommands(commandBuffers_.Data(), commandBuffers_.Count());
+    }
+
+    //------------------------------------------------------------------------------
+    //! Applies commands recorded to a buffer owned by the caller and clears it
+    void FlushCommands(EcsCommandBuffer& buffer)
+    {
+        EcsCommandBuffer* buffers[] = { &buffer };
+        PlaybackCommands(buffers, 1);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Job system used by ParallelEach, runs serially when not set
+    void SetJobSystem(JobSystem* jobSystem)
+    {
+        jobSystem_ = jobSystem;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Runs fun(taskIdx, threadIdx) for every task in [0, taskCount) on the job system. The tasks may iterate the world
+    //! concurrently under the same rules as ParallelEach callbacks, their commands are applied once all of them finish.
+    //! ParallelEach called from a task runs on the task's thread. EachChanged is not allowed.
+    template<class TFun>
+    void ParallelRun(int taskCount, TFun& fun)
+    {
+        HS_ASSERT(!isInParallel_ && "Nested parallel execution is not supported");
+
+        IterScope iterScope(this);
+
+        if (jobSystem_)
+            AddThreadBuffers(jobSystem_->GetThreadCount());
+
+        isInParallel_ = true;
+        if (jobSystem_)
+        {
+            jobSystem_->ParallelFor(taskCount, fun);
+        }
+        else
+        {
+            for (int i = 0; i < taskCount; ++i)
+                fun(i, 0);
+        }
+        isInParallel_ = false;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Non-const components are marked as changed for EachChanged, const ones are read only
+    template<class TComponent>
+    TComponent& GetComponent(Entity_t entity)
+    {
+        if constexpr (IsSparseComponent_v<TComponent>)
+        {
+            // The set checks the generation of the handle, the entity's row is not needed
+            return GetSparseComponent<TComponent>(entity);
+        }
+        else
+        {
+            const EntityRecord& record = GetRecord(entity);
+            Archetype* arch = &archetypes_[record.archetype_];
+
+            if constexpr (IsSharedComponent_v<TComponent>)
+            {
+                return GetEntityComponent<TComponent>(*arch, entity, record.rowIndex_, ID_BAD);
+            }
+            else if constexpr (std::is_empty_v<TComponent>)
+            {
+                HS_ASSERT(arch->HasComponents<TComponent>());
+                return internal::TagInstance<RemoveCvRef_t<TComponent>>::value_;
+            }
+            else
+            {
+                auto columnIdx = arch->FindComponent<TComponent>();
+                HS_ASSERT(columnIdx != ID_BAD);
+
+                // Mutable access, assume the caller writes
+                if constexpr (!std::is_const_v<TComponent>)
+                    arch->MarkElementChanged(record.rowIndex_, columnIdx);
+
+                auto& component = arch->GetComponent<TComponent>(record.rowIndex_, columnIdx);
+                return component;
+            }
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    //! References to several components of the entity with one lookup of its row. Only the non-const components are
+    //! marked as changed. The references are valid until the next structural change of the entity's archetype.
+    template<class... TComponents>
+    std::tuple<TComponents&...> GetComponents(Entity_t entity)
+    {
+        static_assert(sizeof...(TComponents) > 0);
+
+        const EntityRecord& record = GetRecord(entity);
+        Archetype& archetype = archetypes_[record.archetype_];
+        HS_ASSERT(((IsSparseComponent_v<TComponents> || archetype.HasComponents<TComponents>()) && ...));
+
+        const int columns[] = { archetype.FindComponent<TComponents>()... };
+        static constexpr bool IS_WRITTEN[] = { !std::is_const_v<TComponents>... };
+        for (int i = 0; i < (int)sizeof...(TComponents); ++i)
+        {
+            if (IS_WRITTEN[i] && columns[i] != ID_BAD)
+                archetype.MarkElementChanged(record.rowIndex_, columns[i]);
+        }
+
+        return GetComponentsHelper<TComponents...>(archetype, entity, record.rowIndex_, columns, std::index_sequence_for<TComponents...>());
+    }
+
+    //------------------------------------------------------------------------------
+    //! False for NULL_ENTITY and for handles of deleted entities, also after their slot was reused
+    bool IsAlive(Entity_t entity) const
+    {
+        const int index = GetEntityIndex(entity);
+        return index < records_.Count() && records_[index].entity_ == entity && records_[index].archetype_ != ID_BAD;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Adds the components the entity does not have yet and overwrites the rest. During iteration a set which would
+    //! move the entity to another archetype or add a sparse value is recorded to GetCommands() instead, overwrites
+    //! still happen right away.
+    template<class... TComponent>
+    void SetComponents(Entity_t entity, const TComponent&... components)
+    {
+        const EntityRecord& record = GetRecord(entity);
+
+        if ((IsIterating() || isInParallel_) && (IsMigratingSet(entity, archetypes_[record.archetype_], components) || ...))
+        {
+            GetCommands().SetComponents(entity, components...);
+            return;
+        }
+
+        // Sparse components never change the archetype
+        (SetSparseComponent(entity, components), ...);
+
+        int archetypeIdx = record.archetype_;
+        ((archetypeIdx = GetSetTarget(archetypeIdx, components)), ...);
+
+        if (archetypeIdx == record.archetype_)
+        {
+            archetypes_[archetypeIdx].SetComponents(record.rowIndex_, components...);
+        }
+        else
+        {
+            HS_ASSERT(!isInParallel_ && "Use GetCommands() to make structural changes from ParallelEach");
+
+            // The components being set are overwritten right away, no point moving them
+            MigrateEntity(entity, archetypeIdx, MakeMask<TComponent...>());
+
+            const EntityRecord& newRecord = GetRecord(entity);
+            archetypes_[newRecord.archetype_].SetComponents(newRecord.rowIndex_, components...);
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    //! Removes the components from the entity, components it does not have are ignored.
+    //! During iteration the removal is recorded to GetCommands() instead.
+    template<class... TComponents>
+    void RemoveComponents(Entity_t entity)
+    {
+        static_assert(sizeof...(TComponents) > 0);
+
+        if (IsIterating())
+        {
+            GetCommands().RemoveComponents<TComponents...>(entity);
+            return;
+        }
+
+        int archetypeIdx = GetRecord(entity).archetype_;
+        ((archetypeIdx = GetRemoveTarget(archetypeIdx, TypeInfo<TComponents>::TypeId())), ...);
+
+        MigrateEntity(entity, archetypeIdx);
+        (RemoveSparseComponent<TComponents>(entity), ...);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Reorders the rows of every archetype with TComponents by key(const TComponents&...) ascending, rows with equal
+    //! keys keep their relative order. Iteration then visits the entities of each archetype in key order. Archetypes
+    //! which are already in order are left alone, calling it every frame only costs the key extraction.
+    template<class... TComponents, class TKeyFun>
+    void SortRows(TKeyFun key)
+    {
+        static_assert(sizeof...(TComponents) > 0);
+        static_assert(!(std::is_empty_v<TComponents> || ...), "Tags have no value to sort by");
+        static_assert(!(IsSparseComponent_v<TComponents> || ...), "Sparse components are not stored in the rows");
+        HS_ASSERT(!IsIterating() && "Rows can't be reordered during iteration");
+
+        using Key_t = decltype(key(std::declval<const RemoveCvRef_t<TComponents>&>()...));
+
+        static constexpr int TYPE_IDS[]{ TypeInfo<TComponents>::TypeId()... };
+        static constexpr int COMP_COUNT = sizeof...(TComponents);
+        const ComponentMask mask = MakeMask<TComponents...>();
+
+        // Keys are constructed into a buffer of the world which every call reuses and never destroyed
+        static_assert(std::is_trivially_destructible_v<Key_t>, "Sort keys are never destroyed");
+        static_assert(alignof(Key_t) <= ECS_POOL_MIN_BLOCK_SIZE);
+
+        for (int archetypeI = 0; archetypeI < archetypes_.Count(); ++archetypeI)
+        {
+            Archetype& archetype = archetypes_[archetypeI];
+            const int rowCount = archetype.GetRowCount();
+            if (rowCount < 2 || !archetype.GetMask().Contains(mask))
+                continue;
+
+            int columns[COMP_COUNT];
+            for (int i = 0; i < COMP_COUNT; ++i)
+                columns[i] = archetype.FindComponent(TYPE_IDS[i]);
+
+            auto keys = (Key_t*)ReserveSortKeys(rowCount * sizeof(Key_t));
+            int keyCount = 0;
+            for (int chunkI = 0; chunkI < archetype.GetChunkCount(); ++chunkI)
+            {
+                void* arr[COMP_COUNT];
+                // Only shared components have no column here, tags and sparse ones are rejected above
+                for (int i = 0; i < COMP_COUNT; ++i)
+                    arr[i] = columns[i] == ID_BAD ? const_cast<void*>(archetype.GetSharedValue(TYPE_IDS[i])) : archetype.GetChunkColumn(chunkI, columns[i]);
+
+                const int chunkRowCount = archetype.GetChunkRowCount(chunkI);
+                for (int rowI = 0; rowI < chunkRowCount; ++rowI)
+                    new (keys + keyCount++) Key_t(SortKeyHelper<TComponents...>(arr, rowI, key, std::make_index_sequence<COMP_COUNT>()));
+            }
+
+            HS_ASSERT(keyCount == rowCount);
+
+            bool isSorted = true;
+            for (int rowI = 1; rowI < rowCount && isSorted; ++rowI)
+                isSorted = !(keys[rowI] < keys[rowI - 1]);
+
+            if (isSorted)
+                continue;
+
+            sortOrder_.Clear();
+            for (int rowI = 0; rowI < rowCount; ++rowI)
+                sortOrder_.Add(rowI);
+
+            // Ties are broken by the row so the order is stable, std::stable_sort would allocate a temporary buffer
+            std::sort(sortOrder_.Data(), sortOrder_.Data() + rowCount, [keys](int a, int b)
+            {
+                if (keys[a] < keys[b])
+                    return true;
+                return !(keys[b] < keys[a]) && a < b;
+            });
+
+            archetype.PermuteRows(sortOrder_.Data());
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    void GetEntities(int*& begin, int& count)
+    {
+        begin = dense_.Data();
+        count = denseUsedCount_;
+    }
+
+    //------------------------------------------------------------------------------
+    template<class... TComponent>
+    struct Except
+    {
+    };
+
+    //------------------------------------------------------------------------------
+    //! Filter for EachChanged, only chunks where any of TComponent was mutably accessed since the last run are visited
+    template<class... TComponent>
+    struct Changed
+    {
+    };
+
+    //------------------------------------------------------------------------------
+    template<class... TComponent>
+    static ComponentMask MakeMask()
+    {
+        ComponentMask mask{};
+        (mask.Set(TypeInfo<TComponent>::TypeId()), ...);
+        return mask;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Mask of the components kept in archetypes, sparse ones are left out
+    template<class... TComponent>
+    static ComponentMask MakeArchetypeMask()
+    {
+        ComponentMask mask{};
+        ((IsSparseComponent_v<TComponent> ? void() : mask.Set(TypeInfo<TComponent>::TypeId())), ...);
+        return mask;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Ad-hoc iteration, the matching archetypes are cached in the world per distinct signature on the first use
+    template<class... TComponents>
+    struct Iter
+    {
+        //------------------------------------------------------------------------------
+        explicit Iter(EcsWorld* world) : world_(world) {}
+
+        //------------------------------------------------------------------------------
+        template<class... TAvoidComponents, class TFun>
+        void EachExcept(TFun fun)
+        {
+            IterScope iterScope(world_);
+            const QueryCache& query = world_->GetIterQuery<Changed<>, Except<TAvoidComponents...>, TComponents...>();
+            world_->EachMatch<TComponents...>(query, fun);
+        }
+
+        //------------------------------------------------------------------------------
+        template<class TFun>
+        void Each(TFun fun)
+        {
+            IterScope iterScope(world_);
+            const QueryCache& query = world_->GetIterQuery<Changed<>, Except<>, TComponents...>();
+            world_->EachMatch<TComponents...>(query, fun);
+        }
+
+        //------------------------------------------------------------------------------
+        //! Calls fun(Span<TComponents>...) once per chunk of matching rows, the spans all have the same count
+        template<class TFun>
+        void EachChunk(TFun fun)
+        {
+            IterScope iterScope(world_);
+            const QueryCache& query = world_->GetIterQuery<Changed<>, Except<>, TComponents...>();
+            world_->EachMatchChunk<TComponents...>(query, fun);
+        }
+
+        //------------------------------------------------------------------------------
+        //! Same as Each but skips chunks in which none of TChanged was written since the previous EachChanged with the
+        //! same signature. Tracking is per chunk so unchanged rows sharing a chunk with changed ones are visited too.
+        template<class... TChanged, class TFun>
+        void EachChanged(TFun fun)
+        {
+            IterScope iterScope(world_);
+            QueryCache& query = world_->GetIterQuery<Changed<TChanged...>, Except<>, TComponents...>();
+            world_->EachMatchChanged<false, TComponents...>(query, fun, Changed<TChanged...>{});
+        }
+
+        //------------------------------------------------------------------------------
+        template<class... TChanged, class TFun>
+        void EachChunkChanged(TFun fun)
+        {
+            IterScope iterScope(world_);
+            QueryCache& query = world_->GetIterQuery<Changed<TChanged...>, Except<>, TComponents...>();
+            world_->EachMatchChanged<true, TComponents...>(query, fun, Changed<TChanged...>{});
+        }
+
+        //------------------------------------------------------------------------------
+        template<class... TAvoidComponents, class TFun>
+        void EachChunkExcept(TFun fun)
+        {
+            IterScope iterScope(world_);
+            const QueryCache& query = world_->GetIterQuery<Changed<>, Except<TAvoidComponents...>, TComponents...>();
+            world_->EachMatchChunk<TComponents...>(query, fun);
+        }
+
+        //------------------------------------------------------------------------------
+        //! Deletes the entities for which pred(const TComponents&...) returns true. All rows are tested first, then the
+        //! matches are deleted in bulk by DeleteEntities.
+        template<class TPred>
+        void DeleteWhere(TPred pred)
+        {
+            // Per-thread scratch so the systems of one ParallelRun stage can call it together, pred must not call it
+            Array<Entity_t>& entities = world_->GetDeleteScratch();
+            entities.Clear();
+            {
+                IterScope iterScope(world_);
+                const QueryCache& query = world_->GetIterQuery<Changed<>, Except<>, const Entity_t, const TComponents...>();
+                auto test = [&entities, &pred](const Entity_t entity, const TComponents&... components)
+                {
+                    if (pred(components...))
+                        entities.Add(entity);
+                };
+                world_->EachMatch<const Entity_t, const TComponents...>(query, test);
+            }
+
+            world_->DeleteEntities(Span<const Entity_t>(entities.Data(), entities.Count()));
+        }
+
+        //------------------------------------------------------------------------------
+        //! Same as Each but the rows are split into ranges which run on the world's job system.
+        //! fun must only touch the row it gets, structural changes have to go through DeleteEntity or GetCommands().
+        template<class TFun>
+        void ParallelEach(TFun fun)
+        {
+            IterScope iterScope(world_);
+            const QueryCache& query = world_->GetIterQuery<Changed<>, Except<>, TComponents...>();
+            world_->ParallelEachMatch<false, TComponents...>(query, fun);
+        }
+
+        //------------------------------------------------------------------------------
+        //! Same as EachChunk but every row range runs as a separate task on the world's job system
+        template<class TFun>
+        void ParallelEachChunk(TFun fun)
+        {
+            IterScope iterScope(world_);
+            const QueryCache& query = world_->GetIterQuery<Changed<>, Except<>, TComponents...>();
+            world_->ParallelEachMatch<true, TComponents...>(query, fun);
+        }
+
+    private:
+        EcsWorld* world_;
+    };
+
+    //------------------------------------------------------------------------------
+    //! Persistent query owned by the caller, registered with the world for its whole lifetime
+    template<class... TComponents>
+    class Query
+    {
+    public:
+        //------------------------------------------------------------------------------
+        explicit Query(EcsWorld* world)
+            : Query(world, Except<>{})
+        {
+        }
+
+        //------------------------------------------------------------------------------
+        template<class... TAvoidComponents>
+        Query(EcsWorld* world, Except<TAvoidComponents...>)
+            : world_(world)
+            , cache_(MakeQueryCache<Except<TAvoidComponents...>, TComponents...>())
+        {
+            world_->RegisterQuery(&cache_);
+        }
+
+        //------------------------------------------------------------------------------
+        ~Query()
+        {
+            world_->UnregisterQuery(&cache_);
+        }
+
+        //------------------------------------------------------------------------------
+        Query(const Query&) = delete;
+
+        //------------------------------------------------------------------------------
+        Query& operator=(const Query&) = delete;
+
+        //------------------------------------------------------------------------------
+        template<class TFun>
+        void Each(TFun fun)
+        {
+            IterScope iterScope(world_);
+            world_->EachMatch<TComponents...>(cache_, fun);
+        }
+
+        //------------------------------------------------------------------------------
+        template<class TFun>
+        void EachChunk(TFun fun)
+        {
+            IterScope iterScope(world_);
+            world_->EachMatchChunk<TComponents...>(cache_, fun);
+        }
+
+        //------------------------------------------------------------------------------
+        //! Visits only chunks where any of TChanged was written since the previous EachChanged of this query
+        template<class... TChanged, class TFun>
+        void EachChanged(TFun fun)
+        {
+            IterScope iterScope(world_);
+            world_->EachMatchChanged<false, TComponents...>(cache_, fun, Changed<TChanged...>{});
+        }
+
+        //------------------------------------------------------------------------------
+        template<class... TChanged, class TFun>
+        void EachChunkChanged(TFun fun)
+        {
+            IterScope iterScope(world_);
+            world_->EachMatchChanged<true, TComponents...>(cache_, fun, Changed<TChanged...>{});
+        }
+
+        //------------------------------------------------------------------------------
+        template<class TFun>
+        void ParallelEach(TFun fun)
+        {
+            IterScope iterScope(world_);
+            world_->ParallelEachMatch<false, TComponents...>(cache_, fun);
+        }
+
+        //------------------------------------------------------------------------------
+        template<class TFun>
+        void ParallelEachChunk(TFun fun)
+        {
+            IterScope iterScope(world_);
+            world_->ParallelEachMatch<true, TComponents...>(cache_, fun);
+        }
+
+    private:
+        EcsWorld* world_;
+        QueryCache cache_;
+    };
+
+private:
+    friend class SparseSet;
+    template<class T>
+    friend class EcsPodArray;
+
+    struct EntityDeleteOperation;
+    struct EntityRecord
+    {
+        // ID_BAD while the slot is free
+        int archetype_;
+        int rowIndex_;
+        // Position of the entity in dense_
+        int denseIdx_;
+        // Handle of the entity in the slot, of the next one to be created in it while the slot is free
+        Entity_t entity_;
+    };
+
+    // Declared first so it is destroyed after everything allocated from it
+    EcsPoolAllocator    defaultAllocator_;
+    EcsAllocator*       allocator_;
+    EcsAllocatorStats   allocatorStats_{};
+
+    // Handles of live entities followed by the handles to be given out next, in the order they will be reused
+    EcsPodArray<Entity_t>       dense_{ this };
+    // Indexed by the entity index, slots are never removed
+    EcsPodArray<EntityRecord>   records_{ this };
+    Array<Archetype>    archetypes_;
+    // Indexed by type id, null for types kept in archetypes and sparse types which were never added
+    Array<SparseSet*>   sparseSets_;
+    // Backs the chunks of archetypes restored by LoadSnapshot
+    internal::FileMapping snapshotMapping_;
+
+    //------------------------------------------------------------------------------
+    struct KeyHash
+    {
+        size_t operator()(const ArchetypeKey& key) const
+        {
+            // FNV-1a over the mask words and shared value ids
+            uint64 hash = 14695981039346656037ull;
+            for (int i = 0; i < ComponentMask::WORD_COUNT; ++i)
+            {
+                hash ^= key.mask_.words_[i];
+                hash *= 1099511628211ull;
+            }
+            for (int i = 0; i < MAX_SHARED_COMPONENTS; ++i)
+            {
+                hash ^= (uint32)key.sharedValues_[i];
+                hash *= 1099511628211ull;
+            }
+            return (size_t)hash;
+        }
+    };
+
+    std::unordered_map<ArchetypeKey, int, KeyHash> archetypeIndex_;
+
+    //------------------------------------------------------------------------------
+    struct SharedValue
+    {
+        int typeId_;
+        void* data_;
+    };
+
+    // Distinct values of shared components, indexed by the value ids archetypes keep. Values are never removed.
+    Array<SharedValue>  sharedValues_;
+
+    // One buffer per job system thread, index 0 is used outside of ParallelEach
+    Array<EcsCommandBuffer*> commandBuffers_;
+    // Entities collected by Iter::DeleteWhere, one array per command buffer so they are reused every frame
+    Array<Array<Entity_t>*> deleteScratch_;
+
+    // All live query caches, updated when a new archetype is created
+    Array<QueryCache*>  queries_;
+    // Caches owned by the world for Iter, indexed by internal::QuerySlotHelper slot
+    Array<QueryCache*>  iterQueries_;
+    std::mutex          iterQueriesMutex_;
+
+    ArchetypeStorage    storage_;
+    // Bumped when Compact drops archetypes, states saved before refer to stale archetype indices
+    uint32              archetypeListVersion_{};
+    int                 denseUsedCount_{};
+    int                 iteratingDepth_{};
+    // Stamped into archetype columns on mutable access, bumped around every change filtered iteration
+    uint32              changeVersion_{ 1 };
+
+    //------------------------------------------------------------------------------
+    struct ParallelRange
+    {
+        int match_;
+        int chunk_;
+        int beginRow_;
+        int endRow_;
+    };
+
+    JobSystem*              jobSystem_{};
+    Array<ParallelRange>    parallelRanges_;
+    bool                    isInParallel_{};
+
+    //------------------------------------------------------------------------------
+    //! Makes sure there are command buffers and scratch arrays for threadCount threads
+    void AddThreadBuffers(int threadCount)
+    {
+        while (commandBuffers_.Count() < threadCount)
+            commandBuffers_.Add(new EcsCommandBuffer());
+
+        while (deleteScratch_.Count() < threadCount)
+            deleteScratch_.Add(new Array<Entity_t>());
+    }
+
+    //------------------------------------------------------------------------------
+    //! Scratch of the calling thread, indexed the same way as the command buffers in GetCommands
+    Array<Entity_t>& GetDeleteScratch()
+    {
+        const int threadIdx = isInParallel_ ? JobSystem::GetCurrentThreadIdx() : 0;
+        HS_ASSERT(threadIdx < deleteScratch_.Count());
+        return *deleteScratch_[threadIdx];
+    }
+
+    //------------------------------------------------------------------------------
+    //! Key buffer of SortRows with at least size bytes, grows geometrically and is kept for the next call
+    void* ReserveSortKeys(size_t size)
+    {
+        if (size > sortKeysSize_)
+        {
+            FreeMemory(sortKeys_, sortKeysSize_);
+            sortKeysSize_ = Max(size, 2 * sortKeysSize_);
+            sortKeys_ = AllocateMemory(sortKeysSize_, ECS_POOL_MIN_BLOCK_SIZE);
+        }
+        return sortKeys_;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Room for one element of any column, Archetype::PermuteRows parks elements in it. Kept for the next call.
+    void* ReserveElementScratch(size_t size)
+    {
+        if (size > elementScratchSize_)
+        {
+            FreeMemory(elementScratch_, elementScratchSize_);
+            elementScratchSize_ = size;
+            elementScratch_ = AllocateMemory(elementScratchSize_, ECS_POOL_MIN_BLOCK_SIZE);
+        }
+        return elementScratch_;
+    }
+
+    //------------------------------------------------------------------------------
+    //! All column, sparse and shared storage and the entity tables go through here so the counters cover the whole world
+    void* AllocateMemory(size_t size, size_t alignment)
+    {
+        HS_ASSERT(!isInParallel_ && "Use GetCommands() to make structural changes from ParallelEach");
+
+        void* ptr = allocator_->Allocate(size, alignment);
+        HS_ASSERT(ptr);
+
+        ++allocatorStats_.allocationCount_;
+        allocatorStats_.liveBytes_ += size;
+        allocatorStats_.peakLiveBytes_ = Max(allocatorStats_.peakLiveBytes_, allocatorStats_.liveBytes_);
+        return ptr;
+    }
+
+    //------------------------------------------------------------------------------
+    void FreeMemory(void* ptr, size_t size)
+    {
+        if (!ptr)
+            return;
+
+        ++allocatorStats_.freeCount_;
+        allocatorStats_.liveBytes_ -= size;
+        allocator_->Free(ptr, size);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Creates a new entity with a default constructed row in the given archetype
+    Entity_t AllocateEntity(int archetypeIdx)
+    {
+        if (denseUsedCount_ == dense_.Count())
+        {
+            const int index = records_.Count();
+            HS_ASSERT((uint32)index <= ENTITY_INDEX_MASK && "Too many entities");
+
+            // Generations start at 1 so no handle is NULL_ENTITY
+            const Entity_t entity = (Entity_t)((1u << ENTITY_INDEX_BITS) | (uint32)index);
+            dense_.Add(entity);
+            records_.Add(EntityRecord{ ID_BAD, 0, denseUsedCount_, entity });
+        }
+
+        const Entity_t entity = dense_[denseUsedCount_];
+        EntityRecord& record = records_[GetEntityIndex(entity)];
+        HS_ASSERT(record.archetype_ == ID_BAD && record.denseIdx_ == denseUsedCount_);
+        ++denseUsedCount_;
+
+        record.archetype_ = archetypeIdx;
+        record.rowIndex_ = archetypes_[archetypeIdx].AddEntity(entity);
+
+        return entity;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Marks the slot of a deleted entity free, the entity has to be at the end of the live part of dense_ already
+    void FreeEntity(int denseIdx)
+    {
+        HS_ASSERT(denseIdx >= denseUsedCount_);
+        EntityRecord& record = records_[GetEntityIndex(dense_[denseIdx])];
+
+        // Generation 0 is skipped on wrap around
+        uint32 generation = ((uint32)record.entity_ >> ENTITY_INDEX_BITS) + 1;
+        if (generation > (~0u >> ENTITY_INDEX_BITS))
+            generation = 1;
+
+        record.archetype_ = ID_BAD;
+        record.entity_ = (Entity_t)((generation << ENTITY_INDEX_BITS) | ((uint32)record.entity_ & ENTITY_INDEX_MASK));
+        dense_[denseIdx] = record.entity_;
+    }
+
+    //------------------------------------------------------------------------------
+    EntityRecord& GetRecord(Entity_t entity)
+    {
+        HS_ASSERT(IsAlive(entity) && "Entity was deleted");
+        return records_[GetEntityIndex(entity)];
+    }
+
+    //------------------------------------------------------------------------------
+    template<class... TComponents, size_t... Seq>
+    std::tuple<TComponents&...> GetComponentsHelper(Archetype& archetype, Entity_t entity, int rowIdx, const int* columns, std::index_sequence<Seq...>)
+    {
+        return std::tuple<TComponents&...>(GetEntityComponent<TComponents>(archetype, entity, rowIdx, columns[Seq])...);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Component of the entity whose row is rowIdx in archetype, sparse components are looked up in their set
+    template<class TComponent>
+    TComponent& GetEntityComponent(Archetype& archetype, Entity_t entity, int rowIdx, int column)
+    {
+        if constexpr (IsSparseComponent_v<TComponent>)
+        {
+            return GetSparseComponent<TComponent>(entity);
+        }
+        else if constexpr (IsSharedComponent_v<TComponent>)
+        {
+            static_assert(std::is_const_v<TComponent>, "Shared values are read-only, SetComponents moves the entity to the archetype with the new value");
+            HS_ASSERT(archetype.HasComponents<TComponent>());
+            return *static_cast<TComponent*>(archetype.GetSharedValue(TypeInfo<TComponent>::TypeId()));
+        }
+        else
+        {
+            return archetype.GetComponent<TComponent>(rowIdx, column);
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    SparseSet* FindSparseSet(int typeId) const
+    {
+        return typeId < sparseSets_.Count() ? sparseSets_[typeId] : nullptr;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Set of the sparse component type, created on the first use
+    SparseSet& GetSparseSet(int typeId)
+    {
+        HS_ASSERT(!isInParallel_ && "Use GetCommands() to make structural changes from ParallelEach");
+
+        while (sparseSets_.Count() <= typeId)
+            sparseSets_.Add(nullptr);
+
+        if (!sparseSets_[typeId])
+            sparseSets_[typeId] = new SparseSet(typeId, this);
+
+        return *sparseSets_[typeId];
+    }
+
+    //------------------------------------------------------------------------------
+    template<class TComponent>
+    TComponent& GetSparseComponent(Entity_t entity)
+    {
+        const SparseSet* set = FindSparseSet(TypeInfo<TComponent>::TypeId());
+        void* value = set ? set->Find(entity) : nullptr;
+        HS_ASSERT(value && "Entity does not have the component");
+        return *static_cast<TComponent*>(value);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Adds or overwrites the value of a sparse component, does nothing for components kept in archetypes
+    template<class TComponent>
+    void SetSparseComponent(Entity_t entity, const TComponent& value)
+    {
+        if constexpr (IsSparseComponent_v<TComponent>)
+        {
+            const int typeId = TypeInfo<TComponent>::TypeId();
+
+            // Overwriting is a plain write, allowed from parallel tasks
+            const SparseSet* set = FindSparseSet(typeId);
+            void* dst = set ? set->Find(entity) : nullptr;
+            if (!dst)
+                dst = GetSparseSet(typeId).Add(entity);
+
+            *static_cast<TComponent*>(dst) = value;
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    //! Adds a default constructed sparse component, does nothing for components kept in archetypes
+    template<class TComponent>
+    void AddSparseComponent(Entity_t entity)
+    {
+        if constexpr (IsSparseComponent_v<TComponent>)
+            GetSparseSet(TypeInfo<TComponent>::TypeId()).Add(entity);
+    }
+
+    //------------------------------------------------------------------------------
+    template<class TComponent>
+    void RemoveSparseComponent(Entity_t entity)
+    {
+        if constexpr (IsSparseComponent_v<TComponent>)
+        {
+            if (SparseSet* set = FindSparseSet(TypeInfo<TComponent>::TypeId()))
+                set->Remove(entity);
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    //! Drops the values of a deleted entity from all sparse sets
+    void RemoveSparseComponents(Entity_t entity)
+    {
+        for (int i = 0; i < sparseSets_.Count(); ++i)
+        {
+            if (sparseSets_[i])
+                sparseSets_[i]->Remove(entity);
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    //! Archetype with exactly TComponents, created if it does not exist yet
+    template<class... TComponents>
+    int GetArchetype()
+    {
+        static_assert(!(IsSharedComponent_v<TComponents> || ...), "The archetype depends on the shared values, pass them to CreateEntity");
+
+        int archetypeIdx = 0;
+        ((archetypeIdx = GetAddTarget(archetypeIdx, TypeInfo<TComponents>::TypeId())), ...);
+        return archetypeIdx;
+    }
+
+    //------------------------------------------------------------------------------
+    template<class... TComponents, class TFun, size_t... Seq>
+    void InitEntityHelper(int archetypeIdx, Entity_t entity, int rowIdx, const int* columns, int idx, TFun& init, std::index_sequence<Seq...>)
+    {
+        Archetype& archetype = archetypes_[archetypeIdx];
+        init(idx, GetEntityComponent<TComponents>(archetype, entity, rowIdx, columns[Seq])...);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Moves the row of the entity to another archetype. Components missing in the original archetype or listed in
+    //! skipMask are left default constructed, components missing in the new one are dropped.
+    void MigrateEntity(Entity_t entity, int archetypeIdx, const ComponentMask& skipMask = {})
+    {
+        EntityRecord& record = GetRecord(entity);
+        if (record.archetype_ == archetypeIdx)
+            return;
+
+        Archetype& originalArch = archetypes_[record.archetype_];
+        Archetype& newArch = archetypes_[archetypeIdx];
+
+        ComponentMask relocatedMask;
+        const int newRow = newArch.MoveEntityFrom(originalArch, record.rowIndex_, entity, skipMask, relocatedMask);
+
+        originalArch.RemoveRow(record.rowIndex_, relocatedMask);
+
+        record.archetype_ = archetypeIdx;
+        record.rowIndex_ = newRow;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Batched EntityDeleteOperation, the rows of each archetype and the dense entries are compacted once for all
+    void DeleteEntitiesNow(const Entity_t* entities, int count)
+    {
+        HS_ASSERT(!IsIterating());
+        if (!count)
+            return;
+
+        deletedRecords_.Clear();
+        deletedDense_.Clear();
+        for (int i = 0; i < count; ++i)
+        {
+            const EntityRecord& record = GetRecord(entities[i]);
+            deletedDense_.Add(record.denseIdx_);
+            deletedRecords_.Add(record);
+            RemoveSparseComponents(entities[i]);
+        }
+
+        std::sort(deletedDense_.begin(), deletedDense_.end());
+        const int denseCount = (int)(std::unique(deletedDense_.begin(), deletedDense_.end()) - deletedDense_.begin());
+
+        std::sort(deletedRecords_.begin(), deletedRecords_.end(), [](const EntityRecord& a, const EntityRecord& b)
+        {
+            return a.archetype_ < b.archetype_ || (a.archetype_ == b.archetype_ && a.rowIndex_ < b.rowIndex_);
+        });
+
+        // Records are still valid while rows move, the dense entries are compacted afterwards
+        for (int first = 0; first < count;)
+        {
+            const int archetypeIdx = deletedRecords_[first].archetype_;
+
+            deletedRows_.Clear();
+            int end = first;
+            for (; end < count && deletedRecords_[end].archetype_ == archetypeIdx; ++end)
+            {
+                if (end == first || deletedRecords_[end].rowIndex_ != deletedRecords_[end - 1].rowIndex_)
+                    deletedRows_.Add(deletedRecords_[end].rowIndex_);
+            }
+
+            archetypes_[archetypeIdx].RemoveRows(deletedRows_.Data(), deletedRows_.Count());
+            first = end;
+        }
+
+        // Same as for rows, live entries past the new end fill the holes
+        const int newDenseCount = denseUsedCount_ - denseCount;
+        int tailI = (int)(std::lower_bound(deletedDense_.begin(), deletedDense_.begin() + denseCount, newDenseCount) - deletedDense_.begin());
+        const int holeCount = tailI;
+        int src = newDenseCount;
+        for (int holeI = 0; holeI < holeCount; ++holeI, ++src)
+        {
+            for (; tailI < denseCount && deletedDense_[tailI] == src; ++tailI)
+                ++src;
+
+            SwapDense(deletedDense_[holeI], src);
+        }
+
+        const int oldDenseCount = denseUsedCount_;
+        denseUsedCount_ = newDenseCount;
+        for (int denseI = newDenseCount; denseI < oldDenseCount; ++denseI)
+            FreeEntity(denseI);
+    }
+
+    //------------------------------------------------------------------------------
+    void SwapDense(int denseIdxA, int denseIdxB)
+    {
+        Swap(dense_[denseIdxA], dense_[denseIdxB]);
+
+        records_[GetEntityIndex(dense_[denseIdxA])].denseIdx_ = denseIdxA;
+        records_[GetEntityIndex(dense_[denseIdxB])].denseIdx_ = denseIdxB;
+    }
+
+    //------------------------------------------------------------------------------
+    static void AddComponentToType(Archetype::Type_t& type, int typeId)
+    {
+        for (int i = 0; i < type.Count(); ++i)
+        {
+            HS_ASSERT(type[i] != typeId && "TypeId already present in type");
+            if (type[i] > typeId)
+            {
+                type.Insert(i, typeId);
+                return;
+            }
+        }
+
+        type.Add(typeId);
+    }
+
+    //------------------------------------------------------------------------------
+    //! sharedValues holds the value ids of the shared components of type in type order
+    int FindOrCreateArchetype(const Archetype::Type_t& type, const int* sharedValues = nullptr)
+    {
+        ArchetypeKey key;
+        key.mask_ = type.MakeMask();
+        for (int i = 0; i < MAX_SHARED_COMPONENTS; ++i)
+            key.sharedValues_[i] = sharedValues ? sharedValues[i] : ID_BAD;
+
+        if (auto it = archetypeIndex_.find(key); it != archetypeIndex_.end())
+            return it->second;
+
+        const int archetypeIdx = (int)archetypes_.Count();
+        Archetype newArchetype(this, type, storage_, key.sharedValues_);
+        archetypes_.Add(std::move(newArchetype));
+        archetypeIndex_.emplace(key, archetypeIdx);
+
+        for (int i = 0; i < queries_.Count(); ++i)
+            queries_[i]->OnArchetypeCreated(archetypeIdx, archetypes_[archetypeIdx]);
+
+        return archetypeIdx;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Value ids of the shared components of type, taken from the archetype except typeId which gets valueId
+    void CollectSharedValues(const Archetype::Type_t& type, int archetypeIdx, int typeId, int valueId, int* sharedValues) const
+    {
+        int count = 0;
+        for (int otherTypeId : type)
+        {
+            if (!TypeInfoDb::GetDetails(otherTypeId)->isShared_)
+                continue;
+
+            HS_ASSERT(count < MAX_SHARED_COMPONENTS && "Too many shared components in one archetype, increase MAX_SHARED_COMPONENTS");
+            sharedValues[count++] = otherTypeId == typeId ? valueId : archetypes_[archetypeIdx].GetSharedValueId(otherTypeId);
+        }
+
+        for (; count < MAX_SHARED_COMPONENTS; ++count)
+            sharedValues[count] = ID_BAD;
+    }
 
-public:
     //------------------------------------------------------------------------------
-    EcsWorld()
+    //! Returns the archetype which has all components of archetypeIdx plus typeId, the edge is cached after the first lookup
+    int GetAddTarget(int archetypeIdx, int typeId)
     {
-        Archetype emptyArchetype(this, { 0 });
-        archetypes_.Add(std::move(emptyArchetype));
+        HS_ASSERT(!TypeInfoDb::GetDetails(typeId)->isShared_ && "Shared components need their value, use GetSharedTarget");
+
+        if (archetypes_[archetypeIdx].GetMask().Has(typeId) || TypeInfoDb::GetDetails(typeId)->isSparse_)
+            return archetypeIdx;
+
+        if (int target = archetypes_[archetypeIdx].GetAddEdge(typeId); target != ID_BAD)
+            return target;
+
+        auto type = archetypes_[archetypeIdx].GetType();
+        AddComponentToType(type, typeId);
+
+        int sharedValues[MAX_SHARED_COMPONENTS];
+        CollectSharedValues(type, archetypeIdx, ID_BAD, ID_BAD, sharedValues);
+
+        const int target = FindOrCreateArchetype(type, sharedValues);
+        archetypes_[archetypeIdx].SetAddEdge(typeId, target);
+        archetypes_[target].SetRemoveEdge(typeId, archetypeIdx);
+
+        return target;
     }
 
     //------------------------------------------------------------------------------
-    Entity_t CreateEntity()
+    //! Returns the archetype which has all components of archetypeIdx except typeId, the edge is cached after the first lookup
+    int GetRemoveTarget(int archetypeIdx, int typeId)
     {
-        Entity_t id{};
+        HS_ASSERT(typeId != TypeInfo<Entity_t>::TypeId() && "Entity id can't be removed");
 
-        if (denseUsedCount_ == dense_.Count())
+        if (!archetypes_[archetypeIdx].GetMask().Has(typeId))
+            return archetypeIdx;
+
+        if (int target = archetypes_[archetypeIdx].GetRemoveEdge(typeId); target != ID_BAD)
+            return target;
+
+        Archetype::Type_t type;
+        for (int otherTypeId : archetypes_[archetypeIdx].GetType())
+        {
+            if (otherTypeId != typeId)
+                type.Add(otherTypeId);
+        }
+
+        int sharedValues[MAX_SHARED_COMPONENTS];
+        CollectSharedValues(type, archetypeIdx, ID_BAD, ID_BAD, sharedValues);
+
+        const int target = FindOrCreateArchetype(type, sharedValues);
+        archetypes_[archetypeIdx].SetRemoveEdge(typeId, target);
+
+        // Adding a shared component back depends on its value, those transitions are never cached
+        if (!TypeInfoDb::GetDetails(typeId)->isShared_)
+            archetypes_[target].SetAddEdge(typeId, archetypeIdx);
+
+        return target;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Returns the archetype which has all components of archetypeIdx and valueId as the value of the shared typeId.
+    //! Not cached, every call looks the archetype up by its key.
+    int GetSharedTarget(int archetypeIdx, int typeId, int valueId)
+    {
+        if (archetypes_[archetypeIdx].GetSharedValueId(typeId) == valueId)
+            return archetypeIdx;
+
+        auto type = archetypes_[archetypeIdx].GetType();
+        if (!archetypes_[archetypeIdx].GetMask().Has(typeId))
+            AddComponentToType(type, typeId);
+
+        int sharedValues[MAX_SHARED_COMPONENTS];
+        CollectSharedValues(type, archetypeIdx, typeId, valueId, sharedValues);
+
+        return FindOrCreateArchetype(type, sharedValues);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Whether setting the component on the entity in archetype is a structural change: it moves the entity out of the
+    //! archetype or adds a value to a sparse set, which can move the other values of the set. Nothing is created.
+    template<class TComponent>
+    bool IsMigratingSet(Entity_t entity, const Archetype& archetype, const TComponent& value) const
+    {
+        constexpr int typeId = TypeInfo<TComponent>::TypeId();
+        if constexpr (IsSparseComponent_v<TComponent>)
         {
-            id = denseUsedCount_;
-            dense_.Add(id);
-            sparse_.Add(id);
+            const SparseSet* set = FindSparseSet(typeId);
+            return !set || !set->Find(entity);
         }
+        else if constexpr (IsSharedComponent_v<TComponent>)
+            return !archetype.GetMask().Has(typeId) || memcmp(archetype.GetSharedValue(typeId), &value, sizeof(TComponent)) != 0;
+        else
+            return !archetype.GetMask().Has(typeId);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Archetype after setting the component on an entity in archetypeIdx
+    template<class TComponent>
+    int GetSetTarget(int archetypeIdx, const TComponent& value)
+    {
+        constexpr int typeId = TypeInfo<TComponent>::TypeId();
+        if constexpr (IsSharedComponent_v<TComponent>)
+            return GetSharedTarget(archetypeIdx, typeId, InternSharedValue(typeId, &value));
         else
+            return GetAddTarget(archetypeIdx, typeId);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Id of the shared value with the same bytes as value, a copy is added when there is none yet
+    int InternSharedValue(int typeId, const void* value)
+    {
+        const TypeDetails* details = TypeInfoDb::GetDetails(typeId);
+        HS_ASSERT(details->isShared_);
+
+        for (int i = 0; i < sharedValues_.Count(); ++i)
         {
-            HS_ASSERT(denseUsedCount_ < dense_.Count());
-            id = dense_[denseUsedCount_];
-            sparse_[id] = denseUsedCount_;
+            if (sharedValues_[i].typeId_ == typeId && memcmp(sharedValues_[i].data_, value, details->size_) == 0)
+                return i;
         }
-        ++denseUsedCount_;
 
-        EntityRecord record;
-        record.archetype_= 0;
-        record.rowIndex_ = archetypes_[0].AddEntity(id);
+        HS_ASSERT(!isInParallel_ && "Use GetCommands() to make structural changes from ParallelEach");
+
+        // Values are allocated one by one so references handed out by iteration stay valid when more are added
+        SharedValue sharedValue;
+        sharedValue.typeId_ = typeId;
+        sharedValue.data_ = AllocateMemory(details->size_, details->alignment_);
+        memcpy(sharedValue.data_, value, details->size_);
+        sharedValues_.Add(sharedValue);
+
+        return sharedValues_.Count() - 1;
+    }
+
+    //------------------------------------------------------------------------------
+    template<class TExcept, class... TComponents>
+    struct QueryTraits;
+
+    //------------------------------------------------------------------------------
+    template<class... TAvoidComponents, class... TComponents>
+    struct QueryTraits<Except<TAvoidComponents...>, TComponents...>
+    {
+        //------------------------------------------------------------------------------
+        static QueryCache MakeCache()
+        {
+            static_assert(sizeof...(TComponents) <= MAX_ARCHETYPE_COMPONENTS);
+            static_assert(!(IsSparseComponent_v<TAvoidComponents> || ...), "Sparse components are not part of archetypes, they can't be excluded");
+            static constexpr int TYPE_IDS[]{ TypeInfo<TComponents>::TypeId()... };
+            return QueryCache(MakeArchetypeMask<TComponents...>(), MakeMask<TAvoidComponents...>(), Span<const int>(TYPE_IDS, sizeof...(TComponents)));
+        }
+    };
+
+    //------------------------------------------------------------------------------
+    template<class TExcept, class... TComponents>
+    static QueryCache MakeQueryCache()
+    {
+        return QueryTraits<TExcept, TComponents...>::MakeCache();
+    }
+
+    //------------------------------------------------------------------------------
+    void RegisterQuery(QueryCache* query)
+    {
+        HS_ASSERT(!isInParallel_ && "Queries can't be registered from parallel tasks");
+
+        for (int i = 0; i < archetypes_.Count(); ++i)
+            query->OnArchetypeCreated(i, archetypes_[i]);
+
+        queries_.Add(query);
+    }
+
+    //------------------------------------------------------------------------------
+    void UnregisterQuery(QueryCache* query)
+    {
+        HS_ASSERT(!isInParallel_ && "Queries can't be unregistered from parallel tasks");
+
+        for (int i = 0; i < queries_.Count(); ++i)
+        {
+            if (queries_[i] == query)
+            {
+                queries_[i] = queries_[queries_.Count() - 1];
+                queries_.RemoveBack();
+                return;
+            }
+        }
+
+        HS_ASSERT(false && "Query is not registered");
+    }
+
+    //------------------------------------------------------------------------------
+    template<class TChanged, class TExcept, class... TComponents>
+    QueryCache& GetIterQuery()
+    {
+        // Change filtered iterations get their own slot so they don't share the last seen version with plain ones
+        const int slot = internal::QuerySlotHelper<TChanged, TExcept, RemoveCvRef_t<TComponents>...>::Slot();
+
+        // Tasks of ParallelRun may create caches concurrently, archetypes are not created until the tasks finish
+        std::unique_lock<std::mutex> lock(iterQueriesMutex_, std::defer_lock);
+        if (isInParallel_)
+            lock.lock();
+
+        while (iterQueries_.Count() <= slot)
+            iterQueries_.Add(nullptr);
+
+        if (!iterQueries_[slot])
+        {
+            iterQueries_[slot] = new QueryCache(MakeQueryCache<TExcept, TComponents...>());
+            for (int i = 0; i < archetypes_.Count(); ++i)
+                iterQueries_[slot]->OnArchetypeCreated(i, archetypes_[i]);
+            queries_.Add(iterQueries_[slot]);
+        }
+
+        return *iterQueries_[slot];
+    }
+
+    //------------------------------------------------------------------------------
+    //! Chunks with a column of changedTypeIds written after sinceVersion, everything passes when there are no types
+    struct ChangeFilter
+    {
+        Span<const int> changedTypeIds_;
+        uint32 sinceVersion_;
+    };
+
+    //------------------------------------------------------------------------------
+    static bool PassesChangeFilter(const Archetype& archetype, int chunk, const ChangeFilter& filter)
+    {
+        if (filter.changedTypeIds_.Count() == 0)
+            return true;
+
+        for (int typeId : filter.changedTypeIds_)
+        {
+            const int column = archetype.FindComponent(typeId);
+            if (column != ID_BAD && archetype.GetColumnVersion(chunk, column) > filter.sinceVersion_)
+                return true;
+        }
+
+        return false;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Stamps columns of the chunk which the iteration accesses as non-const
+    template<class... TComponents>
+    void MarkChunkWritten(Archetype& archetype, const QueryCache::Match& match, int chunk)
+    {
+        static constexpr bool IS_WRITTEN[] = { !std::is_const_v<std::remove_reference_t<TComponents>>... };
+        for (int i = 0; i < (int)sizeof...(TComponents); ++i)
+        {
+            if (IS_WRITTEN[i] && match.columns_[i] != ID_BAD)
+                archetype.MarkColumnChanged(chunk, match.columns_[i]);
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    template<bool IsChunk, class... TComponents, class... TChanged, class TFun>
+    void EachMatchChanged(QueryCache& query, TFun& fun, Changed<TChanged...>)
+    {
+        static_assert(sizeof...(TChanged) > 0);
+        static_assert(!(IsSparseComponent_v<TChanged> || ...), "Writes of sparse components are not tracked");
+        static_assert(!(IsSharedComponent_v<TChanged> || ...), "Shared values have no column, entities move to another archetype when their value changes");
+        HS_ASSERT(!isInParallel_ && "EachChanged bumps the world change version, it can't run in parallel tasks");
+
+        static constexpr int CHANGED_TYPE_IDS[] = { TypeInfo<TChanged>::TypeId()... };
+        ChangeFilter filter;
+        filter.changedTypeIds_ = Span<const int>(CHANGED_TYPE_IDS, sizeof...(TChanged));
+        filter.sinceVersion_ = query.GetLastChangeVersion();
+
+        // Writes made during this iteration get the recorded version so the query does not see its own changes
+        query.SetLastChangeVersion(++changeVersion_);
+
+        if constexpr (IsChunk)
+            EachMatchChunk<TComponents...>(query, fun, filter);
+        else
+            EachMatch<TComponents...>(query, fun, filter);
+
+        ++changeVersion_;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Column pointers of the chunk in the order of the query, tags and sparse components have no column and get
+    //! nullptr, shared components get their value
+    template<class... TComponents>
+    static void GetMatchColumns(const Archetype& archetype, const QueryCache::Match& match, int chunk, void** arr)
+    {
+        static constexpr bool IS_SHARED[] = { IsSharedComponent_v<TComponents>... };
+        static constexpr int TYPE_IDS[] = { TypeInfo<TComponents>::TypeId()... };
+        for (int i = 0; i < (int)sizeof...(TComponents); ++i)
+        {
+            if (IS_SHARED[i])
+                arr[i] = const_cast<void*>(archetype.GetSharedValue(TYPE_IDS[i]));
+            else
+                arr[i] = match.columns_[i] == ID_BAD ? nullptr : archetype.GetChunkColumn(chunk, match.columns_[i]);
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    template<class... TComponents, class TFun>
+    void EachMatch(const QueryCache& query, TFun& fun, const ChangeFilter& filter = {})
+    {
+        static constexpr int COMP_COUNT = sizeof...(TComponents);
+        auto seq = std::make_index_sequence<COMP_COUNT>();
+
+        // Match and chunk counts are re-read every time since the callback may create new archetypes and rows. The
+        // match is copied, a new matching archetype may reallocate the matches of the query.
+        for (int matchI = 0; matchI < query.GetMatchCount(); ++matchI)
+        {
+            const QueryCache::Match match = query.GetMatch(matchI);
+            archetypes_[match.archetype_].CountQuery();
+
+            for (int chunkI = 0; chunkI < archetypes_[match.archetype_].GetChunkCount(); ++chunkI)
+            {
+                Archetype& archetype = archetypes_[match.archetype_];
+                if (!PassesChangeFilter(archetype, chunkI, filter))
+                    continue;
+
+                MarkChunkWritten<TComponents...>(archetype, match, chunkI);
+                const int rowCount = archetype.GetChunkRowCount(chunkI);
+
+                void* arr[COMP_COUNT]{};
+                GetMatchColumns<TComponents...>(archetype, match, chunkI, arr);
+
+                if constexpr ((IsSparseComponent_v<TComponents> || ...))
+                {
+                    const Entity_t* entities = static_cast<const Entity_t*>(archetype.GetChunkColumn(chunkI, 0));
+                    for (int rowI = 0; rowI < rowCount; ++rowI)
+                        CallJoinedHelper<TComponents...>(arr, rowI, entities[rowI], fun, seq);
+                }
+                else
+                {
+                    for (int rowI = 0; rowI < rowCount; ++rowI)
+                    {
+                        CallHelper<TComponents...>(arr, rowI, fun, seq);
+                    }
+                }
+            }
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    template<class... TComponents, class TFun>
+    void EachMatchChunk(const QueryCache& query, TFun& fun, const ChangeFilter& filter = {})
+    {
+        static constexpr int COMP_COUNT = sizeof...(TComponents);
+        auto seq = std::make_index_sequence<COMP_COUNT>();
+
+        // Copied for the same reason as in EachMatch
+        for (int matchI = 0; matchI < query.GetMatchCount(); ++matchI)
+        {
+            const QueryCache::Match match = query.GetMatch(matchI);
+            archetypes_[match.archetype_].CountQuery();
+
+            for (int chunkI = 0; chunkI < archetypes_[match.archetype_].GetChunkCount(); ++chunkI)
+            {
+                Archetype& archetype = archetypes_[match.archetype_];
+                if (!PassesChangeFilter(archetype, chunkI, filter))
+                    continue;
+
+                MarkChunkWritten<TComponents...>(archetype, match, chunkI);
+                const int rowCount = archetype.GetChunkRowCount(chunkI);
+
+                void* arr[COMP_COUNT]{};
+                GetMatchColumns<TComponents...>(archetype, match, chunkI, arr);
+
+                CallChunkHelper<TComponents...>(arr, 0, rowCount, fun, seq);
+            }
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    template<bool IsChunk, class... TComponents, class TFun>
+    void ParallelEachMatch(const QueryCache& query, TFun& fun)
+    {
+        static constexpr int COMP_COUNT = sizeof...(TComponents);
+
+        // Already on a thread of the job system
+        if (isInParallel_)
+        {
+            if constexpr (IsChunk)
+                EachMatchChunk<TComponents...>(query, fun);
+            else
+                EachMatch<TComponents...>(query, fun);
+            return;
+        }
+
+        // Chunks are marked written up front, the workers don't touch shared state
+        parallelRanges_.Clear();
+        for (int matchI = 0; matchI < query.GetMatchCount(); ++matchI)
+        {
+            Archetype& archetype = archetypes_[query.GetMatch(matchI).archetype_];
+            archetype.CountQuery();
+            for (int chunkI = 0; chunkI < archetype.GetChunkCount(); ++chunkI)
+            {
+                MarkChunkWritten<TComponents...>(archetype, query.GetMatch(matchI), chunkI);
+                const int rowCount = archetype.GetChunkRowCount(chunkI);
+                for (int beginRow = 0; beginRow < rowCount; beginRow += PARALLEL_RANGE_ROWS)
+                    parallelRanges_.Add(ParallelRange{ matchI, chunkI, beginRow, Min(beginRow + PARALLEL_RANGE_ROWS, rowCount) });
+            }
+        }
+
+        auto runRange = [this, &query, &fun](int taskIdx, int /*threadIdx*/)
+        {
+            const ParallelRange& range = parallelRanges_[taskIdx];
+            const QueryCache::Match& match = query.GetMatch(range.match_);
+            const Archetype& archetype = archetypes_[match.archetype_];
+
+            void* arr[COMP_COUNT]{};
+            GetMatchColumns<TComponents...>(archetype, match, range.chunk_, arr);
+
+            if constexpr (IsChunk)
+            {
+                CallChunkHelper<TComponents...>(arr, range.beginRow_, range.endRow_ - range.beginRow_, fun, std::make_index_sequence<COMP_COUNT>());
+            }
+            else if constexpr ((IsSparseComponent_v<TComponents> || ...))
+            {
+                const Entity_t* entities = static_cast<const Entity_t*>(archetype.GetChunkColumn(range.chunk_, 0));
+                for (int rowI = range.beginRow_; rowI < range.endRow_; ++rowI)
+                    CallJoinedHelper<TComponents...>(arr, rowI, entities[rowI], fun, std::make_index_sequence<COMP_COUNT>());
+            }
+            else
+            {
+                for (int rowI = range.beginRow_; rowI < range.endRow_; ++rowI)
+                    CallHelper<TComponents...>(arr, rowI, fun, std::make_index_sequence<COMP_COUNT>());
+            }
+        };
+
+        if (!jobSystem_)
+        {
+            for (int i = 0; i < parallelRanges_.Count(); ++i)
+                runRange(i, 0);
+            return;
+        }
 
-        records_.Add(record);
+        AddThreadBuffers(jobSystem_->GetThreadCount());
 
-        return id;
+        isInParallel_ = true;
+        jobSystem_->ParallelFor(parallelRanges_.Count(), runRange);
+        isInParallel_ = false;
+    }
+
+    //------------------------------------------------------------------------------
+    template<class... TComponents, class TFun, size_t... Seq>
+    static void CallHelper(void** arr, int row, TFun& fun, std::index_sequence<Seq...>)
+    {
+        fun(RowElement<TComponents>(arr[Seq], row)...);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Calls fun for the row if the entity has all the sparse components of the query, their values are looked up in
+    //! the sets and the rest comes from the columns
+    template<class... TComponents, class TFun, size_t... Seq>
+    void CallJoinedHelper(void** arr, int row, Entity_t entity, TFun& fun, std::index_sequence<Seq...>) const
+    {
+        void* elements[sizeof...(TComponents)]{};
+        if ((JoinElement<TComponents>(arr[Seq], row, entity, elements[Seq]) && ...))
+            fun(RowElement<TComponents>(elements[Seq], 0)...);
+    }
+
+    //------------------------------------------------------------------------------
+    template<class TComponent>
+    bool JoinElement(void* column, int row, Entity_t entity, void*& element) const
+    {
+        if constexpr (IsSparseComponent_v<TComponent>)
+        {
+            const SparseSet* set = FindSparseSet(TypeInfo<TComponent>::TypeId());
+            element = set ? set->Find(entity) : nullptr;
+            return element != nullptr;
+        }
+        else if constexpr (IsSharedComponent_v<TComponent>)
+        {
+            element = column;
+        }
+        else if constexpr (!std::is_empty_v<TComponent>)
+        {
+            element = (RemoveCvRef_t<TComponent>*)column + row;
+        }
+        return true;
+    }
+
+    //------------------------------------------------------------------------------
+    template<class... TComponents, class TKeyFun, size_t... Seq>
+    static auto SortKeyHelper(void** arr, int row, TKeyFun& key, std::index_sequence<Seq...>)
+    {
+        return key(RowElement<const RemoveCvRef_t<TComponents>>(arr[Seq], row)...);
+    }
+
+    //------------------------------------------------------------------------------
+    template<class TComponent>
+    static TComponent& RowElement(void* column, int row)
+    {
+        static_assert(!IsSharedComponent_v<TComponent> || std::is_const_v<TComponent>, "Shared values are read-only, iterate them as const");
+
+        if constexpr (std::is_empty_v<TComponent>)
+            return internal::TagInstance<RemoveCvRef_t<TComponent>>::value_;
+        else if constexpr (IsSharedComponent_v<TComponent>)
+            return *(TComponent*)column;
+        else
+            return ((TComponent*)column)[row];
+    }
+
+    //------------------------------------------------------------------------------
+    template<class... TComponents, class TFun, size_t... Seq>
+    static void CallChunkHelper(void** arr, int firstRow, int rowCount, TFun& fun, std::index_sequence<Seq...>)
+    {
+        static_assert(!(std::is_empty_v<TComponents> || ...), "Tags have no column, filter by them in per-entity iteration");
+        static_assert(!(IsSparseComponent_v<TComponents> || ...), "Sparse components have no column, join them in per-entity iteration");
+        fun(ChunkElement<TComponents>(arr[Seq], firstRow, rowCount)...);
+    }
+
+    //------------------------------------------------------------------------------
+    //! Span of the rows, shared components are passed as the single value of the chunk
+    template<class TComponent>
+    static decltype(auto) ChunkElement(void* column, int firstRow, int rowCount)
+    {
+        if constexpr (IsSharedComponent_v<TComponent>)
+            return RowElement<TComponent>(column, 0);
+        else
+            return Span<TComponent>((TComponent*)column + firstRow, rowCount);
+    }
+
+    //------------------------------------------------------------------------------
+    // RAII structure for automatic handling of when iteration starts and ends.
+    struct IterScope
+    {
+        //------------------------------------------------------------------------------
+        [[nodiscard]]
+        IterScope(EcsWorld* world) : world_(world)
+        {
+            // Parallel tasks all run inside the scope of the ParallelEach or ParallelRun which started them
+            if (!world_->isInParallel_)
+                ++world_->iteratingDepth_;
+        }
+
+        //------------------------------------------------------------------------------
+        ~IterScope()
+        {
+            if (world_->isInParallel_)
+                return;
+
+            HS_ASSERT(world_->IsIterating());
+            --world_->iteratingDepth_;
+
+            if (!world_->IsIterating())
+                world_->OnIterationEnd();
+        }
+
+    private:
+        EcsWorld* world_;
+    };
+
+    //------------------------------------------------------------------------------
+    void UpdateRecord(Entity_t eid, int rowIdx)
+    {
+        records_[GetEntityIndex(eid)].rowIndex_ = rowIdx;
     }
 
     //------------------------------------------------------------------------------
-    template<class... TComponents>
-    Entity_t CreateEntity(TComponents... components)
+    bool IsIterating()
     {
-        auto e = CreateEntity();
-        SetComponents(e, components...);
-        return e;
+        return iteratingDepth_ > 0;
     }
 
     //------------------------------------------------------------------------------
-    void DeleteEntity(Entity_t entity)
+    void OnIterationEnd()
     {
-        EntityDeleteOperation deleteOp(this, entity);
-        if (!IsIterating())
-        {
-            deleteOp.Execute();
-        }
-        else
-        {
-            deferredDeletions_.Add(std::move(deleteOp));
-        }
+        FlushCommands();
     }
 
     //------------------------------------------------------------------------------
-    template<class TComponent>
-    TComponent& GetComponent(Entity_t entity)
+    //! Set commands of one entity merged into a single migration
+    struct CommandMigration
     {
-        auto dense = sparse_[entity];
-        EntityRecord& record = records_[dense];
-        Archetype* arch = &archetypes_[record.archetype_];
+        Entity_t entity_;
+        int archetype_;
+        int firstCommand_;
+        int commandCount_;
+        // Components overwritten by the commands
+        ComponentMask setMask_;
+    };
 
-        auto columnIdx = arch->FindComponent<TComponent>();
-        HS_ASSERT(columnIdx != ID_BAD);
+    //------------------------------------------------------------------------------
+    struct CommandRef
+    {
+        const EcsCommandBuffer* buffer_;
+        const EcsCommandBuffer::Command* command_;
+    };
 
-        auto& component = arch->GetComponent<TComponent>(record.rowIndex_, columnIdx);
-        return component;
-    }
+    Array<CommandRef>       playbackCommands_;
+    Array<CommandMigration> playbackMigrations_;
+    Array<Entity_t>         playbackDeletions_;
+    // Scratch of DeleteEntitiesNow
+    Array<EntityRecord>     deletedRecords_;
+    Array<int>              deletedDense_;
+    Array<int>              deletedRows_;
+    // Row permutation built by SortRows
+    Array<int>              sortOrder_;
+    // Keys of the rows of one archetype in SortRows, from allocator_
+    void*                   sortKeys_{};
+    size_t                  sortKeysSize_{};
+    // Element displaced by Archetype::PermuteRows, from allocator_
+    void*                   elementScratch_{};
+    size_t                  elementScratchSize_{};
 
     //------------------------------------------------------------------------------
-    template<class... TComponent>
-    void SetComponents(Entity_t entity, const TComponent&... components)
+    //! Moves the recorded component values into the row, the values stay alive until the buffer is cleared.
+    //! Values of components removed by a later command are skipped. Sparse components are added to and removed from
+    //! their sets in recording order.
+    void MoveCommandValues(const CommandRef& ref, Entity_t entity, int archetypeIdx, int rowIdx)
     {
-        // Find entity
-        auto dense = sparse_[entity];
-        EntityRecord& record = records_[dense];
-        Archetype* originalArch = &archetypes_[record.archetype_];
+        const bool isRemove = ref.command_->type_ == EcsCommandBuffer::CommandType::Remove;
 
-        if (originalArch->HasComponents<TComponent...>())
-        {
-            originalArch->SetComponents(record.rowIndex_, components...);
-        }
-        else
+        Archetype& archetype = archetypes_[archetypeIdx];
+        for (int i = 0; i < ref.command_->valueCount_; ++i)
         {
-            // TODO get rid of this allocation
-            auto type = originalArch->GetType();
-            AddComponentsToType<TComponent...>(type);
-
-            int archetypeIdx = ID_BAD;
-
-            for (int i = 0; i < archetypes_.Count(); ++i)
-            {
-                if (archetypes_[i].IsType(type))
-                {
-                    archetypeIdx = i;
-                    break;
-                }
-            }
-
-            if (archetypeIdx == ID_BAD)
+            const EcsCommandBuffer::ComponentValue& value = ref.buffer_->values_[ref.command_->firstValue_ + i];
+            if (TypeInfoDb::GetDetails(value.typeId_)->isSparse_)
             {
-                Archetype newArchetype(this, type);
-                archetypes_.Add(std::move(newArchetype));
-                archetypeIdx = (int)archetypes_.Count() - 1;
+                if (!isRemove)
+                    GetSparseSet(value.typeId_).Move(entity, value.data_);
+                else if (SparseSet* set = FindSparseSet(value.typeId_))
+                    set->Remove(entity);
             }
-
-            HS_ASSERT(archetypeIdx != ID_BAD);
-
-            // Copy components one by one from old to the new originalArch
-            Archetype* newArch = &archetypes_[archetypeIdx];
-
-            EntityRecord newRecord;
-            newRecord.archetype_ = archetypeIdx;
-            newRecord.rowIndex_ = newArch->AddEntity(entity);
-
-            const auto& oldType = originalArch->GetType();
-
-            // TODO skip components in ...components
-            for (int i = 0; i < oldType.Count(); ++i)
+            else if (!isRemove && value.data_ && archetype.FindComponent(value.typeId_) != ID_BAD)
             {
-                void* oldValue = originalArch->GetElement(record.rowIndex_, i).data_;
-                newArch->SetComponent(newRecord.rowIndex_, oldType[i], oldValue); // TODO use MoveComponent here since it will be no longer valid in the old archetype
+                archetype.MoveComponent(rowIdx, value.typeId_, value.data_);
             }
-
-            newArch->SetComponents(newRecord.rowIndex_, components...);
-
-            originalArch->RemoveRow(record.rowIndex_);
-
-            record = newRecord;
         }
     }
 
     //------------------------------------------------------------------------------
-    void GetEntities(int*& begin, int& count)
+    //! Archetype after applying a recorded set of the value to an entity in archetypeIdx
+    int GetCommandTarget(int archetypeIdx, const EcsCommandBuffer::ComponentValue& value)
     {
-        begin = dense_.Data();
-        count = denseUsedCount_;
+        if (TypeInfoDb::GetDetails(value.typeId_)->isShared_)
+            return GetSharedTarget(archetypeIdx, value.typeId_, InternSharedValue(value.typeId_, value.data_));
+
+        return GetAddTarget(archetypeIdx, value.typeId_);
     }
 
     //------------------------------------------------------------------------------
-    template<class... TComponent>
-    struct Except
+    //! Applies the commands in one batch: sets and removals, then deletions, then creations. Sets and creations are sorted by their
+    //! destination archetype so every entity migrates at most once and rows are appended to one archetype at a time.
+    void PlaybackCommands(EcsCommandBuffer* const* buffers, int bufferCount)
     {
-    };
+        HS_ASSERT(!IsIterating() && "Commands can't be applied during iteration");
 
-    //------------------------------------------------------------------------------
-    template<class... TComponents>
-    struct Iter
-    {
-        //------------------------------------------------------------------------------
-        explicit Iter(EcsWorld* world) : world_(world) {}
+        playbackCommands_.Clear();
+        playbackMigrations_.Clear();
+        playbackDeletions_.Clear();
 
-        //------------------------------------------------------------------------------
-        template<class... TAvoidComponents, class TFun>
-        void EachExcept(TFun fun)
+        for (int bufferI = 0; bufferI < bufferCount; ++bufferI)
         {
-            IterScope iterScope(world_);
-            static constexpr int COMP_COUNT = sizeof...(TComponents);
-            auto seq = std::make_index_sequence<COMP_COUNT>();
-
-            int avoidTypes[]{ TypeInfo<TAvoidComponents>::TypeId()... };
-
-            Archetype::Type_t type{ TypeInfo<TComponents>::TypeId()... };
-            Archetype::Type_t canonicalType = type;
-            std::sort(canonicalType.begin(), canonicalType.end());
-
-            int permutation[COMP_COUNT];
-            for (int i = 0; i < COMP_COUNT; ++i)
+            const EcsCommandBuffer* buffer = buffers[bufferI];
+            for (int i = 0; i < buffer->commands_.Count(); ++i)
             {
-                permutation[i] = type.IndexOf(canonicalType[i]);
-            }
-
-            for (int archI = 0; archI < world_->archetypes_.Count(); ++archI)
-            {
-                void* arr[COMP_COUNT]{};
-                if (int rowCount = world_->archetypes_[archI].TryGetIterators(canonicalType, MakeSpan(permutation), arr, MakeSpan(avoidTypes));
-                    rowCount)
-                {
-                    for (int rowI = 0; rowI < rowCount; ++rowI)
-                    {
-                        CallHelper(arr, rowI, fun, seq);
-                    }
-                }
+                const EcsCommandBuffer::Command& command = buffer->commands_[i];
+                if (command.type_ == EcsCommandBuffer::CommandType::Delete)
+                    playbackDeletions_.Add(command.entity_);
+                else if (command.type_ == EcsCommandBuffer::CommandType::Set || command.type_ == EcsCommandBuffer::CommandType::Remove)
+                    playbackCommands_.Add(CommandRef{ buffer, &command });
             }
         }
 
-        //------------------------------------------------------------------------------
-        template<class TFun>
-        void Each(TFun fun)
+        std::sort(playbackDeletions_.begin(), playbackDeletions_.end());
+        const int uniqueDeletionCount = (int)(std::unique(playbackDeletions_.begin(), playbackDeletions_.end()) - playbackDeletions_.begin());
+        while (playbackDeletions_.Count() > uniqueDeletionCount)
+            playbackDeletions_.RemoveBack();
+
+        auto isDeleted = [this](Entity_t entity)
         {
-            IterScope iterScope(world_);
-            static constexpr int COMP_COUNT = sizeof...(TComponents);
-            auto seq = std::make_index_sequence<COMP_COUNT>();
+            return std::binary_search(playbackDeletions_.begin(), playbackDeletions_.end(), entity);
+        };
 
-            Archetype::Type_t type{ TypeInfo<TComponents>::TypeId()... };
-            Archetype::Type_t canonicalType = type;
-            std::sort(canonicalType.begin(), canonicalType.end());
+        // Sets and removals, grouped by entity in recording order
+        std::stable_sort(playbackCommands_.begin(), playbackCommands_.end(), [](const CommandRef& a, const CommandRef& b)
+        {
+            return a.command_->entity_ < b.command_->entity_;
+        });
 
-            int permutation[COMP_COUNT];
-            for (int i = 0; i < COMP_COUNT; ++i)
-            {
-                permutation[i] = (int)type.IndexOf(canonicalType[i]);
-            }
+        for (int i = 0; i < playbackCommands_.Count();)
+        {
+            CommandMigration migration;
+            migration.entity_ = playbackCommands_[i].command_->entity_;
+            migration.archetype_ = GetRecord(migration.entity_).archetype_;
+            migration.firstCommand_ = i;
+            migration.setMask_ = ComponentMask{};
 
-            for (int archI = 0; archI < world_->archetypes_.Count(); ++archI)
+            for (; i < playbackCommands_.Count() && playbackCommands_[i].command_->entity_ == migration.entity_; ++i)
             {
-                void* arr[COMP_COUNT]{};
-                if (int rowCount = world_->archetypes_[archI].TryGetIterators(canonicalType, MakeSpan(permutation), arr, Span<const int>());
-                    rowCount)
+                const CommandRef& ref = playbackCommands_[i];
+                const bool isRemove = ref.command_->type_ == EcsCommandBuffer::CommandType::Remove;
+                for (int valueI = 0; valueI < ref.command_->valueCount_; ++valueI)
                 {
-                    for (int rowI = 0; rowI < rowCount; ++rowI)
+                    const EcsCommandBuffer::ComponentValue& value = ref.buffer_->values_[ref.command_->firstValue_ + valueI];
+                    if (isRemove)
+                    {
+                        migration.archetype_ = GetRemoveTarget(migration.archetype_, value.typeId_);
+                        migration.setMask_.Clear(value.typeId_);
+                    }
+                    else
                     {
-                        CallHelper(arr, rowI, fun, seq);
+                        migration.archetype_ = GetCommandTarget(migration.archetype_, value);
+                        migration.setMask_.Set(value.typeId_);
                     }
                 }
             }
-        }
-
-    private:
-        EcsWorld* world_;
 
-        //------------------------------------------------------------------------------
-        template<class TFun, unsigned long long... Seq>
-        void CallHelper(void** arr, int row, TFun fun, std::index_sequence<Seq...>)
-        {
-            fun(((TComponents*)arr[Seq])[row]...);
+            migration.commandCount_ = i - migration.firstCommand_;
+            if (!isDeleted(migration.entity_))
+                playbackMigrations_.Add(migration);
         }
 
-        //------------------------------------------------------------------------------
-        // RAII structure for automatic handling of when iteration starts and ends.
-        struct IterScope
+        std::stable_sort(playbackMigrations_.begin(), playbackMigrations_.end(), [](const CommandMigration& a, const CommandMigration& b)
         {
-            //------------------------------------------------------------------------------
-            [[nodiscard]]
-            IterScope(EcsWorld* world) : world_(world)
-            {
-                ++world_->iteratingDepth_;
-            }
-
-            //------------------------------------------------------------------------------
-            ~IterScope()
-            {
-                HS_ASSERT(world_->IsIterating());
-                --world_->iteratingDepth_;
-
-                if (!world_->IsIterating())
-                    world_->OnIterationEnd();
-            }
-
-        private:
-            EcsWorld* world_;
-        };
-    };
-
-private:
-    struct EntityDeleteOperation;
-    struct EntityRecord
-    {
-        int archetype_;
-        int rowIndex_;
-    };
-
-    Array<Entity_t>     sparse_;
-    Array<int>         dense_;
-    Array<EntityRecord> records_;
-    Array<Archetype>    archetypes_;
-
-    Array<EntityDeleteOperation> deferredDeletions_;
+            return a.archetype_ < b.archetype_;
+        });
 
-    int                 denseUsedCount_{};
-    int                 iteratingDepth_{};
+        for (int i = 0; i < playbackMigrations_.Count(); ++i)
+        {
+            const CommandMigration& migration = playbackMigrations_[i];
+            MigrateEntity(migration.entity_, migration.archetype_, migration.setMask_);
 
-    //------------------------------------------------------------------------------
-    void SwapEntity(int denseIdxA, int denseIdxB)
-    {
-        Swap(dense_[denseIdxA], dense_[denseIdxB]);
-        Swap(records_[denseIdxA], records_[denseIdxB]);
+            const int rowIdx = GetRecord(migration.entity_).rowIndex_;
+            for (int cmdI = 0; cmdI < migration.commandCount_; ++cmdI)
+                MoveCommandValues(playbackCommands_[migration.firstCommand_ + cmdI], migration.entity_, migration.archetype_, rowIdx);
+        }
 
-        sparse_[dense_[denseIdxA]] = denseIdxA;
-        sparse_[dense_[denseIdxB]] = denseIdxB;
-    }
+        DeleteEntitiesNow(playbackDeletions_.Data(), playbackDeletions_.Count());
 
-    //------------------------------------------------------------------------------
-    template<class TComponent>
-    void AddComponentToType(Archetype::Type_t& type)
-    {
-        auto typeId = TypeInfo<TComponent>::TypeId();
-        // TODO binary search? But we will change the system to bitfields anyway
-        for (int i = 0; i < type.Count(); ++i)
+        // Creations go straight to their final archetype without passing through the empty one
+        playbackMigrations_.Clear();
+        playbackCommands_.Clear();
+        for (int bufferI = 0; bufferI < bufferCount; ++bufferI)
         {
-            HS_ASSERT(type[i] != typeId && "TypeId already present in type");
-            if (type[i] > typeId)
+            const EcsCommandBuffer* buffer = buffers[bufferI];
+            for (int i = 0; i < buffer->commands_.Count(); ++i)
             {
-                type.Insert(i, typeId);
-                return;
+                const EcsCommandBuffer::Command& command = buffer->commands_[i];
+                if (command.type_ != EcsCommandBuffer::CommandType::Create)
+                    continue;
+
+                CommandMigration migration;
+                migration.entity_ = ID_BAD;
+                migration.archetype_ = 0;
+                migration.firstCommand_ = playbackCommands_.Count();
+                migration.commandCount_ = 1;
+                for (int valueI = 0; valueI < command.valueCount_; ++valueI)
+                    migration.archetype_ = GetCommandTarget(migration.archetype_, buffer->values_[command.firstValue_ + valueI]);
+
+                playbackCommands_.Add(CommandRef{ buffer, &command });
+                playbackMigrations_.Add(migration);
             }
         }
 
-        type.Add(typeId);
-    }
-
-    //------------------------------------------------------------------------------
-    template<class TComponent>
-    bool AddComponentsToTypeHelper(Archetype::Type_t& type)
-    {
-        AddComponentToType<TComponent>(type);
-        return true;
-    }
-
-    //------------------------------------------------------------------------------
-    template<class... TComponent>
-    void AddComponentsToType(Archetype::Type_t& type)
-    {
-        (AddComponentsToTypeHelper<TComponent>(type) && ...);
-    }
-
-    //------------------------------------------------------------------------------
-    void UpdateRecord(Entity_t eid, int rowIdx)
-    {
-        auto denseIdx = sparse_[eid];
-        records_[denseIdx].rowIndex_ = rowIdx;
-    }
-
-    //------------------------------------------------------------------------------
-    bool IsIterating()
-    {
-        return iteratingDepth_ > 0;
-    }
+        std::stable_sort(playbackMigrations_.begin(), playbackMigrations_.end(), [](const CommandMigration& a, const CommandMigration& b)
+        {
+            return a.archetype_ < b.archetype_;
+        });
 
-    //------------------------------------------------------------------------------
-    void OnIterationEnd()
-    {
-        for (int i = 0; i < deferredDeletions_.Count(); ++i)
+        for (int i = 0; i < playbackMigrations_.Count(); ++i)
         {
-            deferredDeletions_[i].Execute();
+            const CommandMigration& migration = playbackMigrations_[i];
+            const Entity_t entity = AllocateEntity(migration.archetype_);
+            MoveCommandValues(playbackCommands_[migration.firstCommand_], entity, migration.archetype_, GetRecord(entity).rowIndex_);
         }
 
-        deferredDeletions_.Clear();
+        for (int bufferI = 0; bufferI < bufferCount; ++bufferI)
+            buffers[bufferI]->Clear();
     }
 
     //------------------------------------------------------------------------------
@@ -810,22 +4292,21 @@ private:
         //------------------------------------------------------------------------------
         void Execute()
         {
-            HS_ASSERT(world_->denseUsedCount_ > 0);
-            auto denseIdx = world_->sparse_[entity_];
+            const auto& record = world_->GetRecord(entity_);
+            auto denseIdx = record.denseIdx_;
             auto lastDense = world_->denseUsedCount_ - 1;
-            HS_ASSERT(denseIdx <= world_->denseUsedCount_);
 
-            const auto& record = world_->records_[denseIdx];
             world_->archetypes_[record.archetype_].RemoveRow(record.rowIndex_);
+            world_->RemoveSparseComponents(entity_);
 
             if (denseIdx < lastDense)
             {
-                world_->SwapEntity(denseIdx, lastDense);
+                world_->SwapDense(denseIdx, lastDense);
             }
 
             // Remove last entity
             --world_->denseUsedCount_;
-            world_->records_.RemoveBack();
+            world_->FreeEntity(lastDense);
         }
 
     private:
@@ -835,20 +4316,228 @@ private:
 };
 
 //------------------------------------------------------------------------------
-inline void Archetype::RemoveRow(int row)
+//! In-memory copy of a world for rollback. States are meant to be reused, e.g. as slots of a ring of recent frames,
+//! since every save into the same state only copies what changed since its previous save.
+class EcsWorldState
+{
+public:
+    //------------------------------------------------------------------------------
+    EcsWorldState() = default;
+
+    //------------------------------------------------------------------------------
+    ~EcsWorldState()
+    {
+        for (int i = 0; i < sparseSets_.Count(); ++i)
+            delete sparseSets_[i];
+    }
+
+    //------------------------------------------------------------------------------
+    EcsWorldState(const EcsWorldState&) = delete;
+
+    //------------------------------------------------------------------------------
+    EcsWorldState& operator=(const EcsWorldState&) = delete;
+
+    //------------------------------------------------------------------------------
+    //! The world the state was saved from, null if it was not saved yet
+    const EcsWorld* GetWorld() const
+    {
+        return world_;
+    }
+
+private:
+    friend class EcsWorld;
+
+    const EcsWorld*             world_{};
+    // World change version at the time of the save
+    uint32                      version_{};
+    uint32                      archetypeListVersion_{};
+    Array<ArchetypeState>       archetypes_;
+    EcsPodArray<Entity_t>       dense_{ nullptr };
+    EcsPodArray<EcsWorld::EntityRecord> records_{ nullptr };
+    // Sparse sets are copied whole on every save
+    Array<SparseSet*>           sparseSets_;
+    int                         denseUsedCount_{};
+};
+
+//------------------------------------------------------------------------------
+inline uint32 Archetype::GetChangeVersion() const
+{
+    return world_->changeVersion_;
+}
+
+//------------------------------------------------------------------------------
+inline int8* Archetype::AllocateChunk(int byteSize)
+{
+    return (int8*)world_->AllocateMemory(byteSize, ARCHETYPE_COLUMN_ALIGNMENT);
+}
+
+//------------------------------------------------------------------------------
+inline void Archetype::FreeChunk(int8* chunk, int byteSize)
+{
+    world_->FreeMemory(chunk, byteSize);
+}
+
+//------------------------------------------------------------------------------
+inline int8* SparseSet::AllocateValues(int capacity)
+{
+    const size_t size = (size_t)capacity * details_->size_;
+    const int alignment = Max(details_->alignment_, ARCHETYPE_COLUMN_ALIGNMENT);
+    if (world_)
+        return (int8*)world_->AllocateMemory(size, alignment);
+
+    auto values = (int8*)internal::AlignedAlloc(size, alignment);
+    HS_ASSERT(values);
+    return values;
+}
+
+//------------------------------------------------------------------------------
+inline void SparseSet::FreeValues()
+{
+    if (world_)
+        world_->FreeMemory(values_, (size_t)capacity_ * details_->size_);
+    else
+        internal::AlignedFree(values_);
+}
+
+//------------------------------------------------------------------------------
+template<class T>
+inline T* EcsPodArray<T>::AllocateData(int capacity)
+{
+    const size_t size = (size_t)capacity * sizeof(T);
+    if (world_)
+        return (T*)world_->AllocateMemory(size, alignof(T));
+
+    auto data = (T*)internal::AlignedAlloc(size, alignof(T));
+    HS_ASSERT(data);
+    return data;
+}
+
+//------------------------------------------------------------------------------
+template<class T>
+inline void EcsPodArray<T>::FreeData()
+{
+    if (world_)
+        world_->FreeMemory(data_, (size_t)capacity_ * sizeof(T));
+    else
+        internal::AlignedFree(data_);
+}
+
+//------------------------------------------------------------------------------
+inline const void* Archetype::GetSharedValue(int typeId) const
+{
+    const int valueId = GetSharedValueId(typeId);
+    HS_ASSERT(valueId != ID_BAD && "Archetype does not have the shared component");
+    return world_->sharedValues_[valueId].data_;
+}
+
+//------------------------------------------------------------------------------
+inline void Archetype::RemoveRow(int row, const ComponentMask& relocatedMask)
 {
     HS_ASSERT(row < rowCount_);
 
+    DestroyRows(row, row + 1, relocatedMask);
+
     const int lastRowIdx = rowCount_ - 1;
     if (row < lastRowIdx)
     {
-        auto eid = GetEntityId(lastRowIdx);
-        world_->UpdateRecord(eid, row);
-        SwapRow(row, lastRowIdx);
+        for (int i = 0; i < columns_.Count(); ++i)
+            RelocateElement(details_[i], GetElementData(row, i), GetElementData(lastRowIdx, i));
+
+        // Systems tracking changes per entity have to see the moved row
+        MarkRowChanged(row);
+        world_->UpdateRecord(GetEntityId(row), row);
     }
 
     --rowCount_;
 }
 
+//------------------------------------------------------------------------------
+inline void Archetype::RemoveRows(const int* rows, int count)
+{
+    HS_ASSERT(count <= rowCount_);
+    if (!count)
+        return;
+
+    // Deleted rows past the new end just go away, the others are holes for the live rows from there
+    const int newRowCount = rowCount_ - count;
+    const int holeCount = (int)(std::lower_bound(rows, rows + count, newRowCount) - rows);
+
+    auto forEachMove = [rows, count, newRowCount, holeCount](auto fun)
+    {
+        int tailI = holeCount;
+        int src = newRowCount;
+        for (int holeI = 0; holeI < holeCount; ++holeI, ++src)
+        {
+            for (; tailI < count && rows[tailI] == src; ++tailI)
+                ++src;
+
+            fun(rows[holeI], src);
+        }
+    };
+
+    for (int i = 0; i < columns_.Count(); ++i)
+    {
+        const TypeDetails* details = details_[i];
+        if (!details->isTrivial_)
+        {
+            for (int rowI = 0; rowI < count; ++rowI)
+                details->dtor_(GetElementData(rows[rowI], i));
+        }
+
+        forEachMove([this, details, i](int dst, int src)
+        {
+            RelocateElement(details, GetElementData(dst, i), GetElementData(src, i));
+        });
+    }
+
+    rowCount_ = newRowCount;
+
+    forEachMove([this](int dst, int /*src*/)
+    {
+        MarkRowChanged(dst);
+        world_->UpdateRecord(GetEntityId(dst), dst);
+    });
+}
+
+//------------------------------------------------------------------------------
+inline void Archetype::PermuteRows(int* order)
+{
+    // Cycles of the permutation are walked once per column, the element displaced from the first row of a cycle waits
+    // in a scratch buffer of the world so reordering never grows the archetype
+    size_t elementSize = 0;
+    for (int i = 0; i < columns_.Count(); ++i)
+        elementSize = Max(elementSize, (size_t)details_[i]->size_);
+    void* displaced = world_->ReserveElementScratch(elementSize);
+
+    for (int startRow = 0; startRow < rowCount_; ++startRow)
+    {
+        if (order[startRow] == startRow)
+            continue;
+
+        for (int i = 0; i < columns_.Count(); ++i)
+        {
+            RelocateElement(details_[i], displaced, GetElementData(startRow, i));
+
+            int row = startRow;
+            for (; order[row] != startRow; row = order[row])
+                RelocateElement(details_[i], GetElementData(row, i), GetElementData(order[row], i));
+
+            RelocateElement(details_[i], GetElementData(row, i), displaced);
+        }
+
+        // Rows of the cycle hold their final values now
+        for (int row = startRow; order[row] != row;)
+        {
+            const int srcRow = order[row];
+            order[row] = row;
+
+            MarkRowChanged(row);
+            world_->UpdateRecord(GetEntityId(row), row);
+
+            row = srcRow;
+        }
+    }
+}
+
 
 }
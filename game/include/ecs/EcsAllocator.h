@@ -0,0 +1,110 @@
+#pragma once
+
+#include "Config.h"
+
+#include "Containers/Array.h"
+
+#include "Common/Types.h"
+
+#include <cstddef>
+
+namespace hs
+{
+
+//------------------------------------------------------------------------------
+//! Source of the memory of archetype columns, sparse sets, shared values and entity tables of an EcsWorld. The world
+//! only calls it from the thread which makes structural changes, implementations don't need to be thread safe.
+class EcsAllocator
+{
+public:
+    //------------------------------------------------------------------------------
+    virtual ~EcsAllocator() = default;
+
+    //------------------------------------------------------------------------------
+    //! Returns size bytes aligned to alignment, which is a power of two of at most ECS_POOL_MIN_BLOCK_SIZE
+    virtual void* Allocate(size_t size, size_t alignment) = 0;
+
+    //------------------------------------------------------------------------------
+    //! size has to be the size the memory was allocated with
+    virtual void Free(void* ptr, size_t size) = 0;
+
+    //------------------------------------------------------------------------------
+    //! Bytes the allocator holds from the system, including blocks which are free
+    virtual int64 GetReservedBytes() const = 0;
+};
+
+//! Smallest block of EcsPoolAllocator, also the alignment of every block
+static constexpr int ECS_POOL_MIN_BLOCK_SIZE{ 64 };
+//! Largest block of EcsPoolAllocator, bigger allocations go directly to the system
+static constexpr int ECS_POOL_MAX_BLOCK_SIZE{ 64 * 1024 };
+//! Size of the arenas blocks of EcsPoolAllocator are carved from, one huge page on x64
+static constexpr int ECS_POOL_ARENA_SIZE{ 2 * 1024 * 1024 };
+
+//------------------------------------------------------------------------------
+//! Default EcsAllocator. Allocations are rounded up to a power of two size class and carved from large arenas, freed
+//! blocks go to a free list of their class and are reused by the next allocation of the class. Arenas are only
+//! returned to the system when the allocator is destroyed, all at once.
+class EcsPoolAllocator final : public EcsAllocator
+{
+public:
+    //------------------------------------------------------------------------------
+    //! useHugePages backs the arenas by huge pages where the system allows it, silently falls back to regular pages
+    explicit EcsPoolAllocator(bool useHugePages = false);
+
+    //------------------------------------------------------------------------------
+    ~EcsPoolAllocator() override;
+
+    //------------------------------------------------------------------------------
+    EcsPoolAllocator(const EcsPoolAllocator&) = delete;
+
+    //------------------------------------------------------------------------------
+    EcsPoolAllocator& operator=(const EcsPoolAllocator&) = delete;
+
+    //------------------------------------------------------------------------------
+    void* Allocate(size_t size, size_t alignment) override;
+
+    //------------------------------------------------------------------------------
+    void Free(void* ptr, size_t size) override;
+
+    //------------------------------------------------------------------------------
+    int64 GetReservedBytes() const override;
+
+private:
+    static constexpr int SIZE_CLASS_COUNT{ 11 };
+    static_assert(ECS_POOL_MIN_BLOCK_SIZE << (SIZE_CLASS_COUNT - 1) == ECS_POOL_MAX_BLOCK_SIZE);
+
+    //------------------------------------------------------------------------------
+    //! Header written into free blocks
+    struct FreeBlock
+    {
+        FreeBlock* next_;
+    };
+
+    FreeBlock*      freeLists_[SIZE_CLASS_COUNT]{};
+    Array<void*>    arenas_;
+    // Unused end of the newest arena
+    int8*           arenaTop_{};
+    int8*           arenaEnd_{};
+    int64           largeBytes_{};
+    bool            useHugePages_;
+
+    //------------------------------------------------------------------------------
+    static int GetSizeClass(size_t size);
+
+    //------------------------------------------------------------------------------
+    void AddArena();
+};
+
+//------------------------------------------------------------------------------
+//! Allocation counters of one EcsWorld, sizes are the requested ones
+struct EcsAllocatorStats
+{
+    int64 allocationCount_;
+    int64 freeCount_;
+    int64 liveBytes_;
+    int64 peakLiveBytes_;
+    //! Memory the allocator holds from the system
+    int64 reservedBytes_;
+};
+
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "Config.h"
+
+#include "Containers/Array.h"
+
+#include "Common/Types.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace hs
+{
+
+//------------------------------------------------------------------------------
+//! Fixed pool of worker threads with per-worker task queues. Idle workers steal tasks from the other queues.
+class JobSystem
+{
+public:
+    //! Called for every task, threadIdx is 0 for the thread which called ParallelFor and 1..GetWorkerCount() for workers
+    using TaskFun_t = void (*)(void* context, int taskIdx, int threadIdx);
+
+    //------------------------------------------------------------------------------
+    //! workerCount 0 creates one worker per hardware thread besides the calling one
+    explicit JobSystem(int workerCount = 0);
+
+    //------------------------------------------------------------------------------
+    ~JobSystem();
+
+    //------------------------------------------------------------------------------
+    JobSystem(const JobSystem&) = delete;
+
+    //------------------------------------------------------------------------------
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    //------------------------------------------------------------------------------
+    //! Number of threads besides the calling one
+    int GetWorkerCount() const
+    {
+        return workerCount_;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Number of distinct threadIdx values a task can see
+    int GetThreadCount() const
+    {
+        return GetWorkerCount() + 1;
+    }
+
+    //------------------------------------------------------------------------------
+    //! threadIdx of the calling thread as seen by tasks, 0 for threads which are not workers of any JobSystem
+    static int GetCurrentThreadIdx();
+
+    //------------------------------------------------------------------------------
+    //! Runs fun for every task in [0, taskCount) and returns once all of them finished, the calling thread helps
+    void ParallelFor(int taskCount, TaskFun_t fun, void* context);
+
+    //------------------------------------------------------------------------------
+    //! Runs fun(taskIdx, threadIdx) for every task in [0, taskCount)
+    template<class TFun>
+    void ParallelFor(int taskCount, TFun& fun)
+    {
+        ParallelFor(taskCount, [](void* context, int taskIdx, int threadIdx)
+        {
+            (*static_cast<TFun*>(context))(taskIdx, threadIdx);
+        }, &fun);
+    }
+
+private:
+    //------------------------------------------------------------------------------
+    struct Batch
+    {
+        TaskFun_t fun_;
+        void* context_;
+        std::atomic<int> remaining_;
+    };
+
+    //------------------------------------------------------------------------------
+    struct Task
+    {
+        Batch* batch_;
+        int taskIdx_;
+    };
+
+    //------------------------------------------------------------------------------
+    // Owner pops from the back, thieves take from the front
+    struct TaskQueue
+    {
+        std::mutex mutex_;
+        Array<Task> tasks_;
+        int head_{};
+    };
+
+    std::thread*                workers_{};
+    int                         workerCount_{};
+    // One queue per thread, queue 0 belongs to the thread calling ParallelFor
+    TaskQueue*                  queues_{};
+
+    std::mutex                  wakeMutex_;
+    std::condition_variable     wakeCondition_;
+    uint64                      wakeGeneration_{};
+    bool                        isRunning_{ true };
+    std::atomic<bool>           isInParallelFor_{};
+
+    //------------------------------------------------------------------------------
+    void WorkerMain(int threadIdx);
+
+    //------------------------------------------------------------------------------
+    bool TryPop(int queueIdx, Task& task);
+
+    //------------------------------------------------------------------------------
+    bool TrySteal(int thiefIdx, Task& task);
+
+    //------------------------------------------------------------------------------
+    bool TryRunOne(int threadIdx);
+};
+
+}
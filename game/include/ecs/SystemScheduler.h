@@ -0,0 +1,145 @@
+#pragma once
+
+#include "Config.h"
+
+#include "Ecs/Ecs.h"
+
+#include "Containers/Array.h"
+
+#include "Common/Types.h"
+
+namespace hs
+{
+
+//------------------------------------------------------------------------------
+//! Runs registered systems once per Run. Each system declares the components it reads and writes, systems which don't
+//! conflict are grouped into stages and the systems of one stage run at the same time on the world's job system.
+//! Conflicting systems keep the order in which they were added.
+//!
+//! Systems in a stage with others are restricted like ParallelEach: structural changes go through DeleteEntity or
+//! GetCommands() and are applied when the whole stage finishes. Creating or deleting entities through commands does not
+//! have to be declared, only components accessed in place. Exclusive systems always run alone with full access.
+class SystemScheduler
+{
+public:
+    //------------------------------------------------------------------------------
+    template<class... TComponents>
+    struct Reads
+    {
+    };
+
+    //------------------------------------------------------------------------------
+    template<class... TComponents>
+    struct Writes
+    {
+    };
+
+    //------------------------------------------------------------------------------
+    explicit SystemScheduler(EcsWorld* world);
+
+    //------------------------------------------------------------------------------
+    ~SystemScheduler();
+
+    //------------------------------------------------------------------------------
+    SystemScheduler(const SystemScheduler&) = delete;
+
+    //------------------------------------------------------------------------------
+    SystemScheduler& operator=(const SystemScheduler&) = delete;
+
+    //------------------------------------------------------------------------------
+    //! Adds fun() as a system which may only touch the components listed in reads and writes
+    template<class... TReads, class... TWrites, class TFun>
+    void AddSystem(const char* name, Reads<TReads...>, Writes<TWrites...>, TFun fun)
+    {
+        System& system = AddSystem(name, fun);
+        system.reads_ = EcsWorld::MakeMask<TReads...>();
+        system.writes_ = EcsWorld::MakeMask<TWrites...>();
+    }
+
+    //------------------------------------------------------------------------------
+    //! Adds fun() as a system which runs alone, use for systems with immediate structural changes or shared state
+    template<class TFun>
+    void AddExclusiveSystem(const char* name, TFun fun)
+    {
+        System& system = AddSystem(name, fun);
+        system.isExclusive_ = true;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Runs all the systems stage by stage
+    void Run();
+
+    //------------------------------------------------------------------------------
+    int GetSystemCount() const
+    {
+        return systems_.Count();
+    }
+
+    //------------------------------------------------------------------------------
+    const char* GetSystemName(int system) const
+    {
+        return systems_[system]->name_;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Systems of the same stage run concurrently, stages run in order
+    int GetSystemStage(int system) const
+    {
+        return systems_[system]->stage_;
+    }
+
+    //------------------------------------------------------------------------------
+    int GetStageCount() const
+    {
+        return stageCount_;
+    }
+
+private:
+    //------------------------------------------------------------------------------
+    struct System
+    {
+        const char* name_;
+        ComponentMask reads_{};
+        ComponentMask writes_{};
+        bool isExclusive_{};
+        int stage_{};
+
+        void* context_;
+        void (*run_)(void* context);
+        void (*destroy_)(void* context);
+    };
+
+    EcsWorld*       world_;
+    Array<System*>  systems_;
+    // Indices of systems sorted by stage, the systems of stage i start at stageStarts_[i]
+    Array<int>      stageOrder_;
+    Array<int>      stageStarts_;
+    int             stageCount_{};
+
+    //------------------------------------------------------------------------------
+    template<class TFun>
+    System& AddSystem(const char* name, TFun& fun)
+    {
+        System* system = new System();
+        system->name_ = name;
+        system->context_ = new TFun(fun);
+        system->run_ = [](void* context)
+        {
+            (*static_cast<TFun*>(context))();
+        };
+        system->destroy_ = [](void* context)
+        {
+            delete static_cast<TFun*>(context);
+        };
+
+        systems_.Add(system);
+        stageCount_ = 0;
+
+        return *system;
+    }
+
+    //------------------------------------------------------------------------------
+    void BuildStages();
+};
+
+}
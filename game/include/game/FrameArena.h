@@ -0,0 +1,201 @@
+#pragma once
+
+#include "Containers/Array.h"
+
+#include "Common/Assert.h"
+#include "Common/Types.h"
+#include "Common/Util.h"
+
+#include <cstring>
+#include <type_traits>
+
+namespace hs
+{
+
+//! Default size of the buffer of a FrameArena
+static constexpr int FRAME_ARENA_SIZE{ 64 * 1024 };
+
+//------------------------------------------------------------------------------
+//! Linear allocator for memory which lives until the end of the frame. Allocations bump a pointer into one buffer and
+//! Reset releases all of them at once. When the buffer runs out allocations fall back to the heap, those are counted
+//! and Reset asserts there were none. This only covers the arena itself, see HeapCounter.h for the whole heap. Not
+//! thread safe.
+class FrameArena
+{
+public:
+    //------------------------------------------------------------------------------
+    explicit FrameArena(int capacity = FRAME_ARENA_SIZE);
+
+    //------------------------------------------------------------------------------
+    ~FrameArena();
+
+    //------------------------------------------------------------------------------
+    FrameArena(const FrameArena&) = delete;
+
+    //------------------------------------------------------------------------------
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    //------------------------------------------------------------------------------
+    //! alignment has to be a power of two no bigger than alignof(std::max_align_t)
+    void* Allocate(int size, int alignment);
+
+    //------------------------------------------------------------------------------
+    //! Grows the allocation at ptr of oldSize bytes to newSize bytes without moving it. Only the last allocation can
+    //! grow, returns false when ptr is not the last one or the buffer has no room.
+    bool TryExtend(void* ptr, int oldSize, int newSize);
+
+    //------------------------------------------------------------------------------
+    //! Releases every allocation made since the previous Reset, meant to be called once at the start of a frame
+    void Reset();
+
+    //------------------------------------------------------------------------------
+    int GetUsedBytes() const
+    {
+        return top_;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Most bytes used by a single frame so far
+    int GetPeakBytes() const
+    {
+        return peakBytes_;
+    }
+
+    //------------------------------------------------------------------------------
+    int GetCapacity() const
+    {
+        return capacity_;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Allocations since the last Reset which did not fit into the buffer and went to the heap
+    int GetHeapAllocationCount() const
+    {
+        return (int)heapAllocations_.Count();
+    }
+
+private:
+    int8*           buffer_;
+    int             capacity_;
+    int             top_{};
+    // Start of the most recent allocation in the buffer, -1 when there is none
+    int             lastOffset_{ -1 };
+    int             peakBytes_{};
+    Array<void*>    heapAllocations_;
+};
+
+//------------------------------------------------------------------------------
+//! Growable array in FrameArena memory, valid until the arena is reset. Elements are never destroyed, so only
+//! trivially copyable types can be stored. Growing the last allocation of the arena extends it in place, otherwise
+//! the elements are copied to a new allocation and the old one is left unused until the reset.
+template<class T>
+class FrameArray
+{
+    static_assert(std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>, "FrameArray never runs destructors");
+
+public:
+    //------------------------------------------------------------------------------
+    explicit FrameArray(FrameArena& arena)
+        : arena_(&arena)
+    {
+    }
+
+    //------------------------------------------------------------------------------
+    FrameArray(const FrameArray&) = delete;
+
+    //------------------------------------------------------------------------------
+    FrameArray& operator=(const FrameArray&) = delete;
+
+    //------------------------------------------------------------------------------
+    void Add(const T& value)
+    {
+        if (count_ == capacity_)
+            Reserve(Max(capacity_ * 2, 16));
+
+        data_[count_++] = value;
+    }
+
+    //------------------------------------------------------------------------------
+    void Reserve(int capacity)
+    {
+        if (capacity <= capacity_)
+            return;
+
+        if (data_ && arena_->TryExtend(data_, capacity_ * (int)sizeof(T), capacity * (int)sizeof(T)))
+        {
+            capacity_ = capacity;
+            return;
+        }
+
+        auto data = (T*)arena_->Allocate(capacity * (int)sizeof(T), (int)alignof(T));
+        if (count_)
+            memcpy(data, data_, count_ * sizeof(T));
+        data_ = data;
+        capacity_ = capacity;
+    }
+
+    //------------------------------------------------------------------------------
+    void RemoveBack()
+    {
+        HS_ASSERT(count_ > 0);
+        --count_;
+    }
+
+    //------------------------------------------------------------------------------
+    void Clear()
+    {
+        count_ = 0;
+    }
+
+    //------------------------------------------------------------------------------
+    int Count() const
+    {
+        return count_;
+    }
+
+    //------------------------------------------------------------------------------
+    bool IsEmpty() const
+    {
+        return count_ == 0;
+    }
+
+    //------------------------------------------------------------------------------
+    T& operator[](int i)
+    {
+        HS_ASSERT(i >= 0 && i < count_);
+        return data_[i];
+    }
+
+    //------------------------------------------------------------------------------
+    const T& operator[](int i) const
+    {
+        HS_ASSERT(i >= 0 && i < count_);
+        return data_[i];
+    }
+
+    //------------------------------------------------------------------------------
+    T* Data()
+    {
+        return data_;
+    }
+
+    //------------------------------------------------------------------------------
+    T* begin()
+    {
+        return data_;
+    }
+
+    //------------------------------------------------------------------------------
+    T* end()
+    {
+        return data_ + count_;
+    }
+
+private:
+    FrameArena* arena_;
+    T*          data_{};
+    int         count_{};
+    int         capacity_{};
+};
+
+}
@@ -5,7 +5,9 @@
 
 #include "Ecs/Ecs.h"
 
+#include "Game/FrameArena.h"
 #include "Game/GameBase.h"
+#include "Game/LoopbackTransport.h"
 
 #include "Containers/Array.h"
 
@@ -20,6 +22,8 @@ namespace hs
 //------------------------------------------------------------------------------
 class Texture;
 class Font;
+class JobSystem;
+class SystemScheduler;
 
 //------------------------------------------------------------------------------
 extern class Game* g_Game;
@@ -38,6 +42,19 @@ struct PlayerInfo
     Entity_t weaponEntity_;
 };
 
+//------------------------------------------------------------------------------
+//! Everything the simulation reads from the input devices for one player in one frame
+struct PlayerInput
+{
+    Vec2    aimDirection_;
+    Vec2    cursorWorldPos_;
+    float   moveX_;
+    bool    isFocused_;
+    bool    isJumpDown_;
+    bool    isCursorShootDown_;
+    bool    isGamepadShootDown_;
+};
+
 //------------------------------------------------------------------------------
 struct AnimationState;
 
@@ -77,7 +94,36 @@ private:
     static constexpr float  LAYER_WEAPON{ 0.4f };
     static constexpr float  LAYER_CLUTTER{ 2 };
 
+    //! Number of past frames which can be rolled back to
+    static constexpr int    ROLLBACK_FRAMES{ 8 };
+    static constexpr int    ECS_COMPACT_FRAMES{ 600 };
+    //! Frames after the start which may allocate from the heap while buffers grow to their working size
+    static constexpr int    HEAP_WARMUP_FRAMES{ 120 };
+
+    //------------------------------------------------------------------------------
+    //! State of the simulation before a frame and the input the frame was simulated with
+    struct RollbackFrame
+    {
+        EcsWorldState   world_;
+        PlayerInfo      players_[MAX_PLAYERS];
+        float           timeToShoot_[MAX_PLAYERS];
+        float           coyoteTimeRemaining_[MAX_PLAYERS];
+        int             playerScore_[MAX_PLAYERS];
+        bool            isGrounded_[MAX_PLAYERS];
+        bool            hasDoubleJumped_[MAX_PLAYERS];
+        uint32          rngState_;
+
+        PlayerInput     inputs_[MAX_PLAYERS];
+        float           dTime_;
+        int             frame_{ -1 };
+    };
+
+    UniquePtr<JobSystem> jobSystem_;
     UniquePtr<EcsWorld> world_;
+    UniquePtr<SystemScheduler> scheduler_;
+    // Passed to the systems by SimulateFrame
+    const PlayerInput*  frameInputs_{};
+    float               frameDTime_{};
 
     UniquePtr<Font>     font_;
 
@@ -94,6 +140,11 @@ private:
     Sprite targetSprite_{};
     Sprite bowSprite_{};
 
+    // Animation states refer to these, they are filled once the sprites are loaded
+    AnimationSegment rockIdleSegments_[2]{};
+    AnimationSegment pumpkinIdleSegments_[2]{};
+    AnimationSegment crystalIdleSegments_[1]{};
+
     float       timeScale_{ 1.0f };
     float       coyoteTimeSec_{ 100.0f / 1000 };
 
@@ -106,6 +157,8 @@ private:
     int         playerScore_[MAX_PLAYERS]{};
     bool        isGrounded_[MAX_PLAYERS]{};
     bool        hasDoubleJumped_[MAX_PLAYERS]{};
+    // Random numbers of the simulation, saved with the rollback frames. xorshift needs a non-zero state.
+    uint32      rngState_{ 0x2545F491 };
 
     // Audio
     bool        muteAudio_{ true };
@@ -113,9 +166,32 @@ private:
     uint    musicLength_{};
     uint8*  musicBuffer_{};
 
+    // Transient arrays of one frame, reset at the start of Update
+    FrameArena  frameArena_;
+    // Heap allocations made by the last Update and the warm-up frames left before it has to be 0, debug builds only
+    int64       frameHeapAllocations_{};
+    int         heapWarmupFrames_{ HEAP_WARMUP_FRAMES };
+
     // Debug
     bool visualizeColliders_{};
 
+    // Rollback test, the last player's input goes through a loopback as if it came from a remote peer
+    bool                            isRollbackTest_{};
+    int                             frame_{};
+    RollbackFrame                   rollbackRing_[ROLLBACK_FRAMES];
+    // The delay is at most ROLLBACK_FRAMES - 1, so at most ROLLBACK_FRAMES inputs are in flight
+    LoopbackTransport<PlayerInput, ROLLBACK_FRAMES> loopback_;
+    PlayerInput                     lastRemoteInput_{};
+    int                             lastRemoteFrame_{ -1 };
+    int                             rolledBackFrames_{};
+    float                           rollbackCostMs_{};
+    float                           maxRollbackCostMs_{};
+
+    // ECS memory panel, the world is compacted every ECS_COMPACT_FRAMES frames when auto compaction is on
+    EcsStats    ecsStats_;
+    bool        isAutoCompact_{};
+    int         lastCompactDropped_{};
+
     void InitEcs();
     void InitCamera();
 
@@ -132,8 +208,22 @@ private:
     void AddTarget(const Vec3& pos, Sprite* sprite, const Circle& collider);
     void RemoveTarget(Entity_t idx);
 
-    void AnimateSprites();
+    void MovePlayers(const PlayerInput* inputs, float dTime);
+    void RespawnPlayers(float dTime);
+    void MoveProjectiles(float dTime);
+    void CollideProjectiles();
+    void RespawnTargets(float dTime);
+    void AnimateSprites(float dTime);
     void DrawColliders();
+    void UpdateEcsStats();
+
+    PlayerInput GatherInput(int playerId, float aimDeadzone) const;
+    void SimulateFrame(const PlayerInput* inputs, float dTime);
+
+    void ResetRollback();
+    void SaveRollbackFrame(RollbackFrame& frame);
+    void RestoreRollbackFrame(const RollbackFrame& frame);
+    void RollbackRemoteInput(PlayerInput* inputs);
 
     RESULT LoadMap();
 };
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "Common/Types.h"
+
+//! Debug builds count heap allocations, release builds don't pay for it
+#if !defined(NDEBUG)
+    #define HS_COUNT_HEAP_ALLOCATIONS 1
+#else
+    #define HS_COUNT_HEAP_ALLOCATIONS 0
+#endif
+
+namespace hs
+{
+
+//------------------------------------------------------------------------------
+//! Heap allocations made by any thread since the program started. With the MSVC debug runtime every malloc, realloc
+//! and operator new is counted, with other compilers only operator new is. Always 0 when
+//! HS_COUNT_HEAP_ALLOCATIONS is off.
+int64 GetHeapAllocationCount();
+
+}
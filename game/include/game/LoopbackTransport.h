@@ -0,0 +1,77 @@
+#pragma once
+
+#include "Config.h"
+
+#include "Common/Assert.h"
+
+namespace hs
+{
+
+//------------------------------------------------------------------------------
+//! Delivers messages back to the sender after a fixed number of frames, stands in for a network connection to a remote
+//! peer when testing prediction and rollback locally. Messages arrive in the order they were sent. At most CAPACITY
+//! messages can be in flight, they are kept in a fixed ring.
+template<class TMessage, int CAPACITY>
+class LoopbackTransport
+{
+public:
+    //------------------------------------------------------------------------------
+    //! Messages sent in frame F are received in frame F + delayFrames, only affects messages sent afterwards
+    void SetDelay(int delayFrames)
+    {
+        delayFrames_ = delayFrames;
+    }
+
+    //------------------------------------------------------------------------------
+    int GetDelay() const
+    {
+        return delayFrames_;
+    }
+
+    //------------------------------------------------------------------------------
+    void Send(int frame, const TMessage& message)
+    {
+        HS_ASSERT(count_ < CAPACITY && "Too many messages in flight, receive them or lower the delay");
+        packets_[(head_ + count_) % CAPACITY] = Packet{ frame, frame + delayFrames_, message };
+        ++count_;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Pops the oldest message which is due in the given frame, returns false when there is none
+    bool Receive(int frame, int& sentFrame, TMessage& message)
+    {
+        if (count_ == 0 || packets_[head_].deliveryFrame_ > frame)
+            return false;
+
+        sentFrame = packets_[head_].sentFrame_;
+        message = packets_[head_].message_;
+        head_ = (head_ + 1) % CAPACITY;
+        --count_;
+        return true;
+    }
+
+    //------------------------------------------------------------------------------
+    //! Drops all messages in flight
+    void Clear()
+    {
+        head_ = 0;
+        count_ = 0;
+    }
+
+private:
+    //------------------------------------------------------------------------------
+    struct Packet
+    {
+        int sentFrame_;
+        int deliveryFrame_;
+        TMessage message_;
+    };
+
+    Packet  packets_[CAPACITY]{};
+    // Oldest message in flight
+    int     head_{};
+    int     count_{};
+    int     delayFrames_{};
+};
+
+}
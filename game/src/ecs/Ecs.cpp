@@ -1,7 +1,742 @@
 #include "Ecs/Ecs.h"
 
+#include "Common/Logging.h"
+
+#include <cstdio>
+
+#if defined(_WIN32)
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    // unistd.h and fcntl.h define R_OK, the file is opened through stdio instead
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
 namespace hs
 {
 
+namespace internal
+{
+//------------------------------------------------------------------------------
+// Snapshot file layout, all offsets are from the start of the file:
+//     SnapshotHeader
+//     SnapshotType        x typeCount_
+//     SnapshotArchetype   x archetypeCount_
+//     dense_              x entityCount_
+//     records_            x entityCount_
+//     chunk images of every archetype, each aligned to ARCHETYPE_COLUMN_ALIGNMENT
+//     serialized values of components which are not trivially copyable
+static constexpr uint32 SNAPSHOT_MAGIC{ 0x53455348 }; // "HSES"
+static constexpr uint32 SNAPSHOT_VERSION{ 2 };
+
+//------------------------------------------------------------------------------
+enum SnapshotTypeFlags : int32
+{
+    STF_TRIVIALLY_COPYABLE  = 1 << 0,
+    STF_TAG                 = 1 << 1,
+    STF_SPARSE              = 1 << 2,
+    STF_SHARED              = 1 << 3,
+};
+
+//------------------------------------------------------------------------------
+struct SnapshotHeader
+{
+    uint32 magic_;
+    uint32 version_;
+    int32 storage_;
+    int32 typeCount_;
+    int32 archetypeCount_;
+    int32 entityCount_;
+    int32 denseUsedCount_;
+    int32 padding_;
+};
+
+//------------------------------------------------------------------------------
+//! Registered component type, used to check the snapshot was made with the same component registration
+struct SnapshotType
+{
+    int32 size_;
+    int32 alignment_;
+    int32 flags_;
+    int32 padding_;
+};
+
+//------------------------------------------------------------------------------
+struct SnapshotArchetype
+{
+    int32 typeCount_;
+    int32 typeIds_[MAX_ARCHETYPE_COMPONENTS];
+    int32 rowCount_;
+    int32 chunkCount_;
+    int32 chunkRowCapacity_;
+    int32 chunkByteSize_;
+    int32 padding_;
+    int64 chunkOffset_;
+    int64 valueOffset_;
+    int64 valueSize_;
+};
+
+//------------------------------------------------------------------------------
+struct SnapshotRecord
+{
+    int32 archetype_;
+    int32 rowIndex_;
+    int32 denseIdx_;
+    int32 entity_;
+};
+
+// Sections follow each other without padding, the sizes keep every section 8 byte aligned
+static_assert(sizeof(SnapshotHeader) % 8 == 0);
+static_assert(sizeof(SnapshotType) % 8 == 0);
+static_assert(sizeof(SnapshotArchetype) % 8 == 0);
+static_assert(sizeof(Entity_t) == sizeof(int32));
+
+//------------------------------------------------------------------------------
+static int64 AlignUp64(int64 value, int64 alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+//------------------------------------------------------------------------------
+static int32 GetSnapshotTypeFlags(const TypeDetails* details)
+{
+    int32 flags = 0;
+    if (details->isTriviallyCopyable_)
+        flags |= STF_TRIVIALLY_COPYABLE;
+    if (details->isTag_)
+        flags |= STF_TAG;
+    if (details->isSparse_)
+        flags |= STF_SPARSE;
+    if (details->isShared_)
+        flags |= STF_SHARED;
+    return flags;
+}
+
+//------------------------------------------------------------------------------
+static int64 GetChunkStride(const SnapshotArchetype& archetype)
+{
+    return AlignUp64(archetype.chunkByteSize_, ARCHETYPE_COLUMN_ALIGNMENT);
+}
+
+//------------------------------------------------------------------------------
+FileMapping::~FileMapping()
+{
+    Unmap();
+}
+
+//------------------------------------------------------------------------------
+RESULT FileMapping::Map(const char* path)
+{
+    HS_ASSERT(!data_ && "File is already mapped");
+
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return R_FAIL;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return R_FAIL;
+    }
+
+    // The view keeps the mapping alive, the handles are not needed after it is created
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping)
+        return R_FAIL;
+
+    void* view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view)
+        return R_FAIL;
+
+    data_ = (int8*)view;
+    size_ = size.QuadPart;
+#else
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return R_FAIL;
+
+    struct stat fileStat;
+    if (fstat(fileno(file), &fileStat) != 0 || fileStat.st_size == 0)
+    {
+        fclose(file);
+        return R_FAIL;
+    }
+
+    // The mapping holds its own reference to the file
+    void* view = mmap(nullptr, (size_t)fileStat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), 0);
+    fclose(file);
+    if (view == MAP_FAILED)
+        return R_FAIL;
+
+    data_ = (int8*)view;
+    size_ = fileStat.st_size;
+#endif
+
+    return R_OK;
+}
+
+//------------------------------------------------------------------------------
+void FileMapping::Unmap()
+{
+    if (!data_)
+        return;
+
+#if defined(_WIN32)
+    UnmapViewOfFile(data_);
+#else
+    munmap(data_, (size_t)size_);
+#endif
+
+    data_ = nullptr;
+    size_ = 0;
+}
 }
 
+//------------------------------------------------------------------------------
+RESULT EcsWorld::SaveSnapshot(const char* path) const
+{
+    HS_ASSERT(!iteratingDepth_ && "Snapshot can't be saved during iteration");
+
+    for (int i = 0; i < sparseSets_.Count(); ++i)
+    {
+        if (sparseSets_[i] && sparseSets_[i]->GetCount())
+        {
+            LOG_ERR("Failed to save snapshot %s, sparse components are not supported", path);
+            return R_FAIL;
+        }
+    }
+
+    for (int i = 0; i < archetypes_.Count(); ++i)
+    {
+        if (archetypes_[i].GetSharedCount())
+        {
+            LOG_ERR("Failed to save snapshot %s, shared components are not supported", path);
+            return R_FAIL;
+        }
+    }
+
+    // Values of components which are not trivially copyable, the offsets are relative to the start of this block
+    Array<int8> values;
+    Array<internal::SnapshotArchetype> archetypeHeaders;
+    archetypeHeaders.Reserve(archetypes_.Count());
+
+    int maxChunkStride = 0;
+    for (int archetypeI = 0; archetypeI < archetypes_.Count(); ++archetypeI)
+    {
+        const Archetype& archetype = archetypes_[archetypeI];
+
+        internal::SnapshotArchetype header{};
+        header.typeCount_ = archetype.GetType().Count();
+        for (int i = 0; i < header.typeCount_; ++i)
+            header.typeIds_[i] = archetype.GetType()[i];
+
+        int offsets[MAX_ARCHETYPE_COMPONENTS];
+        header.rowCount_ = archetype.GetRowCount();
+        header.chunkCount_ = archetype.GetChunkCount();
+        header.chunkByteSize_ = archetype.GetSnapshotLayout(header.chunkRowCapacity_, offsets);
+        header.valueOffset_ = values.Count();
+
+        for (int columnI = 0; columnI < archetype.GetColumnCount(); ++columnI)
+        {
+            const TypeDetails* details = archetype.GetColumnDetails(columnI);
+            if (details->isTriviallyCopyable_ || !header.rowCount_)
+                continue;
+
+            if (!details->snapshotSave_)
+            {
+                LOG_ERR("Failed to save snapshot %s, component %d is not trivially copyable and has no SnapshotSerializer",
+                    path, archetype.GetColumnTypeId(columnI));
+                return R_FAIL;
+            }
+
+            for (int chunkI = 0; chunkI < header.chunkCount_; ++chunkI)
+            {
+                const int8* column = (const int8*)archetype.GetChunkColumn(chunkI, columnI);
+                for (int rowI = 0; rowI < archetype.GetChunkRowCount(chunkI); ++rowI)
+                    details->snapshotSave_(column + rowI * details->size_, values);
+            }
+        }
+
+        header.valueSize_ = values.Count() - header.valueOffset_;
+        maxChunkStride = Max(maxChunkStride, (int)internal::GetChunkStride(header));
+        archetypeHeaders.Add(header);
+    }
+
+    internal::SnapshotHeader fileHeader{};
+    fileHeader.magic_ = internal::SNAPSHOT_MAGIC;
+    fileHeader.version_ = internal::SNAPSHOT_VERSION;
+    fileHeader.storage_ = (int32)storage_;
+    fileHeader.typeCount_ = TypeInfoDb::GetTypeCount();
+    fileHeader.archetypeCount_ = archetypes_.Count();
+    fileHeader.entityCount_ = dense_.Count();
+    fileHeader.denseUsedCount_ = denseUsedCount_;
+
+    // Chunk images start at the first aligned offset after the tables, values follow the last image
+    int64 offset = sizeof(internal::SnapshotHeader)
+        + fileHeader.typeCount_ * sizeof(internal::SnapshotType)
+        + fileHeader.archetypeCount_ * sizeof(internal::SnapshotArchetype)
+        + fileHeader.entityCount_ * sizeof(Entity_t)
+        + fileHeader.entityCount_ * sizeof(internal::SnapshotRecord);
+    offset = internal::AlignUp64(offset, ARCHETYPE_COLUMN_ALIGNMENT);
+    const int64 tablesEnd = offset;
+
+    for (internal::SnapshotArchetype& header : archetypeHeaders)
+    {
+        header.chunkOffset_ = offset;
+        offset += header.chunkCount_ * internal::GetChunkStride(header);
+    }
+
+    for (internal::SnapshotArchetype& header : archetypeHeaders)
+        header.valueOffset_ += offset;
+
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        LOG_ERR("Failed to open snapshot %s for writing", path);
+        return R_FAIL;
+    }
+
+    bool isOk = true;
+    auto write = [file, &isOk](const void* data, int64 size)
+    {
+        if (size)
+            isOk &= fwrite(data, 1, (size_t)size, file) == (size_t)size;
+    };
+
+    write(&fileHeader, sizeof(fileHeader));
+    for (int typeI = 0; typeI < fileHeader.typeCount_; ++typeI)
+    {
+        const TypeDetails* details = TypeInfoDb::GetDetails(typeI);
+
+        internal::SnapshotType type{};
+        type.size_ = details->size_;
+        type.alignment_ = details->alignment_;
+        type.flags_ = internal::GetSnapshotTypeFlags(details);
+        write(&type, sizeof(type));
+    }
+    write(archetypeHeaders.Data(), archetypeHeaders.Count() * sizeof(internal::SnapshotArchetype));
+    write(dense_.Data(), dense_.Count() * sizeof(Entity_t));
+
+    static_assert(sizeof(EntityRecord) == sizeof(internal::SnapshotRecord));
+    write(records_.Data(), records_.Count() * sizeof(EntityRecord));
+
+    static constexpr int8 ZEROS[ARCHETYPE_COLUMN_ALIGNMENT]{};
+    write(ZEROS, tablesEnd - (int64)ftell(file));
+
+    // Columns which are not copied stay zero, their values are in the value block
+    int8* image = (int8*)internal::AlignedAlloc(Max(maxChunkStride, 1), ARCHETYPE_COLUMN_ALIGNMENT);
+    for (int archetypeI = 0; archetypeI < archetypes_.Count(); ++archetypeI)
+    {
+        const Archetype& archetype = archetypes_[archetypeI];
+        const int64 stride = internal::GetChunkStride(archetypeHeaders[archetypeI]);
+
+        int chunkRowCapacity;
+        int offsets[MAX_ARCHETYPE_COMPONENTS];
+        archetype.GetSnapshotLayout(chunkRowCapacity, offsets);
+
+        for (int chunkI = 0; chunkI < archetypeHeaders[archetypeI].chunkCount_; ++chunkI)
+        {
+            memset(image, 0, (size_t)stride);
+            archetype.WriteSnapshotChunk(chunkI, image, offsets);
+            write(image, stride);
+        }
+    }
+    internal::AlignedFree(image);
+
+    write(values.Data(), values.Count());
+
+    isOk &= fclose(file) == 0;
+    if (!isOk)
+    {
+        LOG_ERR("Failed to write snapshot %s", path);
+        return R_FAIL;
+    }
+
+    return R_OK;
+}
+
+//------------------------------------------------------------------------------
+RESULT EcsWorld::LoadSnapshot(const char* path)
+{
+    HS_ASSERT(!IsIterating() && "Snapshot can't be loaded during iteration");
+
+    if (dense_.Count() || snapshotMapping_.GetData())
+    {
+        LOG_ERR("Failed to load snapshot %s, the world already has entities", path);
+        return R_FAIL;
+    }
+
+    if (HS_FAILED(snapshotMapping_.Map(path)))
+    {
+        LOG_ERR("Failed to map snapshot %s", path);
+        return R_FAIL;
+    }
+
+    int8* data = snapshotMapping_.GetData();
+    const int64 size = snapshotMapping_.GetSize();
+
+    // Everything is validated before the first archetype starts using the mapped memory
+    auto fail = [this, path](const char* reason)
+    {
+        LOG_ERR("Failed to load snapshot %s, %s", path, reason);
+        snapshotMapping_.Unmap();
+        return R_FAIL;
+    };
+
+    if (size < (int64)sizeof(internal::SnapshotHeader))
+        return fail("file is too small");
+
+    const auto& fileHeader = *(const internal::SnapshotHeader*)data;
+    if (fileHeader.magic_ != internal::SNAPSHOT_MAGIC || fileHeader.version_ != internal::SNAPSHOT_VERSION)
+        return fail("unknown format or version");
+
+    if (fileHeader.storage_ != (int32)storage_)
+        return fail("archetype storage differs");
+
+    if (fileHeader.typeCount_ > TypeInfoDb::GetTypeCount() || fileHeader.archetypeCount_ <= 0
+        || fileHeader.entityCount_ < 0 || fileHeader.denseUsedCount_ < 0 || fileHeader.denseUsedCount_ > fileHeader.entityCount_)
+    {
+        return fail("invalid header");
+    }
+
+    const int64 tablesSize = sizeof(internal::SnapshotHeader)
+        + fileHeader.typeCount_ * sizeof(internal::SnapshotType)
+        + fileHeader.archetypeCount_ * sizeof(internal::SnapshotArchetype)
+        + fileHeader.entityCount_ * sizeof(Entity_t)
+        + fileHeader.entityCount_ * sizeof(internal::SnapshotRecord);
+    if (size < tablesSize)
+        return fail("file is truncated");
+
+    const auto* types = (const internal::SnapshotType*)(data + sizeof(internal::SnapshotHeader));
+    const auto* archetypeHeaders = (const internal::SnapshotArchetype*)(types + fileHeader.typeCount_);
+    const auto* dense = (const Entity_t*)(archetypeHeaders + fileHeader.archetypeCount_);
+    const auto* records = (const internal::SnapshotRecord*)(dense + fileHeader.entityCount_);
+
+    for (int typeI = 0; typeI < fileHeader.typeCount_; ++typeI)
+    {
+        const TypeDetails* details = TypeInfoDb::GetDetails(typeI);
+        if (types[typeI].size_ != details->size_ || types[typeI].alignment_ != details->alignment_
+            || types[typeI].flags_ != internal::GetSnapshotTypeFlags(details))
+        {
+            return fail("component types differ");
+        }
+    }
+
+    // Archetypes are matched by type, indices in the world may differ from the ones in the snapshot
+    Array<int> archetypeRemap;
+    archetypeRemap.Reserve(fileHeader.archetypeCount_);
+    for (int archetypeI = 0; archetypeI < fileHeader.archetypeCount_; ++archetypeI)
+    {
+        const internal::SnapshotArchetype& header = archetypeHeaders[archetypeI];
+        if (header.typeCount_ <= 0 || header.typeCount_ > MAX_ARCHETYPE_COMPONENTS || header.typeIds_[0] != 0)
+            return fail("invalid archetype");
+
+        Archetype::Type_t type;
+        for (int i = 0; i < header.typeCount_; ++i)
+        {
+            if (header.typeIds_[i] >= fileHeader.typeCount_ || (i > 0 && header.typeIds_[i] <= header.typeIds_[i - 1]))
+                return fail("invalid archetype type");
+
+            // Neither is ever saved as part of an archetype
+            const TypeDetails* details = TypeInfoDb::GetDetails(header.typeIds_[i]);
+            if (details->isSparse_ || details->isShared_)
+                return fail("invalid archetype type");
+            type.Add(header.typeIds_[i]);
+        }
+
+        const int archetypeIdx = FindOrCreateArchetype(type);
+        archetypeRemap.Add(archetypeIdx);
+
+        const Archetype& archetype = archetypes_[archetypeIdx];
+        if (archetype.GetRowCount())
+            return fail("archetype already has rows");
+
+        int chunkRowCapacity;
+        int offsets[MAX_ARCHETYPE_COMPONENTS];
+        const int chunkByteSize = archetype.GetSnapshotLayout(chunkRowCapacity, offsets);
+        if (header.rowCount_ < 0 || header.chunkCount_ < 0
+            || (storage_ == ArchetypeStorage::Chunked && (header.chunkByteSize_ != chunkByteSize || header.chunkRowCapacity_ != chunkRowCapacity))
+            || (storage_ == ArchetypeStorage::Contiguous && (header.chunkCount_ > 1 || header.chunkRowCapacity_ != header.rowCount_))
+            || (int64)header.chunkCount_ * header.chunkRowCapacity_ < header.rowCount_)
+        {
+            return fail("archetype layout differs");
+        }
+
+        if (header.chunkCount_ && (header.chunkOffset_ < tablesSize || header.chunkOffset_ % ARCHETYPE_COLUMN_ALIGNMENT
+            || header.chunkOffset_ + header.chunkCount_ * internal::GetChunkStride(header) > size))
+        {
+            return fail("chunk images are out of the file");
+        }
+
+        if (header.valueSize_ < 0 || header.valueOffset_ < tablesSize || header.valueOffset_ + header.valueSize_ > size)
+            return fail("values are out of the file");
+
+        for (int columnI = 0; columnI < archetype.GetColumnCount() && header.rowCount_; ++columnI)
+        {
+            const TypeDetails* details = archetype.GetColumnDetails(columnI);
+            if (!details->isTriviallyCopyable_ && !details->snapshotLoad_)
+                return fail("component is not trivially copyable and has no SnapshotSerializer");
+        }
+    }
+
+    // Every slot is in dense_ once, live ones in the first denseUsedCount_ entries
+    for (int index = 0; index < fileHeader.entityCount_; ++index)
+    {
+        const internal::SnapshotRecord& record = records[index];
+        if (GetEntityIndex(record.entity_) != index || record.denseIdx_ < 0 || record.denseIdx_ >= fileHeader.entityCount_
+            || dense[record.denseIdx_] != record.entity_)
+        {
+            return fail("invalid entity record");
+        }
+
+        if (record.denseIdx_ >= fileHeader.denseUsedCount_)
+        {
+            if (record.archetype_ != ID_BAD)
+                return fail("invalid entity record");
+        }
+        else if (record.archetype_ < 0 || record.archetype_ >= fileHeader.archetypeCount_
+            || record.rowIndex_ < 0 || record.rowIndex_ >= archetypeHeaders[record.archetype_].rowCount_)
+        {
+            return fail("invalid entity record");
+        }
+    }
+
+    for (int archetypeI = 0; archetypeI < fileHeader.archetypeCount_; ++archetypeI)
+    {
+        const internal::SnapshotArchetype& header = archetypeHeaders[archetypeI];
+        if (!header.rowCount_)
+            continue;
+
+        Archetype& archetype = archetypes_[archetypeRemap[archetypeI]];
+        archetype.AdoptSnapshotChunks(data + header.chunkOffset_, header.chunkCount_, (int)internal::GetChunkStride(header),
+            header.rowCount_, header.chunkRowCapacity_);
+
+        // Only components which are not trivially copyable cost per row work
+        const int8* value = data + header.valueOffset_;
+        for (int columnI = 0; columnI < archetype.GetColumnCount(); ++columnI)
+        {
+            const TypeDetails* details = archetype.GetColumnDetails(columnI);
+            if (details->isTriviallyCopyable_)
+                continue;
+
+            for (int chunkI = 0; chunkI < archetype.GetChunkCount(); ++chunkI)
+            {
+                int8* column = (int8*)archetype.GetChunkColumn(chunkI, columnI);
+                for (int rowI = 0; rowI < archetype.GetChunkRowCount(chunkI); ++rowI)
+                    value = details->snapshotLoad_(column + rowI * details->size_, value);
+            }
+        }
+        HS_ASSERT(value == data + header.valueOffset_ + header.valueSize_ && "Serialized values don't match the snapshot");
+    }
+
+    dense_.Reserve(fileHeader.entityCount_);
+    records_.Reserve(fileHeader.entityCount_);
+    for (int i = 0; i < fileHeader.entityCount_; ++i)
+    {
+        const internal::SnapshotRecord& record = records[i];
+        const int archetypeIdx = record.archetype_ == ID_BAD ? ID_BAD : archetypeRemap[record.archetype_];
+
+        dense_.Add(dense[i]);
+        records_.Add(EntityRecord{ archetypeIdx, record.rowIndex_, record.denseIdx_, record.entity_ });
+    }
+
+    denseUsedCount_ = fileHeader.denseUsedCount_;
+
+    return R_OK;
+}
+
+//------------------------------------------------------------------------------
+void EcsWorld::SaveState(EcsWorldState& state)
+{
+    HS_ASSERT(!IsIterating() && "State can't be saved during iteration");
+
+    // Versions in the state are only meaningful for the world it was saved from and its current archetypes
+    if (state.world_ != this || state.archetypeListVersion_ != archetypeListVersion_)
+    {
+        state.archetypes_.Clear();
+        state.world_ = this;
+        state.version_ = 0;
+        state.archetypeListVersion_ = archetypeListVersion_;
+    }
+
+    // Archetypes are only removed by Compact so states of earlier saves keep matching their archetypes by index
+    while (state.archetypes_.Count() < archetypes_.Count())
+        state.archetypes_.Add(ArchetypeState{});
+
+    for (int i = 0; i < archetypes_.Count(); ++i)
+        archetypes_[i].SaveState(state.archetypes_[i], state.version_);
+
+    state.dense_.CopyFrom(dense_);
+    state.records_.CopyFrom(records_);
+    state.denseUsedCount_ = denseUsedCount_;
+
+    while (state.sparseSets_.Count() < sparseSets_.Count())
+        state.sparseSets_.Add(nullptr);
+
+    for (int i = 0; i < state.sparseSets_.Count(); ++i)
+    {
+        const SparseSet* set = FindSparseSet(i);
+        if (set && !state.sparseSets_[i])
+            state.sparseSets_[i] = new SparseSet(i, nullptr);
+
+        if (set)
+            state.sparseSets_[i]->CopyFrom(*set);
+        else if (state.sparseSets_[i])
+            state.sparseSets_[i]->Clear();
+    }
+
+    // Writes after the save get a newer version than the state
+    state.version_ = changeVersion_++;
+}
+
+//------------------------------------------------------------------------------
+void EcsWorld::RestoreState(const EcsWorldState& state)
+{
+    HS_ASSERT(!IsIterating() && "State can't be restored during iteration");
+    HS_ASSERT(state.world_ == this && "State was not saved from this world");
+    HS_ASSERT(state.archetypeListVersion_ == archetypeListVersion_ && "State was saved before Compact dropped archetypes");
+    HS_ASSERT(commandBuffers_[0]->IsEmpty() && "Pending commands would apply to the restored entities");
+
+    // Archetypes created after the save had no rows at that time
+    ArchetypeState emptyState;
+    for (int i = 0; i < archetypes_.Count(); ++i)
+        archetypes_[i].RestoreState(i < state.archetypes_.Count() ? state.archetypes_[i] : emptyState, state.version_);
+
+    dense_.CopyFrom(state.dense_);
+    records_.CopyFrom(state.records_);
+    denseUsedCount_ = state.denseUsedCount_;
+
+    // Sets created after the save had no values at that time
+    for (int i = 0; i < sparseSets_.Count(); ++i)
+    {
+        if (!sparseSets_[i])
+            continue;
+
+        if (i < state.sparseSets_.Count() && state.sparseSets_[i])
+            sparseSets_[i]->CopyFrom(*state.sparseSets_[i]);
+        else
+            sparseSets_[i]->Clear();
+    }
+}
+
+//------------------------------------------------------------------------------
+void EcsWorld::GetStats(EcsStats& stats) const
+{
+    stats.archetypes_.Clear();
+    stats.entityCount_ = denseUsedCount_;
+    stats.emptyArchetypeCount_ = 0;
+    stats.allocatedBytes_ = 0;
+    stats.wastedBytes_ = 0;
+    stats.sparseBytes_ = 0;
+    stats.sparseValueCount_ = 0;
+    stats.sharedValueCount_ = sharedValues_.Count();
+
+    for (int archetypeI = 0; archetypeI < archetypes_.Count(); ++archetypeI)
+    {
+        const Archetype& archetype = archetypes_[archetypeI];
+
+        EcsArchetypeStats archetypeStats{};
+        archetypeStats.archetype_ = archetypeI;
+        archetypeStats.rowCount_ = archetype.GetRowCount();
+        archetypeStats.rowCapacity_ = archetype.GetRowCapacity();
+        archetypeStats.peakRowCount_ = archetype.GetPeakRowCount();
+        archetypeStats.chunkCount_ = archetype.GetAllocatedChunkCount();
+        archetypeStats.columnCount_ = archetype.GetColumnCount();
+        archetypeStats.allocatedBytes_ = archetype.GetAllocatedBytes();
+        archetypeStats.queryCount_ = archetype.GetQueryCount();
+
+        int64 usedBytes = 0;
+        for (int i = 0; i < archetype.GetColumnCount(); ++i)
+        {
+            const int size = archetype.GetColumnDetails(i)->size_;
+            archetypeStats.columnTypeIds_[i] = archetype.GetColumnTypeId(i);
+            archetypeStats.columnBytes_[i] = (int64)archetypeStats.rowCapacity_ * size;
+            usedBytes += (int64)archetypeStats.rowCount_ * size;
+        }
+        archetypeStats.wastedBytes_ = archetypeStats.allocatedBytes_ - usedBytes;
+
+        stats.archetypes_.Add(archetypeStats);
+        stats.allocatedBytes_ += archetypeStats.allocatedBytes_;
+        stats.wastedBytes_ += archetypeStats.wastedBytes_;
+        if (!archetypeStats.rowCount_)
+            ++stats.emptyArchetypeCount_;
+    }
+
+    for (int i = 0; i < sparseSets_.Count(); ++i)
+    {
+        if (!sparseSets_[i])
+            continue;
+
+        stats.sparseBytes_ += sparseSets_[i]->GetAllocatedBytes();
+        stats.sparseValueCount_ += sparseSets_[i]->GetCount();
+    }
+    stats.allocatedBytes_ += stats.sparseBytes_;
+
+    stats.allocator_ = allocatorStats_;
+    stats.allocator_.reservedBytes_ = allocator_->GetReservedBytes();
+}
+
+//------------------------------------------------------------------------------
+int EcsWorld::Compact()
+{
+    HS_ASSERT(!IsIterating() && "World can't be compacted during iteration");
+
+    // New index of every archetype, ID_BAD for dropped ones. The root archetype is kept since everything starts in it.
+    Array<int> remap;
+    int keptCount = 0;
+    for (int i = 0; i < archetypes_.Count(); ++i)
+    {
+        Archetype& archetype = archetypes_[i];
+        const bool isIdle = i != 0 && archetype.GetPeakRowCount() == 0;
+
+        // Capacity used since the last compaction is kept so regular spikes don't reallocate every time
+        archetype.ShrinkCapacity(isIdle ? 0 : archetype.GetPeakRowCount());
+        archetype.ResetPeakRowCount();
+
+        remap.Add(isIdle ? ID_BAD : keptCount++);
+    }
+
+    const int droppedCount = archetypes_.Count() - keptCount;
+    if (!droppedCount)
+        return 0;
+
+    // Kept archetypes slide down over the dropped ones which hold no memory anymore
+    for (int i = 0; i < archetypes_.Count(); ++i)
+    {
+        if (remap[i] != ID_BAD && remap[i] != i)
+            archetypes_[remap[i]] = std::move(archetypes_[i]);
+    }
+    while (archetypes_.Count() > keptCount)
+        archetypes_.RemoveBack();
+
+    archetypeIndex_.clear();
+    for (int i = 0; i < archetypes_.Count(); ++i)
+    {
+        archetypes_[i].RemapEdges(remap.Data());
+        archetypeIndex_.emplace(archetypes_[i].GetKey(), i);
+    }
+
+    for (int i = 0; i < queries_.Count(); ++i)
+        queries_[i]->RemapArchetypes(remap.Data());
+
+    for (int i = 0; i < records_.Count(); ++i)
+    {
+        if (records_[i].archetype_ != ID_BAD)
+            records_[i].archetype_ = remap[records_[i].archetype_];
+    }
+
+    ++archetypeListVersion_;
+    return droppedCount;
+}
+
+}
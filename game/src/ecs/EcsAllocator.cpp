@@ -0,0 +1,177 @@
+#include "Ecs/EcsAllocator.h"
+
+#include "Ecs/Ecs.h"
+
+#include "Common/Assert.h"
+
+#if defined(_WIN32)
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+#endif
+
+namespace hs
+{
+
+namespace internal
+{
+//------------------------------------------------------------------------------
+//! Reserves and commits one arena of ECS_POOL_ARENA_SIZE bytes, null on failure
+static void* AllocateArena(bool useHugePages)
+{
+    #if defined(_WIN32)
+        // Large pages need the lock memory privilege, without it the allocation fails and regular pages are used
+        const size_t largePageSize = GetLargePageMinimum();
+        if (useHugePages && largePageSize && ECS_POOL_ARENA_SIZE % largePageSize == 0)
+        {
+            if (void* arena = VirtualAlloc(nullptr, ECS_POOL_ARENA_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE))
+                return arena;
+        }
+
+        return VirtualAlloc(nullptr, ECS_POOL_ARENA_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    #else
+        if (!useHugePages)
+        {
+            void* arena = mmap(nullptr, ECS_POOL_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            return arena == MAP_FAILED ? nullptr : arena;
+        }
+
+        // Transparent huge pages only back ranges aligned to the huge page size, map twice the size and trim the ends
+        void* mapping = mmap(nullptr, 2 * ECS_POOL_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+            return nullptr;
+
+        const uintptr_t start = (uintptr_t)mapping;
+        const uintptr_t alignedStart = (start + ECS_POOL_ARENA_SIZE - 1) & ~(uintptr_t)(ECS_POOL_ARENA_SIZE - 1);
+        if (alignedStart > start)
+            munmap(mapping, alignedStart - start);
+        if (const uintptr_t tail = start + 2 * ECS_POOL_ARENA_SIZE - (alignedStart + ECS_POOL_ARENA_SIZE))
+            munmap((void*)(alignedStart + ECS_POOL_ARENA_SIZE), tail);
+
+        #if defined(MADV_HUGEPAGE)
+            madvise((void*)alignedStart, ECS_POOL_ARENA_SIZE, MADV_HUGEPAGE);
+        #endif
+        return (void*)alignedStart;
+    #endif
+}
+
+//------------------------------------------------------------------------------
+static void FreeArena(void* arena)
+{
+    #if defined(_WIN32)
+        VirtualFree(arena, 0, MEM_RELEASE);
+    #else
+        munmap(arena, ECS_POOL_ARENA_SIZE);
+    #endif
+}
+}
+
+//------------------------------------------------------------------------------
+EcsPoolAllocator::EcsPoolAllocator(bool useHugePages)
+    : useHugePages_(useHugePages)
+{
+}
+
+//------------------------------------------------------------------------------
+EcsPoolAllocator::~EcsPoolAllocator()
+{
+    HS_ASSERT(largeBytes_ == 0 && "Large blocks have to be freed before the allocator is destroyed");
+
+    for (int i = 0; i < arenas_.Count(); ++i)
+        internal::FreeArena(arenas_[i]);
+}
+
+//------------------------------------------------------------------------------
+int EcsPoolAllocator::GetSizeClass(size_t size)
+{
+    int sizeClass = 0;
+    while (((size_t)ECS_POOL_MIN_BLOCK_SIZE << sizeClass) < size)
+        ++sizeClass;
+    return sizeClass;
+}
+
+//------------------------------------------------------------------------------
+void EcsPoolAllocator::AddArena()
+{
+    void* arena = internal::AllocateArena(useHugePages_);
+    HS_ASSERT(arena);
+
+    arenas_.Add(arena);
+    arenaTop_ = (int8*)arena;
+    arenaEnd_ = arenaTop_ + ECS_POOL_ARENA_SIZE;
+}
+
+//------------------------------------------------------------------------------
+void* EcsPoolAllocator::Allocate(size_t size, size_t alignment)
+{
+    HS_ASSERT(alignment <= ECS_POOL_MIN_BLOCK_SIZE && "Over-aligned allocations are not supported");
+
+    if (size > ECS_POOL_MAX_BLOCK_SIZE)
+    {
+        largeBytes_ += size;
+        return internal::AlignedAlloc(size, ECS_POOL_MIN_BLOCK_SIZE);
+    }
+
+    const int sizeClass = GetSizeClass(size);
+    if (FreeBlock* block = freeLists_[sizeClass])
+    {
+        freeLists_[sizeClass] = block->next_;
+        return block;
+    }
+
+    const int blockSize = ECS_POOL_MIN_BLOCK_SIZE << sizeClass;
+    if (arenaEnd_ - arenaTop_ < blockSize)
+    {
+        // The rest of the arena is smaller than the block, it is split into blocks of the smaller classes
+        for (int i = sizeClass - 1; i >= 0; --i)
+        {
+            const int leftoverSize = ECS_POOL_MIN_BLOCK_SIZE << i;
+            if (arenaEnd_ - arenaTop_ < leftoverSize)
+                continue;
+
+            auto leftover = (FreeBlock*)arenaTop_;
+            leftover->next_ = freeLists_[i];
+            freeLists_[i] = leftover;
+            arenaTop_ += leftoverSize;
+        }
+
+        AddArena();
+    }
+
+    void* block = arenaTop_;
+    arenaTop_ += blockSize;
+    return block;
+}
+
+//------------------------------------------------------------------------------
+void EcsPoolAllocator::Free(void* ptr, size_t size)
+{
+    if (!ptr)
+        return;
+
+    if (size > ECS_POOL_MAX_BLOCK_SIZE)
+    {
+        largeBytes_ -= size;
+        internal::AlignedFree(ptr);
+        return;
+    }
+
+    const int sizeClass = GetSizeClass(size);
+    auto block = (FreeBlock*)ptr;
+    block->next_ = freeLists_[sizeClass];
+    freeLists_[sizeClass] = block;
+}
+
+//------------------------------------------------------------------------------
+int64 EcsPoolAllocator::GetReservedBytes() const
+{
+    return (int64)arenas_.Count() * ECS_POOL_ARENA_SIZE + largeBytes_;
+}
+
+}
@@ -0,0 +1,180 @@
+#include "Ecs/JobSystem.h"
+
+#include "Common/Util.h"
+#include "Common/Assert.h"
+
+namespace hs
+{
+
+static thread_local int t_ThreadIdx{ 0 };
+
+//------------------------------------------------------------------------------
+JobSystem::JobSystem(int workerCount)
+{
+    if (workerCount <= 0)
+        workerCount = Max((int)std::thread::hardware_concurrency() - 1, 0);
+
+    workerCount_ = workerCount;
+    queues_ = new TaskQueue[workerCount_ + 1];
+    workers_ = new std::thread[workerCount_];
+
+    for (int i = 0; i < workerCount_; ++i)
+        workers_[i] = std::thread(&JobSystem::WorkerMain, this, i + 1);
+}
+
+//------------------------------------------------------------------------------
+JobSystem::~JobSystem()
+{
+    {
+        std::lock_guard<std::mutex> lock(wakeMutex_);
+        isRunning_ = false;
+    }
+    wakeCondition_.notify_all();
+
+    for (int i = 0; i < workerCount_; ++i)
+        workers_[i].join();
+
+    delete[] workers_;
+    delete[] queues_;
+}
+
+//------------------------------------------------------------------------------
+int JobSystem::GetCurrentThreadIdx()
+{
+    return t_ThreadIdx;
+}
+
+//------------------------------------------------------------------------------
+void JobSystem::ParallelFor(int taskCount, TaskFun_t fun, void* context)
+{
+    if (taskCount <= 0)
+        return;
+
+    if (!workerCount_ || taskCount == 1)
+    {
+        for (int i = 0; i < taskCount; ++i)
+            fun(context, i, 0);
+        return;
+    }
+
+    const bool wasInParallelFor = isInParallelFor_.exchange(true);
+    HS_ASSERT(!wasInParallelFor && "Nested or concurrent ParallelFor is not supported");
+    (void)wasInParallelFor;
+
+    Batch batch;
+    batch.fun_ = fun;
+    batch.context_ = context;
+    batch.remaining_.store(taskCount, std::memory_order_relaxed);
+
+    // Deal the tasks round robin, stealing evens out the rest
+    const int threadCount = GetThreadCount();
+    for (int queueI = 0; queueI < threadCount; ++queueI)
+    {
+        std::lock_guard<std::mutex> lock(queues_[queueI].mutex_);
+        for (int taskI = queueI; taskI < taskCount; taskI += threadCount)
+            queues_[queueI].tasks_.Add(Task{ &batch, taskI });
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(wakeMutex_);
+        ++wakeGeneration_;
+    }
+    wakeCondition_.notify_all();
+
+    while (batch.remaining_.load(std::memory_order_acquire) > 0)
+    {
+        if (!TryRunOne(0))
+            std::this_thread::yield();
+    }
+
+    isInParallelFor_.store(false);
+}
+
+//------------------------------------------------------------------------------
+void JobSystem::WorkerMain(int threadIdx)
+{
+    t_ThreadIdx = threadIdx;
+
+    uint64 seenGeneration = 0;
+    for (;;)
+    {
+        if (TryRunOne(threadIdx))
+            continue;
+
+        std::unique_lock<std::mutex> lock(wakeMutex_);
+        wakeCondition_.wait(lock, [this, seenGeneration]()
+        {
+            return !isRunning_ || wakeGeneration_ != seenGeneration;
+        });
+
+        if (!isRunning_)
+            return;
+
+        seenGeneration = wakeGeneration_;
+    }
+}
+
+//------------------------------------------------------------------------------
+bool JobSystem::TryPop(int queueIdx, Task& task)
+{
+    TaskQueue& queue = queues_[queueIdx];
+    std::lock_guard<std::mutex> lock(queue.mutex_);
+
+    if ((int)queue.tasks_.Count() == queue.head_)
+        return false;
+
+    task = queue.tasks_[queue.tasks_.Count() - 1];
+    queue.tasks_.RemoveBack();
+
+    if ((int)queue.tasks_.Count() == queue.head_)
+    {
+        queue.tasks_.Clear();
+        queue.head_ = 0;
+    }
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+bool JobSystem::TrySteal(int thiefIdx, Task& task)
+{
+    const int threadCount = GetThreadCount();
+    for (int i = 1; i < threadCount; ++i)
+    {
+        TaskQueue& queue = queues_[(thiefIdx + i) % threadCount];
+        std::lock_guard<std::mutex> lock(queue.mutex_);
+
+        if ((int)queue.tasks_.Count() == queue.head_)
+            continue;
+
+        task = queue.tasks_[queue.head_++];
+
+        if ((int)queue.tasks_.Count() == queue.head_)
+        {
+            queue.tasks_.Clear();
+            queue.head_ = 0;
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+//------------------------------------------------------------------------------
+bool JobSystem::TryRunOne(int threadIdx)
+{
+    Task task;
+    if (!TryPop(threadIdx, task) && !TrySteal(threadIdx, task))
+        return false;
+
+    Batch* batch = task.batch_;
+    batch->fun_(batch->context_, task.taskIdx_, threadIdx);
+
+    // The batch lives on the stack of ParallelFor, it must not be touched after the last decrement
+    batch->remaining_.fetch_sub(1, std::memory_order_release);
+
+    return true;
+}
+
+}
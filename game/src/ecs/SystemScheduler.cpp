@@ -0,0 +1,93 @@
+#include "Ecs/SystemScheduler.h"
+
+#include "Common/Util.h"
+#include "Common/Assert.h"
+
+namespace hs
+{
+
+//------------------------------------------------------------------------------
+SystemScheduler::SystemScheduler(EcsWorld* world)
+    : world_(world)
+{
+    HS_ASSERT(world_);
+}
+
+//------------------------------------------------------------------------------
+SystemScheduler::~SystemScheduler()
+{
+    for (int i = 0; i < systems_.Count(); ++i)
+    {
+        systems_[i]->destroy_(systems_[i]->context_);
+        delete systems_[i];
+    }
+}
+
+//------------------------------------------------------------------------------
+static bool IsConflicting(const ComponentMask& readsA, const ComponentMask& writesA, const ComponentMask& readsB, const ComponentMask& writesB)
+{
+    return writesA.Intersects(readsB) || writesA.Intersects(writesB) || writesB.Intersects(readsA);
+}
+
+//------------------------------------------------------------------------------
+void SystemScheduler::BuildStages()
+{
+    // A system goes to the stage after the last earlier system it conflicts with
+    stageCount_ = 0;
+    for (int i = 0; i < systems_.Count(); ++i)
+    {
+        System& system = *systems_[i];
+        system.stage_ = 0;
+        for (int prevI = 0; prevI < i; ++prevI)
+        {
+            const System& prev = *systems_[prevI];
+            if (prev.isExclusive_ || system.isExclusive_ || IsConflicting(prev.reads_, prev.writes_, system.reads_, system.writes_))
+                system.stage_ = Max(system.stage_, prev.stage_ + 1);
+        }
+
+        stageCount_ = Max(stageCount_, system.stage_ + 1);
+    }
+
+    stageStarts_.Clear();
+    stageOrder_.Clear();
+    for (int stageI = 0; stageI < stageCount_; ++stageI)
+    {
+        stageStarts_.Add(stageOrder_.Count());
+        for (int i = 0; i < systems_.Count(); ++i)
+        {
+            if (systems_[i]->stage_ == stageI)
+                stageOrder_.Add(i);
+        }
+    }
+    stageStarts_.Add(stageOrder_.Count());
+}
+
+//------------------------------------------------------------------------------
+void SystemScheduler::Run()
+{
+    if (!stageCount_)
+        BuildStages();
+
+    for (int stageI = 0; stageI < stageCount_; ++stageI)
+    {
+        const int first = stageStarts_[stageI];
+        const int count = stageStarts_[stageI + 1] - first;
+
+        // A lone system keeps full access to the world, including its own ParallelEach
+        if (count == 1)
+        {
+            const System& system = *systems_[stageOrder_[first]];
+            system.run_(system.context_);
+            continue;
+        }
+
+        auto runSystem = [this, first](int taskIdx, int /*threadIdx*/)
+        {
+            const System& system = *systems_[stageOrder_[first + taskIdx]];
+            system.run_(system.context_);
+        };
+        world_->ParallelRun(count, runSystem);
+    }
+}
+
+}
@@ -0,0 +1,73 @@
+#include "Game/FrameArena.h"
+
+#include <cstddef>
+#include <cstdlib>
+
+namespace hs
+{
+
+//------------------------------------------------------------------------------
+FrameArena::FrameArena(int capacity)
+    : buffer_((int8*)malloc(capacity))
+    , capacity_(capacity)
+{
+    HS_ASSERT(buffer_);
+}
+
+//------------------------------------------------------------------------------
+FrameArena::~FrameArena()
+{
+    for (int i = 0; i < heapAllocations_.Count(); ++i)
+        free(heapAllocations_[i]);
+    free(buffer_);
+}
+
+//------------------------------------------------------------------------------
+void* FrameArena::Allocate(int size, int alignment)
+{
+    HS_ASSERT(alignment > 0 && (alignment & (alignment - 1)) == 0 && alignment <= (int)alignof(std::max_align_t));
+
+    const int offset = (top_ + alignment - 1) & ~(alignment - 1);
+    if (offset + size <= capacity_)
+    {
+        top_ = offset + size;
+        lastOffset_ = offset;
+        peakBytes_ = Max(peakBytes_, top_);
+        return buffer_ + offset;
+    }
+
+    // Buffer is full, the frame still works but Reset reports it
+    void* ptr = malloc(Max(size, 1));
+    HS_ASSERT(ptr);
+    heapAllocations_.Add(ptr);
+    return ptr;
+}
+
+//------------------------------------------------------------------------------
+bool FrameArena::TryExtend(void* ptr, int oldSize, int newSize)
+{
+    if (lastOffset_ < 0 || ptr != buffer_ + lastOffset_ || lastOffset_ + oldSize != top_)
+        return false;
+
+    if (lastOffset_ + newSize > capacity_)
+        return false;
+
+    top_ = lastOffset_ + newSize;
+    peakBytes_ = Max(peakBytes_, top_);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+void FrameArena::Reset()
+{
+    HS_ASSERT(heapAllocations_.IsEmpty() && "Frame arena ran out of memory and used the heap, increase its capacity");
+
+    for (int i = 0; i < heapAllocations_.Count(); ++i)
+        free(heapAllocations_[i]);
+    heapAllocations_.Clear();
+
+    top_ = 0;
+    lastOffset_ = -1;
+}
+
+}
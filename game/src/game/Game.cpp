@@ -1,8 +1,12 @@
 #include "Game/Game.h"
+#include "Game/HeapCounter.h"
 
 #include "Game/SpriteRenderer.h"
 #include "Game/DebugShapeRenderer.h"
 
+#include "Ecs/JobSystem.h"
+#include "Ecs/SystemScheduler.h"
+
 #include "Gui/Font.h"
 #include "Gui/GuiRenderer.h"
 
@@ -22,7 +26,10 @@
 
 #include "imgui/imgui.h"
 
+#include <chrono>
 #include <cstdio>
+#include <tuple>
+#include <utility>
 
 namespace hs
 {
@@ -45,12 +52,32 @@ struct Rotation
     float angle_;
 };
 
+//------------------------------------------------------------------------------
+//! World transform of a rotated sprite, recomputed only when Position or Rotation changes
+struct Transform
+{
+    Mat44 matrix_;
+};
+
 //------------------------------------------------------------------------------
 struct SpriteComponent
 {
     Sprite* sprite_;
 };
 
+//------------------------------------------------------------------------------
+//! Sprite of a map tile which never changes, stored once per archetype for all tiles with the same sprite
+struct StaticSpriteComponent
+{
+    Sprite* sprite_;
+};
+
+//------------------------------------------------------------------------------
+template<>
+struct IsSharedComponent<StaticSpriteComponent> : std::true_type
+{
+};
+
 //------------------------------------------------------------------------------
 struct ColliderComponent
 {
@@ -85,20 +112,19 @@ struct TargetRespawnTimer
 //------------------------------------------------------------------------------
 struct AnimationState
 {
-    RESULT Init(const Array<AnimationSegment>& segments);
+    RESULT Init(Span<const AnimationSegment> segments);
     void Update(float dTime);
     Sprite* GetCurrentSprite() const;
 
-    Array<AnimationSegment> segments_;
+    // Owned by the Game, the state only refers to them so copying it never allocates
+    Span<const AnimationSegment> segments_;
     int currentSegment_{};
     float timeToSwap_;
 };
 
 //------------------------------------------------------------------------------
-enum class ColliderTag
+struct GroundTag
 {
-    None,
-    Ground
 };
 
 //------------------------------------------------------------------------------
@@ -119,30 +145,58 @@ struct PlayerRespawnTimer
     float timeLeft_;
 };
 
+//------------------------------------------------------------------------------
+HS_ECS_COMPONENTS(
+    Position,
+    Velocity,
+    Rotation,
+    Transform,
+    SpriteComponent,
+    StaticSpriteComponent,
+    ColliderComponent,
+    TipCollider,
+    TargetCollider,
+    AnimationState,
+    GroundTag,
+    PlayerComponent,
+    TargetRespawnTimer,
+    SpawnPoint,
+    PlayerRespawnTimer,
+    Projectile
+);
+
 //------------------------------------------------------------------------------
 void Game::InitEcs()
 {
-    #define INIT_COMPONENT(type) TypeInfo<type>::InitTypeId()
-
-    INIT_COMPONENT(Entity_t);
-    INIT_COMPONENT(Position);
-    INIT_COMPONENT(Velocity);
-    INIT_COMPONENT(Rotation);
-    INIT_COMPONENT(SpriteComponent);
-    INIT_COMPONENT(ColliderComponent);
-    INIT_COMPONENT(TipCollider);
-    INIT_COMPONENT(TargetCollider);
-    INIT_COMPONENT(AnimationState);
-    INIT_COMPONENT(ColliderTag);
-    INIT_COMPONENT(PlayerComponent);
-    INIT_COMPONENT(TargetRespawnTimer);
-    INIT_COMPONENT(SpawnPoint);
-    INIT_COMPONENT(PlayerRespawnTimer);
-    INIT_COMPONENT(Projectile);
-
-    #undef INIT_COMPONENT
-
-    world_ = MakeUnique<EcsWorld>();
+    jobSystem_ = MakeUnique<JobSystem>();
+
+    world_ = MakeUnique<EcsWorld>(ArchetypeStorage::Chunked);
+    world_->SetJobSystem(jobSystem_.Get());
+
+    // Respawn timers and animation don't touch the projectiles and run together with their integration
+    scheduler_ = MakeUnique<SystemScheduler>(world_.Get());
+    scheduler_->AddExclusiveSystem("MovePlayers", [this]() { MovePlayers(frameInputs_, frameDTime_); });
+    scheduler_->AddExclusiveSystem("RespawnPlayers", [this]() { RespawnPlayers(frameDTime_); });
+    scheduler_->AddSystem("MoveProjectiles",
+        SystemScheduler::Reads<Entity_t, Projectile>{},
+        SystemScheduler::Writes<Position, Velocity, Rotation>{},
+        [this]() { MoveProjectiles(frameDTime_); }
+    );
+    scheduler_->AddSystem("RespawnTargets",
+        SystemScheduler::Reads<Entity_t>{},
+        SystemScheduler::Writes<TargetRespawnTimer>{},
+        [this]() { RespawnTargets(frameDTime_); }
+    );
+    scheduler_->AddSystem("AnimateSprites",
+        SystemScheduler::Reads<>{},
+        SystemScheduler::Writes<AnimationState, SpriteComponent>{},
+        [this]() { AnimateSprites(frameDTime_); }
+    );
+    scheduler_->AddSystem("CollideProjectiles",
+        SystemScheduler::Reads<Entity_t, Position, Rotation, TipCollider, SpriteComponent, Projectile, TargetCollider, ColliderComponent, PlayerComponent>{},
+        SystemScheduler::Writes<>{},
+        [this]() { CollideProjectiles(); }
+    );
 }
 
 //------------------------------------------------------------------------------
@@ -154,9 +208,19 @@ Game* g_Game{};
 static constexpr int TILE_SIZE = 16;
 
 //------------------------------------------------------------------------------
-RESULT AnimationState::Init(const Array<AnimationSegment>& segments)
+//! xorshift32, the state is part of the simulation so rolled back frames draw the same numbers again
+static uint32 NextRandom(uint32& state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+//------------------------------------------------------------------------------
+RESULT AnimationState::Init(Span<const AnimationSegment> segments)
 {
-    if (segments.IsEmpty())
+    if (!segments.Count())
         return R_FAIL;
 
     segments_ = segments;
@@ -180,7 +244,7 @@ void AnimationState::Update(float dTime)
 //------------------------------------------------------------------------------
 Sprite* AnimationState::GetCurrentSprite() const
 {
-    HS_ASSERT(currentSegment_ < segments_.Count());
+    HS_ASSERT((uint)currentSegment_ < segments_.Count());
     return segments_[currentSegment_].sprite_;
 }
 
@@ -212,7 +276,7 @@ Game::~Game() = default;
 //------------------------------------------------------------------------------
 void Game::AddSprite(const Vec3& pos, Sprite* sprite)
 {
-     world_->CreateEntity(Position{ pos }, SpriteComponent{ sprite });
+     world_->CreateEntity(Position{ pos }, StaticSpriteComponent{ sprite });
 }
 
 //------------------------------------------------------------------------------
@@ -233,12 +297,8 @@ void Game::AddObject(const Vec3& pos, const AnimationState& animation, const Box
 PlayerInfo Game::RespawnPlayer(int playerId)
 {
     // Prepare to create entity
-    Array<AnimationSegment> rockIdleSegments;
-    for (uint i = 0; i < HS_ARR_LEN(rockSprite_); ++i)
-        rockIdleSegments.Add(AnimationSegment{ &rockSprite_[i], 0.5f });
-
     AnimationState rockIdle{};
-    if (HS_FAILED(rockIdle.Init(rockIdleSegments)))
+    if (HS_FAILED(rockIdle.Init(Span<const AnimationSegment>(rockIdleSegments_, HS_ARR_LEN(rockIdleSegments_)))))
     {
         HS_ASSERT(false);
         return {};
@@ -247,7 +307,7 @@ PlayerInfo Game::RespawnPlayer(int playerId)
     Box2D rockCollider = MakeBox2DPosSize(Vec2(6, 1), Vec2(18, 29));
 
     // Spawn
-    Array<Vec3> spawnPositions;
+    FrameArray<Vec3> spawnPositions(frameArena_);
     EcsWorld::Iter<const Position, const SpawnPoint>(world_.Get()).Each(
         [&spawnPositions](const Position pos, const SpawnPoint)
         {
@@ -255,7 +315,8 @@ PlayerInfo Game::RespawnPlayer(int playerId)
         }
     );
 
-    const auto spawnIdx = (uint)((rand() * 1.0f / RAND_MAX) * spawnPositions.Count());
+    HS_ASSERT(!spawnPositions.IsEmpty());
+    const int spawnIdx = (int)(NextRandom(rngState_) % (uint32)spawnPositions.Count());
     const Vec3 spawnPos = spawnPositions[spawnIdx];
 
     PlayerInfo playerInfo{};
@@ -272,6 +333,7 @@ PlayerInfo Game::RespawnPlayer(int playerId)
     playerInfo.weaponEntity_ = world_->CreateEntity(
         Position{ Vec3(spawnPos.x + weaponPosOffset.x, spawnPos.x + weaponPosOffset.y, LAYER_WEAPON) },
         Rotation { 0.0f },
+        Transform{},
         SpriteComponent{ &bowSprite_ }
     );
 
@@ -317,6 +379,7 @@ void Game::AddProjectile(const Vec3& pos, float rotation, Sprite* sprite, const
     world_->CreateEntity(
         Position{ pos },
         Rotation{ rotation },
+        Transform{},
         SpriteComponent{ sprite },
         TipCollider{ collider },
         Velocity{ velocity },
@@ -348,14 +411,17 @@ void Game::RemoveTarget(Entity_t eid)
 }
 
 //------------------------------------------------------------------------------
-void Game::AnimateSprites()
+void Game::AnimateSprites(float dTime)
 {
-    EcsWorld::Iter<AnimationState, SpriteComponent>(world_.Get()).Each(
-        [dTime = GetDTime()]
-        (AnimationState& anim, SpriteComponent& sprite)
+    EcsWorld::Iter<AnimationState, SpriteComponent>(world_.Get()).ParallelEachChunk(
+        [dTime]
+        (Span<AnimationState> anims, Span<SpriteComponent> sprites)
         {
-            anim.Update(dTime);
-            sprite.sprite_ = anim.GetCurrentSprite();
+            for (uint i = 0; i < anims.Count(); ++i)
+            {
+                anims[i].Update(dTime);
+                sprites[i].sprite_ = anims[i].GetCurrentSprite();
+            }
         }
     );
 }
@@ -409,11 +475,11 @@ void Game::DrawColliders()
         }
     );
 
-    EcsWorld::Iter<const Position, const Rotation, const TipCollider, const SpriteComponent>(world_.Get()).Each(
+    EcsWorld::Iter<const Transform, const TipCollider>(world_.Get()).Each(
         []
-        (const Position& pos, const Rotation rotation, const TipCollider& collider, const SpriteComponent sprite)
+        (const Transform& transform, const TipCollider& collider)
         {
-            DrawCollider(collider.collider_, MakeTransform(pos, rotation.angle_, sprite.sprite_->pivot_));
+            DrawCollider(collider.collider_, transform.matrix_);
         }
     );
 
@@ -426,6 +492,56 @@ void Game::DrawColliders()
     );
 }
 
+//------------------------------------------------------------------------------
+void Game::UpdateEcsStats()
+{
+    world_->GetStats(ecsStats_);
+
+    bool shouldCompact = isAutoCompact_ && frame_ % ECS_COMPACT_FRAMES == 0;
+    ImGui::Begin("ECS");
+        ImGui::Text("Entities: %d", ecsStats_.entityCount_);
+        ImGui::Text("Archetypes: %d, empty %d", (int)ecsStats_.archetypes_.Count(), ecsStats_.emptyArchetypeCount_);
+        ImGui::Text("Allocated: %.1f KB, wasted %.1f KB", ecsStats_.allocatedBytes_ / 1024.0f, ecsStats_.wastedBytes_ / 1024.0f);
+        ImGui::Text("Sparse values: %d, %.1f KB", ecsStats_.sparseValueCount_, ecsStats_.sparseBytes_ / 1024.0f);
+        ImGui::Text("Shared values: %d", ecsStats_.sharedValueCount_);
+        ImGui::Text("Allocator: %.1f KB live, peak %.1f KB, reserved %.1f KB",
+            ecsStats_.allocator_.liveBytes_ / 1024.0f, ecsStats_.allocator_.peakLiveBytes_ / 1024.0f, ecsStats_.allocator_.reservedBytes_ / 1024.0f);
+        ImGui::Text("Allocations: %lld, frees %lld", (long long)ecsStats_.allocator_.allocationCount_, (long long)ecsStats_.allocator_.freeCount_);
+        ImGui::Checkbox("Auto compact", &isAutoCompact_);
+        if (ImGui::Button("Compact"))
+            shouldCompact = true;
+        ImGui::Text("Last compaction dropped %d archetypes", lastCompactDropped_);
+
+        ImGui::Separator();
+        for (const EcsArchetypeStats& archetype : ecsStats_.archetypes_)
+        {
+            ImGui::Text("#%d rows %d/%d peak %d, %d chunks, %.1f KB, wasted %.1f KB, queried %u",
+                archetype.archetype_, archetype.rowCount_, archetype.rowCapacity_, archetype.peakRowCount_, archetype.chunkCount_,
+                archetype.allocatedBytes_ / 1024.0f, archetype.wastedBytes_ / 1024.0f, archetype.queryCount_);
+
+            // Component type id and bytes of its column
+            char buff[512];
+            int length = 0;
+            for (int i = 0; i < archetype.columnCount_ && length < (int)sizeof(buff); ++i)
+            {
+                length += snprintf(buff + length, sizeof(buff) - length, " %d:%lldB",
+                    archetype.columnTypeIds_[i], (long long)archetype.columnBytes_[i]);
+            }
+            ImGui::Text("   columns%s", archetype.columnCount_ ? buff : " none");
+        }
+    ImGui::End();
+
+    if (!shouldCompact)
+        return;
+
+    lastCompactDropped_ = world_->Compact();
+    if (lastCompactDropped_)
+    {
+        // Saved frames refer to the dropped archetypes
+        ResetRollback();
+    }
+}
+
 //------------------------------------------------------------------------------
 static Vec3 TilePos(float x, float y, float z = 0)
 {
@@ -450,12 +566,17 @@ static RESULT MakeSimpleSprite(const char* texPath, Sprite& t, Vec2 pivot)
 //------------------------------------------------------------------------------
 RESULT Game::LoadMap()
 {
-    Array<AnimationSegment> pumpkinIdleSegments;
-    for (uint i = 0; i < HS_ARR_LEN(pumpkinSprite_); ++i)
-        pumpkinIdleSegments.Add(AnimationSegment{ &pumpkinSprite_[i], 0.5f });
+    // Static sprites are collected first and created in one batch at the end
+    Array<Position> tilePositions;
+    Array<StaticSpriteComponent> tileSprites;
+    auto AddTile = [&tilePositions, &tileSprites](const Vec3& pos, Sprite* sprite)
+    {
+        tilePositions.Add(Position{ pos });
+        tileSprites.Add(StaticSpriteComponent{ sprite });
+    };
 
     AnimationState pumpkinIdle{};
-    if (HS_FAILED(pumpkinIdle.Init(pumpkinIdleSegments)))
+    if (HS_FAILED(pumpkinIdle.Init(Span<const AnimationSegment>(pumpkinIdleSegments_, HS_ARR_LEN(pumpkinIdleSegments_)))))
         return R_FAIL;
     Box2D pumpkinCollider = MakeBox2DPosSize(Vec2(2, 0), Vec2(12, 10));
 
@@ -464,14 +585,14 @@ RESULT Game::LoadMap()
         AddObject(Vec3(x * TILE_SIZE + offsetX, y * TILE_SIZE + 9 + offsetY, 1), pumpkinIdle, &pumpkinCollider);
     };
 
-    auto MakeAmanita = [this](float x, float y, int height)
+    auto MakeAmanita = [this, &AddTile](float x, float y, int height)
     {
-        AddSprite(Vec3(x * TILE_SIZE, y * TILE_SIZE + 5 + height, LAYER_CLUTTER), &amanitaSprite_);
+        AddTile(Vec3(x * TILE_SIZE, y * TILE_SIZE + 5 + height, LAYER_CLUTTER), &amanitaSprite_);
     };
 
-    auto MakeFlowerSmall = [this](float  tileX, float tileY, int offsetX, int height)
+    auto MakeFlowerSmall = [this, &AddTile](float  tileX, float tileY, int offsetX, int height)
     {
-        AddSprite(Vec3(tileX * TILE_SIZE + offsetX, tileY * TILE_SIZE + 6 + height, LAYER_CLUTTER), &flowerSmallSprite_);
+        AddTile(Vec3(tileX * TILE_SIZE + offsetX, tileY * TILE_SIZE + 6 + height, LAYER_CLUTTER), &flowerSmallSprite_);
     };
 
     auto MakeFlowerSmallCluster = [this, MakeFlowerSmall](float tileX, float tileY, int offsetX)
@@ -481,16 +602,13 @@ RESULT Game::LoadMap()
         MakeFlowerSmall(tileX, tileY, offsetX + 4, 1);
     };
 
-    auto MakeSunflower = [this](float tileX, float tileY, int offsetX, int offsetY)
+    auto MakeSunflower = [this, &AddTile](float tileX, float tileY, int offsetX, int offsetY)
     {
-        AddSprite(Vec3(tileX * TILE_SIZE + offsetX, tileY * TILE_SIZE + 9 + offsetY, LAYER_CLUTTER), &sunflowerSprite_);
+        AddTile(Vec3(tileX * TILE_SIZE + offsetX, tileY * TILE_SIZE + 9 + offsetY, LAYER_CLUTTER), &sunflowerSprite_);
     };
 
-    Array<AnimationSegment> crystalIdleSegments;
-    crystalIdleSegments.Add(AnimationSegment{ &crystalSprite_, 0.5f });
-
     AnimationState crystalIdle{};
-    if (HS_FAILED(crystalIdle.Init(crystalIdleSegments)))
+    if (HS_FAILED(crystalIdle.Init(Span<const AnimationSegment>(crystalIdleSegments_, HS_ARR_LEN(crystalIdleSegments_)))))
         return R_FAIL;
     Box2D mainCrystalCollider = MakeBox2DPosSize(Vec2(2, 0), Vec2(26, 10));
 
@@ -510,34 +628,34 @@ RESULT Game::LoadMap()
         int width = 22;
         int height = 15;
 
-        AddSprite(TilePos(left, bot + 1), &groundSprite_[TOP_LEFT]);
+        AddTile(TilePos(left, bot + 1), &groundSprite_[TOP_LEFT]);
         for (int i = 0; i < width; ++i)
-            AddSprite(TilePos(left + 1 + i, bot + 1), &groundSprite_[TOP]);
-        AddSprite(TilePos(left + width + 1, bot + 1), &groundSprite_[TOP_RIGHT]);
+            AddTile(TilePos(left + 1 + i, bot + 1), &groundSprite_[TOP]);
+        AddTile(TilePos(left + width + 1, bot + 1), &groundSprite_[TOP_RIGHT]);
 
         for (int i = 0; i < height; ++i)
-            AddSprite(TilePos(left, bot + i, 0.1f), &groundSprite_[MID_RIGHT]);
+            AddTile(TilePos(left, bot + i, 0.1f), &groundSprite_[MID_RIGHT]);
 
         for (int i = 0; i < height; ++i)
-            AddSprite(TilePos(left + width + 1, bot + i, 0.1f), &groundSprite_[MID_LEFT]);
+            AddTile(TilePos(left + width + 1, bot + i, 0.1f), &groundSprite_[MID_LEFT]);
 
-        AddSprite(TilePos(left, bot), &groundSprite_[BOT_LEFT]);
+        AddTile(TilePos(left, bot), &groundSprite_[BOT_LEFT]);
         for (int i = 0; i < width; ++i)
-            AddSprite(TilePos(left + 1 + i, bot), &groundSprite_[BOT]);
-        AddSprite(TilePos(left + width + 1, bot), &groundSprite_[BOT_RIGHT]);
+            AddTile(TilePos(left + 1 + i, bot), &groundSprite_[BOT]);
+        AddTile(TilePos(left + width + 1, bot), &groundSprite_[BOT_RIGHT]);
 
         Box2D groundCollider = MakeBox2DMinMax(Vec2((left + 0.25f) * TILE_SIZE, bot * TILE_SIZE), Vec2((left + width + 1.75f) * TILE_SIZE, 1.5f * TILE_SIZE));
-        world_->CreateEntity(ColliderComponent{ groundCollider }, Position{ Vec3::ZERO() }, ColliderTag::Ground);
+        world_->CreateEntity(ColliderComponent{ groundCollider }, Position{ Vec3::ZERO() }, GroundTag{});
 
         Box2D leftWallCollider = MakeBox2DMinMax(Vec2((left) * TILE_SIZE, bot * TILE_SIZE), Vec2((left + 0.75f) * TILE_SIZE, height * TILE_SIZE));
-        world_->CreateEntity(ColliderComponent{ leftWallCollider }, Position{ Vec3::ZERO() }, ColliderTag::Ground);
+        world_->CreateEntity(ColliderComponent{ leftWallCollider }, Position{ Vec3::ZERO() }, GroundTag{});
 
         Box2D rightWallCollider = MakeBox2DMinMax(Vec2((left + width + 1.25f) * TILE_SIZE, bot * TILE_SIZE), Vec2((left + width + 2) * TILE_SIZE, height * TILE_SIZE));
-        world_->CreateEntity(ColliderComponent{ rightWallCollider }, Position{ Vec3::ZERO() }, ColliderTag::Ground);
+        world_->CreateEntity(ColliderComponent{ rightWallCollider }, Position{ Vec3::ZERO() }, GroundTag{});
     }
 
     // Platforms
-    auto MakePlatform = [this](float left, float bot, float width)
+    auto MakePlatform = [this, &AddTile](float left, float bot, float width)
     {
         int height = 1;
 
@@ -545,12 +663,12 @@ RESULT Game::LoadMap()
             Vec2((left + 0.25f) * TILE_SIZE, bot * TILE_SIZE),
             Vec2((left + 0.75f + width) * TILE_SIZE, (bot + height - 0.5f) * TILE_SIZE)
         );
-        world_->CreateEntity(ColliderComponent{ groundCollider }, Position{ Vec3::ZERO() }, ColliderTag::Ground);
+        world_->CreateEntity(ColliderComponent{ groundCollider }, Position{ Vec3::ZERO() }, GroundTag{});
 
-        AddSprite(TilePos(left, bot + height - 1), &groundSprite_[TOP_LEFT]);
+        AddTile(TilePos(left, bot + height - 1), &groundSprite_[TOP_LEFT]);
         for (float x = left + 1; x < left + width; ++x)
-            AddSprite(TilePos(x, bot + height - 1), &groundSprite_[TOP]);
-        AddSprite(TilePos(left + width, bot + height - 1), &groundSprite_[TOP_RIGHT]);
+            AddTile(TilePos(x, bot + height - 1), &groundSprite_[TOP]);
+        AddTile(TilePos(left + width, bot + height - 1), &groundSprite_[TOP_RIGHT]);
     };
 
     MakePlatform(1, 4, 3);
@@ -599,6 +717,8 @@ RESULT Game::LoadMap()
     world_->CreateEntity(Position{ Vec3(2 * TILE_SIZE, 1.5 * TILE_SIZE, 1) }, SpawnPoint{});
     world_->CreateEntity(Position{ Vec3(10 * TILE_SIZE, 0.5f * TILE_SIZE + 50, 1) }, SpawnPoint{});
 
+    world_->CreateEntities(MakeSpan(tilePositions), MakeSpan(tileSprites));
+
     return R_OK;
 }
 
@@ -701,6 +821,16 @@ RESULT Game::Init()
     if (HS_FAILED(MakeSimpleSprite("textures/BowSimple.png", bowSprite_, Vec2(0.1f, 0.5f))))
         return R_FAIL;
 
+    static_assert(HS_ARR_LEN(rockIdleSegments_) == HS_ARR_LEN(rockSprite_));
+    for (uint i = 0; i < HS_ARR_LEN(rockSprite_); ++i)
+        rockIdleSegments_[i] = AnimationSegment{ &rockSprite_[i], 0.5f };
+
+    static_assert(HS_ARR_LEN(pumpkinIdleSegments_) == HS_ARR_LEN(pumpkinSprite_));
+    for (uint i = 0; i < HS_ARR_LEN(pumpkinSprite_); ++i)
+        pumpkinIdleSegments_[i] = AnimationSegment{ &pumpkinSprite_[i], 0.5f };
+
+    crystalIdleSegments_[0] = AnimationSegment{ &crystalSprite_, 0.5f };
+
     if (HS_FAILED(LoadMap()))
         return R_FAIL;
 
@@ -818,87 +948,77 @@ static Vec2 DirectionFromRotation(float rotation)
 }
 
 //------------------------------------------------------------------------------
-void Game::Update()
+static bool IsSameInput(const PlayerInput& a, const PlayerInput& b)
 {
-    // Audio
-    if (!muteAudio_ && SDL_GetQueuedAudioSize(audioDevice_) < 2 * musicLength_)
-    {
-        if (SDL_QueueAudio(audioDevice_, musicBuffer_, musicLength_) != 0)
-        {
-            LOG_ERR("Failed to queue audio %s", SDL_GetError());
-            SDL_ClearError();
-        }
-    }
+    return a.aimDirection_ == b.aimDirection_
+        && a.cursorWorldPos_ == b.cursorWorldPos_
+        && a.moveX_ == b.moveX_
+        && a.isFocused_ == b.isFocused_
+        && a.isJumpDown_ == b.isJumpDown_
+        && a.isCursorShootDown_ == b.isCursorShootDown_
+        && a.isGamepadShootDown_ == b.isGamepadShootDown_;
+}
 
-    // Debug
-    if (g_Input->IsKeyDown(KC_C))
-    {
-        visualizeColliders_ = !visualizeColliders_;
-    }
+//------------------------------------------------------------------------------
+PlayerInput Game::GatherInput(int playerId, float aimDeadzone) const
+{
+    const int gamepad = gamepadForPlayer_[playerId];
 
-    ImGui::Begin("Score");
-        for (int playerI = 0; playerI < playerCount_; ++playerI)
-        {
-            ImGui::Text("Player %d: %d", playerI, playerScore_[playerI]);
-        }
-    ImGui::End();
+    PlayerInput input{};
+    input.isFocused_ = g_Input->GetState(KC_LSHIFT) || (gamepad != -1 && g_Input->GetAxis(gamepad, GLFW_GAMEPAD_AXIS_LEFT_TRIGGER) > -0.5);
+    input.isJumpDown_ = g_Input->IsKeyDown(KC_SPACE)
+        || (gamepad != -1 && g_Input->IsButtonDown(gamepad, GLFW_GAMEPAD_BUTTON_A))
+        || (gamepad != -1 && g_Input->IsButtonDown(gamepad, GLFW_GAMEPAD_BUTTON_LEFT_BUMPER));
 
-    // Player menu
-    int newPlayerCount = playerCount_;
-    ImGui::Begin("Players");
-        ImGui::InputInt("Player count", &newPlayerCount);
-        newPlayerCount = Clamp((uint)newPlayerCount, 1u, MAX_PLAYERS);
+    if (g_Input->GetState(KC_D))
+        input.moveX_ += 1;
+    else if (g_Input->GetState(KC_A))
+        input.moveX_ -= 1;
 
-        for (int playerI = 0; playerI < playerCount_; ++playerI)
-        {
-            ImGui::Text("Player %d input", playerI);
-            for (int gamepadI = 0; gamepadI < GLFW_JOYSTICK_LAST; ++gamepadI)
-            {
-                if (g_Input->IsGamepadConnected(gamepadI))
-                {
-                    char buff[128];
-                    sprintf(buff, "P%d Gamepad %d", playerI, gamepadI);
-                    ImGui::RadioButton(buff, &gamepadForPlayer_[playerI], gamepadI);
-                }
-            }
-        }
-    ImGui::End();
+    if (gamepad != -1)
+        input.moveX_ += g_Input->GetAxis(gamepad, GLFW_GAMEPAD_AXIS_LEFT_X);
 
-    while (playerCount_ < newPlayerCount)
-    {
-        SpawnPlayer();
-    }
+    Vec2 aim;
+    aim.x = gamepad == -1 ? 0 : g_Input->GetAxis(gamepad, GLFW_GAMEPAD_AXIS_RIGHT_X);
+    aim.y = gamepad == -1 ? 0 : -g_Input->GetAxis(gamepad, GLFW_GAMEPAD_AXIS_RIGHT_Y);
+    input.aimDirection_ = aim.Length() > aimDeadzone ? aim : Vec2::ZERO();
 
-    float aimDeadzone = 0.2f;
-    ImGui::Begin("Settings");
-        ImGui::SliderFloat("Aim deadzone", &aimDeadzone, 0.0f, 1.0f);
-        ImGui::SliderFloat("Projectile speed", &projectileSpeed, 0.0f, 500.0f);
-        ImGui::SliderFloat("Time scale", &timeScale_, 0.0f, 4.0f);
-    ImGui::End();
+    input.isCursorShootDown_ = g_Input->IsButtonDown(BTN_LEFT);
+    input.cursorWorldPos_ = CursorToWorld();
+    input.isGamepadShootDown_ = gamepad != -1 && g_Input->IsButtonDown(gamepad, GLFW_GAMEPAD_BUTTON_RIGHT_BUMPER);
+
+    return input;
+}
 
-    // Movement
+//------------------------------------------------------------------------------
+//! Moves the players and their weapons, shoots. Creates projectiles right away so it has to run as an exclusive system.
+void Game::MovePlayers(const PlayerInput* inputs, float dTime)
+{
     float focusMultiplier[MAX_PLAYERS]{};
     for (int playerI = 0; playerI < playerCount_; ++playerI)
     {
         if (players_[playerI].playerEntity_ == NULL_ENTITY)
             continue;
 
-        if (g_Input->GetState(KC_LSHIFT) || (gamepadForPlayer_[playerI] != -1 && g_Input->GetAxis(gamepadForPlayer_[playerI], GLFW_GAMEPAD_AXIS_LEFT_TRIGGER) > -0.5))
+        if (inputs[playerI].isFocused_)
             focusMultiplier[playerI] = 0.25f;
         else
             focusMultiplier[playerI] = 1.0;
 
-        Vec2& velocity = world_->GetComponent<Velocity>(players_[playerI].playerEntity_);
-        velocity.y += gravity * GetDTime() * focusMultiplier[playerI];
+        // The player's row is looked up once for all the components used below
+        auto playerComponents = world_->GetComponents<Velocity, Position, const ColliderComponent, const AnimationState, const SpriteComponent>(
+            players_[playerI].playerEntity_
+        );
+
+        Vec2& velocity = std::get<Velocity&>(playerComponents);
+        velocity.y += gravity * dTime * focusMultiplier[playerI];
         velocity.x = 0;
 
         if (!isGrounded_[playerI])
-            coyoteTimeRemaining_[playerI] -= GetDTime();
+            coyoteTimeRemaining_[playerI] -= dTime;
 
         float characterSpeed{ 80 };
-        if (g_Input->IsKeyDown(KC_SPACE)
-            || (gamepadForPlayer_[playerI] != -1 && g_Input->IsButtonDown(gamepadForPlayer_[playerI], GLFW_GAMEPAD_BUTTON_A))
-            || (gamepadForPlayer_[playerI] != -1 && g_Input->IsButtonDown(gamepadForPlayer_[playerI], GLFW_GAMEPAD_BUTTON_LEFT_BUMPER)))
+        if (inputs[playerI].isJumpDown_)
         {
             if (isGrounded_[playerI] || coyoteTimeRemaining_[playerI] > 0)
             {
@@ -912,29 +1032,16 @@ void Game::Update()
             }
         }
 
-        if (g_Input->GetState(KC_D))
-        {
-            velocity.x += characterSpeed;
-        }
-        else if (g_Input->GetState(KC_A))
-        {
-            velocity.x -= characterSpeed;
-        }
+        velocity.x += characterSpeed * inputs[playerI].moveX_;
 
-        const float xAxis = gamepadForPlayer_[playerI] == -1 ? 0 :g_Input->GetAxis(gamepadForPlayer_[playerI], GLFW_GAMEPAD_AXIS_LEFT_X);
-        if (xAxis)
-        {
-            velocity.x += characterSpeed * xAxis;
-        }
-
-        Vec3& pos = world_->GetComponent<Position>(players_[playerI].playerEntity_);
+        Vec3& pos = std::get<Position&>(playerComponents);
 
         isGrounded_[playerI] = false;
 
-        Vec2 dtVel = velocity * GetDTime() * focusMultiplier[playerI];
+        Vec2 dtVel = velocity * dTime * focusMultiplier[playerI];
 
         Vec2 pos2 = pos.XY();
-        const ColliderComponent& originalCollider = world_->GetComponent<ColliderComponent>(players_[playerI].playerEntity_);
+        const ColliderComponent& originalCollider = std::get<const ColliderComponent&>(playerComponents);
         Box2D playerCollider = originalCollider.collider_.Offset(pos.XY());
 
         auto SolveIntersection = [this, pos2, &dtVel, &originalCollider, &playerCollider, &velocity](const Box2D& groundCollider, int playerI)
@@ -987,29 +1094,15 @@ void Game::Update()
         pos.x += dtVel.x;
         pos.y += dtVel.y;
 
-        static Vec2 maxPlayerVelocity(Vec2::ZERO());
-        static Vec2 minPlayerVelocity(Vec2::ZERO());
-        maxPlayerVelocity.x = Max(maxPlayerVelocity.x, velocity.x);
-        maxPlayerVelocity.y = Max(maxPlayerVelocity.y, velocity.y);
-        minPlayerVelocity.x = Min(minPlayerVelocity.x, velocity.x);
-        minPlayerVelocity.y = Min(minPlayerVelocity.y, velocity.y);
-
-        ImGui::Text("IsGrounded %d", isGrounded_[0]);
-        ImGui::Text("Cur player %d velocity: [%.2f, %.2f]", playerI, velocity.x, velocity.y);
-        ImGui::Text("Max player %d velocity: [%.2f, %.2f]", playerI, maxPlayerVelocity.x, maxPlayerVelocity.y);
-        ImGui::Text("Min player %d velocity: [%.2f, %.2f]", playerI, minPlayerVelocity.x, minPlayerVelocity.y);
-
         // Weapon update
         {
-            const Sprite* playerSprite = world_->GetComponent<AnimationState>(players_[playerI].playerEntity_).GetCurrentSprite();
+            const Sprite* playerSprite = std::get<const AnimationState&>(playerComponents).GetCurrentSprite();
             Vec3 weaponPos(0, 0, LAYER_WEAPON);
             weaponPos.x = pos.x + playerSprite->size_.x / 2.0f;
             weaponPos.y = pos.y + playerSprite->size_.y / 2.0f;
 
-            Vec2 dir;
-            dir.x = gamepadForPlayer_[playerI] == -1 ? 0 : g_Input->GetAxis(gamepadForPlayer_[playerI], GLFW_GAMEPAD_AXIS_RIGHT_X);
-            dir.y = gamepadForPlayer_[playerI] == -1 ? 0 : -g_Input->GetAxis(gamepadForPlayer_[playerI], GLFW_GAMEPAD_AXIS_RIGHT_Y);
-            if (dir.Length() > aimDeadzone)
+            const Vec2 dir = inputs[playerI].aimDirection_;
+            if (dir.LengthSqr() > 0)
             {
                 Vec2 dirNormalized = dir.Normalized();
                 constexpr float AIM_STEP = HS_TAU / (36.0f * 2);
@@ -1026,20 +1119,20 @@ void Game::Update()
         }
 
         // Shooting
-        timeToShoot_[playerI] = Max(timeToShoot_[playerI] - GetDTime(), 0.0f);
+        timeToShoot_[playerI] = Max(timeToShoot_[playerI] - dTime, 0.0f);
         if (timeToShoot_[playerI] <= 0)
         {
-            const Vec2 projPos = world_->GetComponent<Position>(players_[playerI].playerEntity_).XY() + world_->GetComponent<SpriteComponent>(players_[playerI].playerEntity_).sprite_->size_ / 2;
+            const Vec2 projPos = pos.XY() + std::get<const SpriteComponent&>(playerComponents).sprite_->size_ / 2;
             Vec2 dir;
             bool shouldShoot = false;
 
-            if (g_Input->IsButtonDown(BTN_LEFT))
+            if (inputs[playerI].isCursorShootDown_)
             {
                 shouldShoot = true;
-                Vec2 to = CursorToWorld();
+                Vec2 to = inputs[playerI].cursorWorldPos_;
                 dir = (to - projPos);
             }
-            else if (gamepadForPlayer_[playerI] != -1 && g_Input->IsButtonDown(gamepadForPlayer_[playerI], GLFW_GAMEPAD_BUTTON_RIGHT_BUMPER))
+            else if (inputs[playerI].isGamepadShootDown_)
             {
                 shouldShoot = true;
                 /*dir.x = g_Input->GetAxis(gamepadForPlayer_[playerI], GLFW_GAMEPAD_AXIS_RIGHT_X);
@@ -1050,7 +1143,7 @@ void Game::Update()
 
                 if (dir.LengthSqr() == 0)
                     dir.x = 1;*/
-                dir = DirectionFromRotation(world_->GetComponent<Rotation>(players_[playerI].weaponEntity_).angle_);
+                dir = DirectionFromRotation(world_->GetComponent<const Rotation>(players_[playerI].weaponEntity_).angle_);
             }
 
             if (shouldShoot)
@@ -1061,7 +1154,7 @@ void Game::Update()
                 float angle = RotationFromDirection(dir);
 
                 constexpr float PLAYER_VELOCITY_WEIGHT = 0.7f;
-                Vec2 projectileVelocity = dir * projectileSpeed + world_->GetComponent<Velocity>(players_[playerI].playerEntity_) * PLAYER_VELOCITY_WEIGHT * focusMultiplier[playerI];
+                Vec2 projectileVelocity = dir * projectileSpeed + velocity * PLAYER_VELOCITY_WEIGHT * focusMultiplier[playerI];
                 AddProjectile(
                     Vec3(projPos.x, projPos.y, 0.5f),
                     angle,
@@ -1073,152 +1166,421 @@ void Game::Update()
             }
         }
     }
+}
 
-    {
-        // Move projectiles
+//------------------------------------------------------------------------------
+void Game::MoveProjectiles(float dTime)
+{
+    EcsWorld::Iter<Position, Velocity, Rotation>(world_.Get()).EachChunk(
+        [dTime]
+        (Span<Position> positions, Span<Velocity> velocities, Span<Rotation> rotations)
         {
-            Array<Entity_t> projectilesToRemove;
-            EcsWorld::Iter<const Entity_t, Position, Velocity, Rotation>(world_.Get()).Each(
-                [this, &projectilesToRemove](Entity_t eid, Position& position, Velocity& velocity, Rotation& rotation)
-                {
-                    velocity.y += projectileGravity * GetDTime();
-                    position.AddXY(velocity * GetDTime());
+            // Integrate in a tight loop first, the rotation needs calls
+            for (uint i = 0; i < positions.Count(); ++i)
+            {
+                velocities[i].y += projectileGravity * dTime;
+                positions[i].x += velocities[i].x * dTime;
+                positions[i].y += velocities[i].y * dTime;
+            }
 
-                    rotation.angle_ = RotationFromDirection(velocity.Normalized());
+            for (uint i = 0; i < positions.Count(); ++i)
+                rotations[i].angle_ = RotationFromDirection(velocities[i].Normalized());
+        }
+    );
 
-                    ImGui::Text("Projectile velocity: [%.2f, %.2f]", velocity.x, velocity.y);
+    // Arrows which fell out of the world expire in bulk
+    EcsWorld::Iter<const Position, const Projectile>(world_.Get()).DeleteWhere(
+        [](const Position& position, const Projectile)
+        {
+            return position.y < -1000;
+        }
+    );
+}
 
-                    if (position.y < -1000)
-                        projectilesToRemove.Add(eid);
+//------------------------------------------------------------------------------
+void Game::CollideProjectiles()
+{
+    // Deletions and creations are deferred to the world's command buffer until the iteration ends
+    EcsWorld::Iter<const Entity_t, const Position, const Rotation, const TipCollider, const SpriteComponent, const Projectile>(world_.Get()).Each(
+        [this]
+        (Entity_t projectile, const Position& position, const Rotation& rotation, const TipCollider& collider, const SpriteComponent& sprite, Projectile projectileComponent)
+        {
+            Mat44 projectileTransform = MakeTransform(position, rotation.angle_, sprite.sprite_->pivot_);
+            Vec2 projPos = projectileTransform.TransformPos(collider.collider_.center_);
+            bool shouldRemove = false;
+
+            EcsWorld::Iter<const Entity_t, const Position, const TargetCollider>(world_.Get()).Each(
+                [this, &shouldRemove, projPos, &tipCollider = collider.collider_, projectileComponent]
+                (Entity_t target, Position targetPos, TargetCollider targetCollider)
+                {
+                    Vec2 tgtPos = targetPos.XY() + targetCollider.collider_.center_;
+                    if (IsIntersecting(Circle(projPos, tipCollider.radius_), Circle(tgtPos, targetCollider.collider_.radius_)))
+                    {
+                        shouldRemove = true;
+
+                        playerScore_[projectileComponent.shooterId_] += TARGET_DESTROY_SCORE;
+                        world_->DeleteEntity(target);
+                        world_->GetCommands().CreateEntity(TargetRespawnTimer{ targetPos, TARGET_COOLDOWN });
+                    }
                 }
             );
 
-            for (int i = 0; i < projectilesToRemove.Count(); ++i)
-                RemoveProjectile(projectilesToRemove[i]);
-        }
+            EcsWorld::Iter<const Entity_t, const Position, const ColliderComponent, const PlayerComponent>(world_.Get()).Each(
+                [this, &shouldRemove, projPos, &tipCollider = collider.collider_, projectileComponent]
+                (Entity_t playerEntity, Position playerPos, ColliderComponent playerCollider, const PlayerComponent& player)
+                {
+                    Box2D playerColliderWorld = playerCollider.collider_.Offset(playerPos.XY());
+                    if (player.playerId_ != projectileComponent.shooterId_ && IsIntersecting(playerColliderWorld, Circle(projPos, tipCollider.radius_)))
+                    {
+                        shouldRemove = true;
+
+                        playerScore_[projectileComponent.shooterId_] += PLAYER_KILL_SCORE;
+                        world_->DeleteEntity(playerEntity);
+                        world_->DeleteEntity(players_[player.playerId_].weaponEntity_);
+                        world_->GetCommands().CreateEntity(PlayerRespawnTimer{ player.playerId_, PLAYER_RESPAWN_TIME });
+                        players_[player.playerId_] = { NULL_ENTITY, NULL_ENTITY };
+                        LOG_DBG("Player %d killed by player %d, score: %d, %d", player.playerId_, projectileComponent.shooterId_, playerScore_[0], playerScore_[1]);
+                    }
+                }
+            );
 
-        // Collide projectiles
-        {
-            Array<Entity_t> toRemove;
-            Array<TargetRespawnTimer> toCreateTargetRespawn;
-            Array<PlayerRespawnTimer> toCreatePlayerRespawn;
-            EcsWorld::Iter<const Entity_t, Position, Rotation, TipCollider, SpriteComponent, const Projectile>(world_.Get()).Each(
-                [this, &toRemove, &toCreateTargetRespawn, &toCreatePlayerRespawn]
-                (Entity_t projectile, Position& position, Rotation& rotation, TipCollider& collider, SpriteComponent& sprite, Projectile projectileComponent)
+            EcsWorld::Iter<const ColliderComponent, const Position>(world_.Get()).EachExcept<PlayerComponent>(
+                [&shouldRemove, &tipCollider = collider.collider_, projPos]
+                (const ColliderComponent& collider, const Position& pos)
                 {
-                    Mat44 projectileTransform = MakeTransform(position, rotation.angle_, sprite.sprite_->pivot_);
-                    Vec2 projPos = projectileTransform.TransformPos(collider.collider_.center_);
-                    bool shouldRemove = false;
-
-                    EcsWorld::Iter<const Entity_t, const Position, const TargetCollider>(world_.Get()).Each(
-                        [this, &shouldRemove, &toRemove, &toCreateTargetRespawn, projPos, &tipCollider = collider.collider_, projectileComponent]
-                        (Entity_t target, Position targetPos, TargetCollider targetCollider)
-                        {
-                            Vec2 tgtPos = targetPos.XY() + targetCollider.collider_.center_;
-                            if (IsIntersecting(Circle(projPos, tipCollider.radius_), Circle(tgtPos, targetCollider.collider_.radius_)))
-                            {
-                                shouldRemove = true;
-
-                                playerScore_[projectileComponent.shooterId_] += TARGET_DESTROY_SCORE;
-                                toRemove.AddUnique(target);
-                                toCreateTargetRespawn.Add(TargetRespawnTimer{ targetPos, TARGET_COOLDOWN });
-                            }
-                        }
-                    );
-
-                    EcsWorld::Iter<const Entity_t, const Position, const ColliderComponent, const PlayerComponent>(world_.Get()).Each(
-                        [this, &shouldRemove, &toRemove, &toCreatePlayerRespawn, projPos, &tipCollider = collider.collider_, projectileComponent]
-                        (Entity_t playerEntity, Position playerPos, ColliderComponent playerCollider, const PlayerComponent& player)
-                        {
-                            Box2D playerColliderWorld = playerCollider.collider_.Offset(playerPos.XY());
-                            if (player.playerId_ != projectileComponent.shooterId_ && IsIntersecting(playerColliderWorld, Circle(projPos, tipCollider.radius_)))
-                            {
-                                shouldRemove = true;
-
-                                playerScore_[projectileComponent.shooterId_] += PLAYER_KILL_SCORE;
-                                toRemove.AddUnique(playerEntity);
-                                toRemove.AddUnique(players_[player.playerId_].weaponEntity_);
-                                toCreatePlayerRespawn.Add(PlayerRespawnTimer{ player.playerId_, PLAYER_RESPAWN_TIME });
-                                players_[player.playerId_] = { NULL_ENTITY, NULL_ENTITY };
-                                LOG_DBG("Player %d killed by player %d, score: %d, %d", player.playerId_, projectileComponent.shooterId_, playerScore_[0], playerScore_[1]);
-                            }
-                        }
-                    );
-
-                    EcsWorld::Iter<const ColliderComponent, const Position>(world_.Get()).EachExcept<PlayerComponent>(
-                        [&shouldRemove, &tipCollider = collider.collider_, projPos]
-                        (const ColliderComponent& collider, const Position& pos)
-                        {
-                            if (IsIntersecting(collider.collider_.Offset(pos.XY()), Circle(projPos, tipCollider.radius_)))
-                            {
-                                shouldRemove = true;
-                                return;
-                            }
-                        }
-                    );
-
-                    if (shouldRemove)
-                        toRemove.AddUnique(projectile);
+                    if (IsIntersecting(collider.collider_.Offset(pos.XY()), Circle(projPos, tipCollider.radius_)))
+                    {
+                        shouldRemove = true;
+                        return;
+                    }
                 }
             );
 
-            for (int i = 0; i < toRemove.Count(); ++i)
-                world_->DeleteEntity(toRemove[i]);
+            if (shouldRemove)
+                world_->DeleteEntity(projectile);
+        }
+    );
+}
 
-            for (const auto& targetRespawn : toCreateTargetRespawn)
-                world_->CreateEntity(targetRespawn);
+//------------------------------------------------------------------------------
+//! Spawns players whose respawn timer ran out, the new entities are needed right away so it is an exclusive system
+void Game::RespawnPlayers(float dTime)
+{
+    // Entities can't be created during iteration, the players are spawned once it ends
+    int respawnIds[MAX_PLAYERS];
+    int respawnCount = 0;
+    EcsWorld::Iter<const Entity_t, PlayerRespawnTimer>(world_.Get()).Each(
+        [this, dTime, &respawnIds, &respawnCount](Entity_t eid, PlayerRespawnTimer& timer)
+        {
+            timer.timeLeft_ -= dTime;
+            if (timer.timeLeft_ <= 0)
+            {
+                world_->DeleteEntity(eid);
+                HS_ASSERT(respawnCount < (int)MAX_PLAYERS);
+                respawnIds[respawnCount++] = timer.playerEntity_;
+            }
+        }
+    );
 
-            for (int i = 0; i < toCreatePlayerRespawn.Count(); ++i)
-                world_->CreateEntity(toCreatePlayerRespawn[i]);
+    for (int i = 0; i < respawnCount; ++i)
+        players_[respawnIds[i]] = RespawnPlayer(respawnIds[i]);
+}
+
+//------------------------------------------------------------------------------
+void Game::RespawnTargets(float dTime)
+{
+    EcsWorld::Iter<const Entity_t, TargetRespawnTimer>(world_.Get()).Each(
+        [this, dTime](Entity_t eid, TargetRespawnTimer& timer)
+        {
+            timer.timeLeft_ -= dTime;
+            if (timer.timeLeft_ <= 0)
+            {
+                world_->DeleteEntity(eid);
+                world_->GetCommands().CreateEntity(Position{ timer.position_ }, SpriteComponent{ &targetSprite_ }, TargetCollider{ Circle(targetSprite_.size_ / 2.0f, 8) });
+            }
         }
+    );
+}
+
+//------------------------------------------------------------------------------
+//! Advances the simulation by one frame, everything it reads from the outside comes in inputs so frames can be replayed
+void Game::SimulateFrame(const PlayerInput* inputs, float dTime)
+{
+    frameInputs_ = inputs;
+    frameDTime_ = dTime;
+
+    scheduler_->Run();
+}
+
+//------------------------------------------------------------------------------
+void Game::ResetRollback()
+{
+    for (RollbackFrame& frame : rollbackRing_)
+        frame.frame_ = -1;
+
+    loopback_.Clear();
+    lastRemoteInput_ = PlayerInput{};
+    lastRemoteFrame_ = -1;
+    rolledBackFrames_ = 0;
+    rollbackCostMs_ = 0;
+    maxRollbackCostMs_ = 0;
+}
+
+//------------------------------------------------------------------------------
+void Game::SaveRollbackFrame(RollbackFrame& frame)
+{
+    // Only chunks written since this slot was saved last time are copied
+    world_->SaveState(frame.world_);
+
+    memcpy(frame.players_, players_, sizeof(players_));
+    memcpy(frame.timeToShoot_, timeToShoot_, sizeof(timeToShoot_));
+    memcpy(frame.coyoteTimeRemaining_, coyoteTimeRemaining_, sizeof(coyoteTimeRemaining_));
+    memcpy(frame.playerScore_, playerScore_, sizeof(playerScore_));
+    memcpy(frame.isGrounded_, isGrounded_, sizeof(isGrounded_));
+    memcpy(frame.hasDoubleJumped_, hasDoubleJumped_, sizeof(hasDoubleJumped_));
+    frame.rngState_ = rngState_;
+}
+
+//------------------------------------------------------------------------------
+void Game::RestoreRollbackFrame(const RollbackFrame& frame)
+{
+    world_->RestoreState(frame.world_);
+
+    memcpy(players_, frame.players_, sizeof(players_));
+    memcpy(timeToShoot_, frame.timeToShoot_, sizeof(timeToShoot_));
+    memcpy(coyoteTimeRemaining_, frame.coyoteTimeRemaining_, sizeof(coyoteTimeRemaining_));
+    memcpy(playerScore_, frame.playerScore_, sizeof(playerScore_));
+    memcpy(isGrounded_, frame.isGrounded_, sizeof(isGrounded_));
+    memcpy(hasDoubleJumped_, frame.hasDoubleJumped_, sizeof(hasDoubleJumped_));
+    rngState_ = frame.rngState_;
+}
+
+//------------------------------------------------------------------------------
+//! Sends the last player's input through the loopback and replaces it with a prediction. When a received input differs
+//! from the one a saved frame was simulated with, the world goes back to that frame and the frames since are simulated again.
+void Game::RollbackRemoteInput(PlayerInput* inputs)
+{
+    const int remoteI = playerCount_ - 1;
+    loopback_.Send(frame_, inputs[remoteI]);
+
+    int firstWrongFrame = frame_;
+    int sentFrame;
+    PlayerInput remoteInput;
+    while (loopback_.Receive(frame_, sentFrame, remoteInput))
+    {
+        lastRemoteInput_ = remoteInput;
+        lastRemoteFrame_ = sentFrame;
+
+        RollbackFrame& frame = rollbackRing_[sentFrame % ROLLBACK_FRAMES];
+        if (frame.frame_ != sentFrame || IsSameInput(frame.inputs_[remoteI], remoteInput))
+            continue;
+
+        frame.inputs_[remoteI] = remoteInput;
+        firstWrongFrame = Min(firstWrongFrame, sentFrame);
     }
 
-    // Spawn players
+    // Until its input arrives the remote player is expected to keep doing what it did last
+    inputs[remoteI] = lastRemoteInput_;
+
+    if (firstWrongFrame == frame_)
+        return;
+
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    RestoreRollbackFrame(rollbackRing_[firstWrongFrame % ROLLBACK_FRAMES]);
+    for (int frameI = firstWrongFrame; frameI < frame_; ++frameI)
     {
-        Array<Entity_t> timersToRemove;
-        EcsWorld::Iter<const Entity_t, PlayerRespawnTimer>(world_.Get()).Each(
-            [this, dTime = GetDTime(), &timersToRemove](Entity_t eid, PlayerRespawnTimer& timer)
-            {
-                timer.timeLeft_ -= dTime;
-                if (timer.timeLeft_ <= 0)
-                {
-                    timersToRemove.Add(eid);
-                    players_[timer.playerEntity_] = RespawnPlayer(timer.playerEntity_);
-                }
-            }
-        );
+        RollbackFrame& frame = rollbackRing_[frameI % ROLLBACK_FRAMES];
+        if (frameI > firstWrongFrame)
+            SaveRollbackFrame(frame);
 
-        for (int i = 0; i < timersToRemove.Count(); ++i)
-            world_->DeleteEntity(timersToRemove[i]);
+        if (frameI > lastRemoteFrame_)
+            frame.inputs_[remoteI] = lastRemoteInput_;
+
+        SimulateFrame(frame.inputs_, frame.dTime_);
     }
 
-    // Spawn targets
+    const std::chrono::duration<float, std::milli> cost = std::chrono::high_resolution_clock::now() - start;
+    rolledBackFrames_ = frame_ - firstWrongFrame;
+    rollbackCostMs_ = cost.count();
+    maxRollbackCostMs_ = Max(maxRollbackCostMs_, rollbackCostMs_);
+}
+
+//------------------------------------------------------------------------------
+void Game::Update()
+{
+    // Transient arrays of the previous frame are dead
+    frameArena_.Reset();
+
+    const int64 heapAllocationsAtStart = GetHeapAllocationCount();
+
+    // Audio
+    if (!muteAudio_ && SDL_GetQueuedAudioSize(audioDevice_) < 2 * musicLength_)
     {
-        Array<Entity_t> timersToRemove;
-        EcsWorld::Iter<const Entity_t, TargetRespawnTimer>(world_.Get()).Each(
-            [this, dTime = GetDTime(), &timersToRemove](Entity_t eid, TargetRespawnTimer& timer)
+        if (SDL_QueueAudio(audioDevice_, musicBuffer_, musicLength_) != 0)
+        {
+            LOG_ERR("Failed to queue audio %s", SDL_GetError());
+            SDL_ClearError();
+        }
+    }
+
+    // Debug
+    if (g_Input->IsKeyDown(KC_C))
+    {
+        visualizeColliders_ = !visualizeColliders_;
+    }
+
+    ImGui::Begin("Score");
+        for (int playerI = 0; playerI < playerCount_; ++playerI)
+        {
+            ImGui::Text("Player %d: %d", playerI, playerScore_[playerI]);
+        }
+    ImGui::End();
+
+    // Player menu
+    int newPlayerCount = playerCount_;
+    ImGui::Begin("Players");
+        ImGui::InputInt("Player count", &newPlayerCount);
+        newPlayerCount = Clamp((uint)newPlayerCount, 1u, MAX_PLAYERS);
+
+        for (int playerI = 0; playerI < playerCount_; ++playerI)
+        {
+            ImGui::Text("Player %d input", playerI);
+            for (int gamepadI = 0; gamepadI < GLFW_JOYSTICK_LAST; ++gamepadI)
             {
-                timer.timeLeft_ -= dTime;
-                if (timer.timeLeft_ <= 0)
+                if (g_Input->IsGamepadConnected(gamepadI))
                 {
-                    timersToRemove.Add(eid);
-                    world_->CreateEntity(Position{ timer.position_ }, SpriteComponent{ &targetSprite_ }, TargetCollider{ Circle(targetSprite_.size_ / 2.0f, 8) });
+                    char buff[128];
+                    sprintf(buff, "P%d Gamepad %d", playerI, gamepadI);
+                    ImGui::RadioButton(buff, &gamepadForPlayer_[playerI], gamepadI);
                 }
             }
-        );
+        }
+    ImGui::End();
+
+    if (playerCount_ < newPlayerCount)
+    {
+        // Saved frames have a different set of players
+        ResetRollback();
+    }
+
+    while (playerCount_ < newPlayerCount)
+    {
+        SpawnPlayer();
+    }
+
+    bool isRollbackTest = isRollbackTest_;
+    int loopbackDelay = loopback_.GetDelay();
+    ImGui::Begin("Rollback");
+        ImGui::Checkbox("Loopback last player", &isRollbackTest);
+        ImGui::SliderInt("Delay frames", &loopbackDelay, 0, ROLLBACK_FRAMES - 1);
+        ImGui::Text("Rolled back frames: %d", rolledBackFrames_);
+        ImGui::Text("Rollback cost: %.3f ms, max %.3f ms", rollbackCostMs_, maxRollbackCostMs_);
+    ImGui::End();
+
+    if (isRollbackTest != isRollbackTest_ || loopbackDelay != loopback_.GetDelay())
+    {
+        isRollbackTest_ = isRollbackTest;
+        loopback_.SetDelay(loopbackDelay);
+        ResetRollback();
+    }
+
+    float aimDeadzone = 0.2f;
+    ImGui::Begin("Settings");
+        ImGui::SliderFloat("Aim deadzone", &aimDeadzone, 0.0f, 1.0f);
+        ImGui::SliderFloat("Projectile speed", &projectileSpeed, 0.0f, 500.0f);
+        ImGui::SliderFloat("Time scale", &timeScale_, 0.0f, 4.0f);
+        ImGui::Text("Frame arena peak: %.1f KB of %.1f KB", frameArena_.GetPeakBytes() / 1024.0f, frameArena_.GetCapacity() / 1024.0f);
+        if (HS_COUNT_HEAP_ALLOCATIONS)
+            ImGui::Text("Heap allocations last frame: %lld", (long long)frameHeapAllocations_);
+    ImGui::End();
+
+    UpdateEcsStats();
+
+    // Input
+    PlayerInput inputs[MAX_PLAYERS]{};
+    for (int playerI = 0; playerI < playerCount_; ++playerI)
+        inputs[playerI] = GatherInput(playerI, aimDeadzone);
+
+    const float dTime = GetDTime();
+    if (isRollbackTest_)
+    {
+        RollbackRemoteInput(inputs);
+
+        RollbackFrame& frame = rollbackRing_[frame_ % ROLLBACK_FRAMES];
+        SaveRollbackFrame(frame);
+        memcpy(frame.inputs_, inputs, sizeof(inputs));
+        frame.dTime_ = dTime;
+        frame.frame_ = frame_;
+    }
+
+    SimulateFrame(inputs, dTime);
+    ++frame_;
+
+    for (int playerI = 0; playerI < playerCount_; ++playerI)
+    {
+        if (players_[playerI].playerEntity_ == NULL_ENTITY)
+            continue;
+
+        const Vec2& velocity = world_->GetComponent<const Velocity>(players_[playerI].playerEntity_);
 
-        for (int i = 0; i < timersToRemove.Count(); ++i)
-            world_->DeleteEntity(timersToRemove[i]);
+        static Vec2 maxPlayerVelocity(Vec2::ZERO());
+        static Vec2 minPlayerVelocity(Vec2::ZERO());
+        maxPlayerVelocity.x = Max(maxPlayerVelocity.x, velocity.x);
+        maxPlayerVelocity.y = Max(maxPlayerVelocity.y, velocity.y);
+        minPlayerVelocity.x = Min(minPlayerVelocity.x, velocity.x);
+        minPlayerVelocity.y = Min(minPlayerVelocity.y, velocity.y);
+
+        ImGui::Text("IsGrounded %d", isGrounded_[0]);
+        ImGui::Text("Cur player %d velocity: [%.2f, %.2f]", playerI, velocity.x, velocity.y);
+        ImGui::Text("Max player %d velocity: [%.2f, %.2f]", playerI, maxPlayerVelocity.x, maxPlayerVelocity.y);
+        ImGui::Text("Min player %d velocity: [%.2f, %.2f]", playerI, minPlayerVelocity.x, minPlayerVelocity.y);
     }
 
-    AnimateSprites();
+    EcsWorld::Iter<const Velocity, const Projectile>(world_.Get()).Each(
+        [](const Velocity& velocity, const Projectile)
+        {
+            ImGui::Text("Projectile velocity: [%.2f, %.2f]", velocity.x, velocity.y);
+        }
+    );
+
+    // Cache transforms of rotated sprites, only chunks where something moved or turned are recomputed
+    EcsWorld::Iter<Transform, const Position, const Rotation, const SpriteComponent>(world_.Get()).EachChanged<Position, Rotation>(
+        [](Transform& transform, const Position& position, const Rotation rotation, const SpriteComponent sprite)
+        {
+            transform.matrix_ = MakeTransform(position, rotation.angle_, sprite.sprite_->pivot_);
+        }
+    );
 
     // Draw calls
     SpriteRenderer* sr = g_Render->GetSpriteRenderer();
 
     sr->ClearSprites();
 
-    // Regular tiles
+    // Sprites are submitted grouped by texture and then by depth, only archetypes which got out of order are reordered
+    world_->SortRows<const SpriteComponent, const Position>(
+        [](const SpriteComponent sprite, const Position& position)
+        {
+            return std::make_pair((uintptr_t)sprite.sprite_->texture_, position.z);
+        }
+    );
+
+    // Map tiles, every archetype has a single sprite so whole chunks are submitted with it
+    world_->SortRows<const StaticSpriteComponent, const Position>(
+        [](const StaticSpriteComponent&, const Position& position)
+        {
+            return position.z;
+        }
+    );
+    EcsWorld::Iter<const StaticSpriteComponent, const Position>(world_.Get()).EachChunk(
+        [sr](const StaticSpriteComponent& sprite, Span<const Position> positions)
+        {
+            for (const Position& position : positions)
+                sr->AddSprite(sprite.sprite_, Mat44::Translation(position));
+        }
+    );
+
+    // Regular sprites
     EcsWorld::Iter<const SpriteComponent, const Position>(world_.Get()).EachExcept<Rotation>(
         [sr](const SpriteComponent sprite, const Position& position)
         {
@@ -1227,18 +1589,10 @@ void Game::Update()
     );
 
     // Projectiles
-    EcsWorld::Iter<const SpriteComponent, const Position, const Rotation>(world_.Get()).Each(
-        [sr](const SpriteComponent sprite, const Position& position, const Rotation rotation)
+    EcsWorld::Iter<const SpriteComponent, const Transform>(world_.Get()).Each(
+        [sr](const SpriteComponent sprite, const Transform& transform)
         {
-            sr->AddSprite(
-                sprite.sprite_,
-                // TODO(pavel): With ECS we should calculate the transform once during update and save it to entity and just read it here and in collider drawing, physics etc.
-                MakeTransform(
-                    position,
-                    rotation.angle_,
-                    sprite.sprite_->pivot_
-                )
-            );
+            sr->AddSprite(sprite.sprite_, transform.matrix_);
         }
     );
 
@@ -1246,6 +1600,17 @@ void Game::Update()
 
     // TODO(pavel): 0,0 for UI top left or bottom left?
     g_Render->GetGuiRenderer()->AddText(font_.Get(), StringView("HELLO"), Vec2(100, 200));
+
+    // Buffers grow to their working size during the warm-up, after it a frame must not allocate at all
+    frameHeapAllocations_ = GetHeapAllocationCount() - heapAllocationsAtStart;
+    if (heapWarmupFrames_ > 0)
+    {
+        --heapWarmupFrames_;
+    }
+    else
+    {
+        HS_ASSERT(frameHeapAllocations_ == 0 && "A frame allocated from the heap after the warm-up");
+    }
 }
 
 }
@@ -0,0 +1,105 @@
+#include "Game/HeapCounter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#if HS_COUNT_HEAP_ALLOCATIONS && defined(_MSC_VER) && defined(_DEBUG)
+    #include <crtdbg.h>
+#endif
+
+namespace hs
+{
+
+#if HS_COUNT_HEAP_ALLOCATIONS
+namespace internal
+{
+// Zero initialized before any dynamic initialization, allocations of static constructors are counted too
+static std::atomic<int64> g_HeapAllocationCount{ 0 };
+
+//------------------------------------------------------------------------------
+static void CountHeapAllocation()
+{
+    g_HeapAllocationCount.fetch_add(1, std::memory_order_relaxed);
+}
+}
+#endif
+
+//------------------------------------------------------------------------------
+int64 GetHeapAllocationCount()
+{
+    #if HS_COUNT_HEAP_ALLOCATIONS
+        return internal::g_HeapAllocationCount.load(std::memory_order_relaxed);
+    #else
+        return 0;
+    #endif
+}
+
+}
+
+#if HS_COUNT_HEAP_ALLOCATIONS
+    #if defined(_MSC_VER) && defined(_DEBUG)
+        // The debug runtime reports malloc, realloc and operator new to one hook
+        namespace hs::internal
+        {
+        //------------------------------------------------------------------------------
+        static int HeapAllocationHook(int allocType, void*, size_t, int blockType, long, const unsigned char*, int)
+        {
+            // Blocks of the runtime itself are not ours, the hook must not call into the runtime for them either
+            if (blockType != _CRT_BLOCK && (allocType == _HOOK_ALLOC || allocType == _HOOK_REALLOC))
+                CountHeapAllocation();
+            return TRUE;
+        }
+
+        //------------------------------------------------------------------------------
+        static const _CRT_ALLOC_HOOK g_PrevHeapAllocationHook = _CrtSetAllocHook(HeapAllocationHook);
+        }
+    #else
+        // Replacements of the global operator new, the array and nothrow forms of the standard library call these.
+        // malloc is not seen.
+
+        //------------------------------------------------------------------------------
+        void* operator new(std::size_t size)
+        {
+            hs::internal::CountHeapAllocation();
+            if (void* ptr = malloc(size ? size : 1))
+                return ptr;
+            throw std::bad_alloc();
+        }
+
+        //------------------------------------------------------------------------------
+        void operator delete(void* ptr) noexcept
+        {
+            free(ptr);
+        }
+
+        //------------------------------------------------------------------------------
+        void operator delete(void* ptr, std::size_t) noexcept
+        {
+            free(ptr);
+        }
+
+        //------------------------------------------------------------------------------
+        void* operator new(std::size_t size, std::align_val_t alignment)
+        {
+            hs::internal::CountHeapAllocation();
+            // aligned_alloc needs the size to be a multiple of the alignment
+            const size_t align = (size_t)alignment;
+            if (void* ptr = aligned_alloc(align, ((size ? size : 1) + align - 1) & ~(align - 1)))
+                return ptr;
+            throw std::bad_alloc();
+        }
+
+        //------------------------------------------------------------------------------
+        void operator delete(void* ptr, std::align_val_t) noexcept
+        {
+            free(ptr);
+        }
+
+        //------------------------------------------------------------------------------
+        void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept
+        {
+            free(ptr);
+        }
+    #endif
+#endif